@@ -0,0 +1,320 @@
+#include <new>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "json.h"
+#include "msgpack.h"
+#include "protocol.h"
+#include "thread_pool.h"
+
+
+namespace {
+
+size_t allocCount = 0;
+
+enum class TextKind {
+    Ascii,
+    Unicode,
+};
+
+struct Result {
+    double seconds;
+    double allocs;
+};
+
+static const char* TextKindName(TextKind kind) {
+    return (kind == TextKind::Ascii) ? "ascii" : "unicode";
+}
+
+static std::string MakeText(TextKind kind, size_t index) {
+    if (kind == TextKind::Ascii) {
+        return "Application name number " + std::to_string(index) + " with some words";
+    }
+
+    return "应用程序 " + std::to_string(index) + " 名前 🚀 検索 ✨ 데이터 \"ёжик\"";
+}
+
+static void AppendJsonString(std::string& out, const std::string& value) {
+    out.push_back('\"');
+    for (char ch: value) {
+        if ((ch == '\"') || (ch == '\\')) {
+            out.push_back('\\');
+        }
+        out.push_back(ch);
+    }
+    out.push_back('\"');
+}
+
+static std::string MakeJsonLines(size_t count, TextKind kind, bool decorated) {
+    std::string result = "{\"lines\": [";
+    for (size_t i=0; i!=count; ++i) {
+        if (i != 0) {
+            result += ", ";
+        }
+        result += "{\"id\": \"" + std::to_string(i) + "\", \"text\": ";
+        AppendJsonString(result, MakeText(kind, i));
+        result += ", \"group\": \"apps\"";
+        if (decorated) {
+            result += ", \"icon\": \"applications-internet\", \"markup\": true, \"urgent\": false";
+        }
+        result += "}";
+    }
+    result += "]}";
+
+    return result;
+}
+
+static std::string MakeMsgPackLines(size_t count, TextKind kind, bool decorated) {
+    MsgPackWriter writer;
+    writer.Object(1);
+    writer.String("lines");
+    std::string result(writer.Data());
+    const char arrayHeader[5] = {
+        static_cast<char>(0xdd), static_cast<char>(count >> 24), static_cast<char>(count >> 16),
+        static_cast<char>(count >> 8), static_cast<char>(count)};
+    result.append(arrayHeader, sizeof(arrayHeader));
+
+    for (size_t i=0; i!=count; ++i) {
+        writer.Clear();
+        writer.Object(decorated ? 6 : 3);
+        writer.String("id");
+        writer.String(std::to_string(i));
+        writer.String("text");
+        writer.String(MakeText(kind, i));
+        writer.String("group");
+        writer.String("apps");
+        if (decorated) {
+            writer.String("icon");
+            writer.String("applications-internet");
+            writer.String("markup");
+            writer.Bool(true);
+            writer.String("urgent");
+            writer.Bool(false);
+        }
+        result.append(writer.Data());
+    }
+
+    return result;
+}
+
+// Run prepare() and fn() repeatedly, only fn() is measured, the first run is a warm up
+template <typename Prepare, typename Fn> Result Measure(const Prepare& prepare, const Fn& fn) {
+    using clock = std::chrono::steady_clock;
+    static constexpr double MIN_TIME = 0.3;
+    static constexpr size_t MAX_ITERATIONS = 1000;
+
+    prepare();
+    fn();
+
+    double seconds = 0;
+    size_t allocs = 0;
+    size_t iterations = 0;
+    while ((iterations == 0) || ((seconds < MIN_TIME) && (iterations < MAX_ITERATIONS))) {
+        prepare();
+        size_t allocsBefore = allocCount;
+        auto start = clock::now();
+        fn();
+        seconds += std::chrono::duration<double>(clock::now() - start).count();
+        allocs += allocCount - allocsBefore;
+        ++iterations;
+    }
+
+    return Result{seconds / static_cast<double>(iterations), static_cast<double>(allocs) / static_cast<double>(iterations)};
+}
+
+static void Report(const std::string& name, const Result& result, size_t bytes, size_t lines) {
+    printf("%-54s %10.1f MB/s %10.1f ns/line %10.1f allocs/msg\n",
+        name.c_str(),
+        static_cast<double>(bytes) / result.seconds / 1e6,
+        result.seconds * 1e9 / static_cast<double>(lines),
+        result.allocs);
+}
+
+static void BenchParse(size_t count, TextKind kind, bool decorated) {
+    std::string suffix = std::to_string(count) + " " + TextKindName(kind) + (decorated ? " icon+markup" : "");
+    std::string payload = MakeJsonLines(count, kind, decorated);
+    std::string binaryPayload = MakeMsgPackLines(count, kind, decorated);
+    std::string buffer;
+    buffer.reserve(std::max(payload.size(), binaryPayload.size()));
+
+    Json json;
+    auto copyJson = [&buffer, &payload]() {
+        buffer.assign(payload);
+    };
+    Report("Json::Parse " + suffix,
+        Measure(copyJson, [&json, &buffer]() { json.Parse(buffer.data(), buffer.size()); }),
+        payload.size(), count);
+
+    Protocol protocol;
+    Report("Protocol::ParseRequest json " + suffix,
+        Measure(copyJson, [&protocol, &buffer]() { protocol.ParseRequest(buffer.data(), buffer.size(), 0); }),
+        payload.size(), count);
+
+    Protocol binaryProtocol;
+    binaryProtocol.SetFormat(MessageFormat::MsgPack);
+    auto copyBinary = [&buffer, &binaryPayload]() {
+        buffer.assign(binaryPayload);
+    };
+    Report("Protocol::ParseRequest binary " + suffix,
+        Measure(copyBinary, [&binaryProtocol, &buffer]() { binaryProtocol.ParseRequest(buffer.data(), buffer.size(), 0); }),
+        binaryPayload.size(), count);
+}
+
+static void BenchWriter(size_t count, TextKind kind) {
+    std::vector<std::string> texts;
+    size_t bytes = 0;
+    for (size_t i=0; i!=count; ++i) {
+        texts.push_back(MakeText(kind, i));
+        bytes += texts.back().size();
+    }
+
+    JsonWriter writer;
+    auto clear = [&writer]() {
+        writer.Clear();
+    };
+    Report(std::string("JsonWriter::String ") + TextKindName(kind),
+        Measure(clear, [&writer, &texts]() {
+            for (const auto& text: texts) {
+                writer.String(text);
+            }
+        }),
+        bytes, count);
+}
+
+static void BenchMessages(MessageFormat format, TextKind kind) {
+    static constexpr size_t COUNT = 100000;
+    std::string suffix = std::string((format == MessageFormat::Json) ? " json " : " binary ") + TextKindName(kind);
+    std::string text = MakeText(kind, 42);
+    Line line;
+    line.id = "42";
+    line.text = text;
+    line.group = "apps";
+
+    Protocol protocol;
+    protocol.SetFormat(format);
+    auto none = []() {};
+    size_t bytes = 0;
+    auto run = [&bytes](const auto& create) {
+        return [&bytes, &create]() {
+            bytes = 0;
+            for (size_t i=0; i!=COUNT; ++i) {
+                bytes += create().size();
+            }
+        };
+    };
+
+    auto input = [&protocol, &text]() { return protocol.CreateMessageInput(text.c_str(), 1); };
+    auto result = Measure(none, run(input));
+    Report("CreateMessageInput" + suffix, Result{result.seconds, result.allocs / COUNT}, bytes, COUNT);
+
+    auto selectLine = [&protocol, &line]() { return protocol.CreateMessageSelectLine(line); };
+    result = Measure(none, run(selectLine));
+    Report("CreateMessageSelectLine" + suffix, Result{result.seconds, result.allocs / COUNT}, bytes, COUNT);
+
+    auto keyPress = [&protocol, &line]() { return protocol.CreateMessageKeyPress(line, "custom_1"); };
+    result = Measure(none, run(keyPress));
+    Report("CreateMessageKeyPress" + suffix, Result{result.seconds, result.allocs / COUNT}, bytes, COUNT);
+}
+
+static void BenchParallelMatch(size_t count) {
+    // strstr stands in for the token matching of rofi, the chunk size is the one of FilterCache
+    static constexpr size_t CHUNK_SIZE = 4096;
+    std::vector<std::string> texts;
+    size_t bytes = 0;
+    for (size_t i=0; i!=count; ++i) {
+        texts.push_back(MakeText(TextKind::Ascii, i));
+        bytes += texts.back().size();
+    }
+    std::vector<uint8_t> results(count);
+
+    size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    double baseSeconds = 0;
+    for (size_t threads=1; threads<=maxThreads; ++threads) {
+        ThreadPool pool(threads);
+        auto none = []() {};
+        auto result = Measure(none, [&pool, &texts, &results]() {
+            pool.ParallelFor(texts.size(), CHUNK_SIZE, [&texts, &results](size_t begin, size_t end) {
+                for (size_t i=begin; i!=end; ++i) {
+                    results[i] = (strstr(texts[i].c_str(), "number 42") != nullptr) ? 1 : 0;
+                }
+            });
+        });
+        if (threads == 1) {
+            baseSeconds = result.seconds;
+        }
+        Report("ThreadPool::ParallelFor match " + std::to_string(count) + ", threads " + std::to_string(threads),
+            result, bytes, count);
+        printf("%-54s %10.2fx\n", "  speedup", baseSeconds / result.seconds);
+    }
+}
+
+}
+
+void* operator new(size_t size) {
+    ++allocCount;
+    if (void* ptr = malloc(size); ptr != nullptr) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept {
+    free(ptr);
+}
+
+// Usage: rofi_proxy_bench [max_lines], max_lines is 1000000 by default
+int main(int argc, char** argv) {
+    size_t maxLines = 1000000;
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [max_lines]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1) {
+        // strtoul accepts a sign and wraps negative numbers
+        char* end = nullptr;
+        const char* arg = argv[1];
+        unsigned long value = strtoul(arg, &end, 10);
+        if ((end == arg) || (*end != '\0') || (arg[0] == '-') || (value == 0)) {
+            fprintf(stderr, "invalid value \"%s\" of max_lines, expected a positive number\nusage: %s [max_lines]\n", arg, argv[0]);
+            return 1;
+        }
+        maxLines = value;
+    }
+
+    printf("Parsing, ns/line is per line of the request, allocs/msg are per request\n");
+    for (size_t count: {size_t(10), size_t(1000), size_t(100000), size_t(1000000)}) {
+        if (count > maxLines) {
+            break;
+        }
+        for (auto kind: {TextKind::Ascii, TextKind::Unicode}) {
+            BenchParse(count, kind, false);
+            BenchParse(count, kind, true);
+        }
+    }
+
+    printf("\nWriting, ns/line is per string, allocs/msg are per all strings\n");
+    BenchWriter(std::min(maxLines, size_t(100000)), TextKind::Ascii);
+    BenchWriter(std::min(maxLines, size_t(100000)), TextKind::Unicode);
+
+    printf("\nOutgoing messages, ns/line and allocs/msg are per message\n");
+    for (auto format: {MessageFormat::Json, MessageFormat::MsgPack}) {
+        for (auto kind: {TextKind::Ascii, TextKind::Unicode}) {
+            BenchMessages(format, kind);
+        }
+    }
+
+    printf("\nMatching all lines on the thread pool, ns/line is per line\n");
+    BenchParallelMatch(maxLines);
+
+    return 0;
+}
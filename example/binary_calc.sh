@@ -0,0 +1,4 @@
+#!/bin/sh
+
+dir=`dirname "$(readlink -f "$0")"`
+rofi -modi proxy -show proxy -proxy-log -proxy-protocol binary -proxy-cmd "$dir/binary_calc.py"
@@ -0,0 +1,35 @@
+#!/bin/python
+
+# A backend that stays running between rofi launches and serves many rofi
+# instances at once. rofi connects to the socket from "-proxy-socket" and
+# starts this script with "-proxy-cmd" only if nobody listens on the socket.
+
+import os
+import socketserver
+
+from rofi_proxy import read_messages, write_message
+
+
+SOCKET_PATH = os.environ["ROFI_PROXY_SOCKET"]
+
+# Loaded once for all sessions, it is the expensive part of the startup
+WORDS = ["word number {}".format(i) for i in range(100000)]
+
+
+class Session(socketserver.StreamRequestHandler):
+    def handle(self):
+        session = None
+        for msg in read_messages(self.rfile):
+            if msg["name"] == "hello":
+                session = msg["value"]["session"]
+            elif msg["name"] == "input":
+                text = msg["value"]
+                lines = [{"text": word} for word in WORDS if text in word][:100]
+                lines.insert(0, {"text": "session " + session, "filtering": False})
+                write_message({"lines": lines, "in_reply_to": msg["seq"]}, self.wfile)
+
+
+if os.path.exists(SOCKET_PATH):
+    os.unlink(SOCKET_PATH)
+with socketserver.ThreadingUnixStreamServer(SOCKET_PATH, Session) as server:
+    server.serve_forever()
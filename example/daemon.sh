@@ -0,0 +1,5 @@
+#!/bin/sh
+
+dir=`dirname "$(readlink -f "$0")"`
+socket="${XDG_RUNTIME_DIR:-/tmp}/rofi_proxy_example.sock"
+rofi -modi proxy -show proxy -proxy-log -proxy-socket "$socket" -proxy-cmd "$dir/daemon.py"
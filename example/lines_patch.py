@@ -0,0 +1,35 @@
+#!/bin/python
+
+import sys
+import json
+import time
+import threading
+
+
+def send(req):
+    sys.stdout.write(json.dumps(req) + "\n")
+    sys.stdout.flush()
+
+
+def tick():
+    counter = 0
+    while True:
+        time.sleep(1)
+        counter += 1
+        send({"lines_patch": [
+            {"op": "update", "id": "counter", "line": {"text": "counter: {}".format(counter), "filtering": False}},
+        ]})
+
+
+send({"lines": [{"id": "counter", "text": "counter: 0", "filtering": False}] +
+               [{"id": str(i), "text": "line {}".format(i)} for i in range(10000)]})
+threading.Thread(target=tick, daemon=True).start()
+
+for line in sys.stdin:
+    j = json.loads(line)
+    if j["name"] == "select_custom_input":
+        send({"lines_patch": [{"op": "insert", "index": 1, "line": {"id": j["value"], "text": j["value"]}}]})
+    elif j["name"] == "delete_line":
+        send({"lines_patch": [{"op": "remove", "id": j["value"]["id"]}]})
+    elif j["name"] == "select_line":
+        send({"lines_patch": [{"op": "move", "id": j["value"]["id"], "index": 1}]})
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+dir=`dirname "$(readlink -f "$0")"`
+rofi -modi proxy -show proxy -proxy-log -proxy-cmd "$dir/lines_patch.py"
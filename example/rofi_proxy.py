@@ -0,0 +1,182 @@
+# Helpers for reading and writing rofi-proxy messages in both formats.
+# The format is selected by rofi with the "-proxy-protocol" option and passed
+# to the application in the ROFI_PROXY_PROTOCOL environment variable:
+# - "json" (default): single-line json messages separated by new line symbol
+# - "binary": MessagePack messages, each prefixed with its size as 4 bytes big-endian
+
+import os
+import sys
+import json
+import struct
+
+
+BINARY = os.environ.get("ROFI_PROXY_PROTOCOL", "json") == "binary"
+
+
+def pack(obj):
+    out = bytearray()
+    _pack(obj, out)
+    return bytes(out)
+
+
+def _pack(obj, out):
+    if obj is None:
+        out.append(0xc0)
+    elif obj is True:
+        out.append(0xc3)
+    elif obj is False:
+        out.append(0xc2)
+    elif isinstance(obj, int):
+        if 0 <= obj <= 0x7f:
+            out.append(obj)
+        elif 0 <= obj <= 0xffffffff:
+            out += struct.pack(">BI", 0xce, obj)
+        elif 0 <= obj:
+            out += struct.pack(">BQ", 0xcf, obj)
+        else:
+            out += struct.pack(">Bq", 0xd3, obj)
+    elif isinstance(obj, (str, bytes)):
+        data = obj.encode("utf-8") if isinstance(obj, str) else obj
+        if len(data) < 32:
+            out.append(0xa0 | len(data))
+        elif len(data) <= 0xff:
+            out += struct.pack(">BB", 0xd9, len(data))
+        elif len(data) <= 0xffff:
+            out += struct.pack(">BH", 0xda, len(data))
+        else:
+            out += struct.pack(">BI", 0xdb, len(data))
+        out += data
+    elif isinstance(obj, (list, tuple)):
+        if len(obj) < 16:
+            out.append(0x90 | len(obj))
+        else:
+            out += struct.pack(">BI", 0xdd, len(obj))
+        for item in obj:
+            _pack(item, out)
+    elif isinstance(obj, dict):
+        if len(obj) < 16:
+            out.append(0x80 | len(obj))
+        else:
+            out += struct.pack(">BI", 0xdf, len(obj))
+        for key, value in obj.items():
+            _pack(key, out)
+            _pack(value, out)
+    else:
+        raise TypeError("unsupported type {}".format(type(obj)))
+
+
+def unpack(data):
+    obj, pos = _unpack(data, 0)
+    if pos != len(data):
+        raise ValueError("extra bytes after MessagePack object")
+    return obj
+
+
+def _unpack(data, pos):
+    t = data[pos]
+    pos += 1
+    if t <= 0x7f:
+        return t, pos
+    if t >= 0xe0:
+        return t - 0x100, pos
+    if t & 0xe0 == 0xa0:
+        return _str(data, pos, t & 0x1f)
+    if t & 0xf0 == 0x90:
+        return _array(data, pos, t & 0x0f)
+    if t & 0xf0 == 0x80:
+        return _map(data, pos, t & 0x0f)
+    if t == 0xc0:
+        return None, pos
+    if t == 0xc2:
+        return False, pos
+    if t == 0xc3:
+        return True, pos
+    ints = {0xcc: ">B", 0xcd: ">H", 0xce: ">I", 0xcf: ">Q", 0xd0: ">b", 0xd1: ">h", 0xd2: ">i", 0xd3: ">q"}
+    if t in ints:
+        fmt = ints[t]
+        return struct.unpack_from(fmt, data, pos)[0], pos + struct.calcsize(fmt)
+    sizes = {0xd9: ">B", 0xda: ">H", 0xdb: ">I", 0xc4: ">B", 0xc5: ">H", 0xc6: ">I",
+             0xdc: ">H", 0xdd: ">I", 0xde: ">H", 0xdf: ">I"}
+    if t in sizes:
+        fmt = sizes[t]
+        size = struct.unpack_from(fmt, data, pos)[0]
+        pos += struct.calcsize(fmt)
+        if t in (0xdc, 0xdd):
+            return _array(data, pos, size)
+        if t in (0xde, 0xdf):
+            return _map(data, pos, size)
+        if t in (0xc4, 0xc5, 0xc6):
+            return bytes(data[pos:pos + size]), pos + size
+        return _str(data, pos, size)
+    raise ValueError("unsupported MessagePack type 0x{:02x}".format(t))
+
+
+def _str(data, pos, size):
+    return bytes(data[pos:pos + size]).decode("utf-8"), pos + size
+
+
+def _array(data, pos, size):
+    result = []
+    for _ in range(size):
+        item, pos = _unpack(data, pos)
+        result.append(item)
+    return result, pos
+
+
+def _map(data, pos, size):
+    result = {}
+    for _ in range(size):
+        key, pos = _unpack(data, pos)
+        result[key], pos = _unpack(data, pos)
+    return result, pos
+
+
+def read_messages(stream=sys.stdin.buffer):
+    """Yield messages from rofi-proxy until the stream is closed"""
+    if not BINARY:
+        for line in stream:
+            if line.strip():
+                yield json.loads(line)
+        return
+
+    while True:
+        header = stream.read(4)
+        if len(header) < 4:
+            return
+        size = struct.unpack(">I", header)[0]
+        yield unpack(stream.read(size))
+
+
+def write_message(obj, stream=sys.stdout.buffer):
+    if BINARY:
+        data = pack(obj)
+        stream.write(struct.pack(">I", len(data)) + data)
+    else:
+        stream.write(json.dumps(obj).encode("utf-8") + b"\n")
+    stream.flush()
+
+
+class SharedLines:
+    """Writes "lines" to the memory shared by rofi with the "-proxy-shm" option,
+    only a small "lines_shm" reference is sent through the pipe"""
+
+    def __init__(self, fd=None):
+        self.fd = int(os.environ["ROFI_PROXY_SHM_FD"]) if fd is None else fd
+        self.generation = 0
+        # End of the region by generation, rofi can read the region until it is released
+        self.busy = {}
+
+    def write(self, lines):
+        """Write lines and return the value for the "lines_shm" key of a message"""
+        data = pack(lines)
+        offset = max(self.busy.values(), default=0)
+        if os.fstat(self.fd).st_size < offset + len(data):
+            os.ftruncate(self.fd, offset + len(data))
+        os.pwrite(self.fd, data, offset)
+        self.generation += 1
+        self.busy[self.generation] = offset + len(data)
+        return {"generation": self.generation, "offset": offset, "length": len(data)}
+
+    def release(self, generation):
+        """Call on the "lines_shm_release" message"""
+        self.busy.pop(generation, None)
@@ -0,0 +1,16 @@
+#!/bin/python
+
+# Big lists are written to the memory shared with rofi ("-proxy-shm"),
+# only the small "lines_shm" reference goes through the pipe.
+
+from rofi_proxy import SharedLines, read_messages, write_message
+
+
+shared = SharedLines()
+for msg in read_messages():
+    if msg["name"] == "lines_shm_release":
+        shared.release(msg["value"])
+    elif msg["name"] == "input":
+        text = msg["value"]
+        lines = [{"text": "line {} for '{}'".format(i, text)} for i in range(100000)]
+        write_message({"lines_shm": shared.write(lines), "in_reply_to": msg["seq"]})
@@ -11,7 +11,7 @@ for line in sys.stdin:
 
     try:
         answer = str(eval(j["value"]))
-        req = {"lines": [{"text": answer, "filtering": False}]}
+        req = {"lines": [{"text": answer, "filtering": False}], "in_reply_to": j["seq"]}
         sys.stdout.write(json.dumps(req) + "\n")
         sys.stdout.flush()
     except Exception:
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+
+
+// Sequence kept in chunks of up to twice ChunkSize elements: an insert or an erase at any position
+// moves O(ChunkSize + number of chunks) elements instead of the tail of the whole sequence.
+// A position is found by a scan of the chunk sizes.
+template <typename T, size_t ChunkSize = 512> class ChunkedVector final {
+public:
+    ChunkedVector() = default;
+    explicit ChunkedVector(const std::vector<T>& values) {
+        m_chunks.reserve(values.size() / ChunkSize + 1);
+        for (size_t begin=0; begin < values.size(); begin += ChunkSize) {
+            size_t end = std::min(begin + ChunkSize, values.size());
+            m_chunks.emplace_back(values.begin() + static_cast<ptrdiff_t>(begin), values.begin() + static_cast<ptrdiff_t>(end));
+        }
+        m_size = values.size();
+    }
+
+    size_t Size() const { return m_size; }
+
+    T& operator[](size_t index) {
+        auto [chunk, offset] = Locate(index);
+        return m_chunks[chunk][offset];
+    }
+
+    const T& operator[](size_t index) const {
+        auto [chunk, offset] = Locate(index);
+        return m_chunks[chunk][offset];
+    }
+
+    void Insert(size_t index, T value) {
+        if (m_chunks.empty()) {
+            m_chunks.emplace_back();
+        }
+        auto [chunkIndex, offset] = Locate(index);
+        auto& chunk = m_chunks[chunkIndex];
+        chunk.insert(chunk.begin() + static_cast<ptrdiff_t>(offset), std::move(value));
+        ++m_size;
+
+        if (chunk.size() == 2 * ChunkSize) {
+            std::vector<T> tail(chunk.begin() + ChunkSize, chunk.end());
+            chunk.resize(ChunkSize);
+            m_chunks.insert(m_chunks.begin() + static_cast<ptrdiff_t>(chunkIndex + 1), std::move(tail));
+        }
+    }
+
+    // Insert values [first, last) before the index, big ranges are added as whole chunks
+    template <typename Iterator> void Insert(size_t index, Iterator first, Iterator last) {
+        auto count = static_cast<size_t>(std::distance(first, last));
+        if (count < ChunkSize) {
+            for (; first != last; ++first) {
+                Insert(index++, *first);
+            }
+            return;
+        }
+
+        if (m_chunks.empty()) {
+            m_chunks.emplace_back();
+        }
+        auto [chunkIndex, offset] = Locate(index);
+        auto& chunk = m_chunks[chunkIndex];
+        std::vector<T> tail(std::make_move_iterator(chunk.begin() + static_cast<ptrdiff_t>(offset)), std::make_move_iterator(chunk.end()));
+        chunk.resize(offset);
+
+        std::vector<std::vector<T>> chunks;
+        chunks.reserve(count / ChunkSize + 2);
+        for (size_t i=0; i < count; i += ChunkSize) {
+            auto next = first;
+            std::advance(next, static_cast<ptrdiff_t>(std::min(ChunkSize, count - i)));
+            chunks.emplace_back(first, next);
+            first = next;
+        }
+        if (!tail.empty()) {
+            chunks.push_back(std::move(tail));
+        }
+        auto position = m_chunks.begin() + static_cast<ptrdiff_t>(chunkIndex + 1);
+        m_chunks.insert(position, std::make_move_iterator(chunks.begin()), std::make_move_iterator(chunks.end()));
+        if (m_chunks[chunkIndex].empty()) {
+            m_chunks.erase(m_chunks.begin() + static_cast<ptrdiff_t>(chunkIndex));
+        }
+        m_size += count;
+    }
+
+    // Erase count elements from the index, calls callback(value) for each of them
+    template <typename Callback> void Erase(size_t index, size_t count, Callback&& callback) {
+        auto [chunkIndex, offset] = Locate(index);
+        while (count != 0) {
+            auto& chunk = m_chunks[chunkIndex];
+            size_t erased = std::min(count, chunk.size() - offset);
+            auto first = chunk.begin() + static_cast<ptrdiff_t>(offset);
+            auto last = first + static_cast<ptrdiff_t>(erased);
+            std::for_each(first, last, callback);
+            chunk.erase(first, last);
+            count -= erased;
+            m_size -= erased;
+
+            if (chunk.empty()) {
+                m_chunks.erase(m_chunks.begin() + static_cast<ptrdiff_t>(chunkIndex));
+            } else {
+                ++chunkIndex;
+            }
+            offset = 0;
+        }
+    }
+
+    // Erase the element and return it
+    T Take(size_t index) {
+        auto [chunkIndex, offset] = Locate(index);
+        auto& chunk = m_chunks[chunkIndex];
+        T value = std::move(chunk[offset]);
+        chunk.erase(chunk.begin() + static_cast<ptrdiff_t>(offset));
+        --m_size;
+
+        if (chunk.empty()) {
+            m_chunks.erase(m_chunks.begin() + static_cast<ptrdiff_t>(chunkIndex));
+        }
+        return value;
+    }
+
+    // Calls callback(value) for each element in order
+    template <typename Callback> void ForEach(Callback&& callback) const {
+        for (const auto& chunk: m_chunks) {
+            for (const auto& value: chunk) {
+                callback(value);
+            }
+        }
+    }
+
+    std::vector<T> ToVector() const {
+        std::vector<T> result;
+        result.reserve(m_size);
+        for (const auto& chunk: m_chunks) {
+            result.insert(result.end(), chunk.begin(), chunk.end());
+        }
+        return result;
+    }
+
+    size_t MemorySize() const {
+        size_t result = m_chunks.capacity() * sizeof(std::vector<T>);
+        for (const auto& chunk: m_chunks) {
+            result += chunk.capacity() * sizeof(T);
+        }
+        return result;
+    }
+
+private:
+    // Chunk and position in it, the end of the last chunk for the size
+    std::pair<size_t, size_t> Locate(size_t index) const {
+        for (size_t i=0; i!=m_chunks.size(); ++i) {
+            if (index < m_chunks[i].size()) {
+                return {i, index};
+            }
+            index -= m_chunks[i].size();
+        }
+
+        return m_chunks.empty() ? std::make_pair(size_t(0), size_t(0)) : std::make_pair(m_chunks.size() - 1, m_chunks.back().size());
+    }
+
+private:
+    size_t m_size = 0;
+    std::vector<std::vector<T>> m_chunks;
+};
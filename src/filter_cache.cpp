@@ -0,0 +1,200 @@
+#include "filter_cache.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <cctype>
+#include <cstring>
+#include <rofi/helper.h>
+
+#include "trigram_index.h"
+
+
+namespace {
+
+// Appending the suffix to a pattern makes a concatenation: literal characters, escaped characters
+// and the wildcards that rofi produces for the "fuzzy" and "glob" methods, but no alternation or quantifiers
+static bool IsConcatenation(std::string_view suffix) {
+    for (size_t i=0; i!=suffix.size();) {
+        char ch = suffix[i];
+        if (ch == '\\') {
+            if (i + 1 == suffix.size()) {
+                return false;
+            }
+            i += 2;
+        } else if (ch == '.') {
+            // ".", ".*", ".*?"
+            ++i;
+            if ((i != suffix.size()) && (suffix[i] == '*')) {
+                ++i;
+                if ((i != suffix.size()) && (suffix[i] == '?')) {
+                    ++i;
+                }
+            }
+        } else if (strchr("^$|?*+()[]{}", ch) != nullptr) {
+            return false;
+        } else {
+            ++i;
+        }
+    }
+
+    return true;
+}
+
+// A pattern like "\x4" or "\1" changes its meaning when a digit is appended
+static bool EndsWithAlnumEscape(std::string_view pattern) {
+    bool isEscape = false;
+    for (size_t i=0; i!=pattern.size(); ++i) {
+        if (pattern[i] == '\\') {
+            ++i;
+            isEscape = (i != pattern.size()) && (isalnum(static_cast<unsigned char>(pattern[i])) != 0);
+        } else {
+            isEscape = false;
+        }
+    }
+
+    return isEscape;
+}
+
+static constexpr size_t PRECOMPUTE_CHUNK_SIZE = 4096;
+
+}
+
+void FilterCache::EnablePrecompute(FilterCacheHandler* handler, size_t threadCount) {
+    m_handler = handler;
+    m_pool = std::make_unique<ThreadPool>(threadCount);
+}
+
+void FilterCache::StartPass(rofi_int_matcher_t** tokens, size_t linesCount) {
+    m_passMode.store(PassMode::None, std::memory_order_relaxed);
+    m_passTokens.store(nullptr, std::memory_order_relaxed);
+
+    // The previous pass becomes the base of the next one only if rofi tested all lines
+    bool isComplete = (!m_currentTokens.empty()) && (m_current.size() == linesCount) &&
+        (memchr(m_current.data(), static_cast<int>(FilterResult::Unknown), m_current.size()) == nullptr);
+    if (isComplete) {
+        std::swap(m_previous, m_current);
+        std::swap(m_previousTokens, m_currentTokens);
+    }
+
+    // Rofi doesn't filter lines by an empty input
+    m_currentTokens = GetTokens(tokens);
+    if (m_currentTokens.empty()) {
+        m_current.clear();
+        return;
+    }
+    m_current.assign(linesCount, FilterResult::Unknown);
+    if (m_index != nullptr) {
+        m_index->Filter(tokens, m_current);
+    }
+
+    PassMode mode = PassMode::Full;
+    if ((m_previous.size() == linesCount) && (!m_previousTokens.empty())) {
+        if (m_previousTokens == m_currentTokens) {
+            mode = PassMode::Same;
+        } else if (IsNarrowing(m_previousTokens, m_currentTokens)) {
+            mode = PassMode::Narrow;
+        }
+    }
+
+    if (m_pool) {
+        Precompute(tokens, mode);
+        mode = PassMode::Precomputed;
+    }
+    m_passMode.store(mode, std::memory_order_release);
+}
+
+void FilterCache::Reset() {
+    m_previous.clear();
+    m_previousTokens.clear();
+    m_current.clear();
+    m_currentTokens.clear();
+    m_passMode.store(PassMode::None, std::memory_order_release);
+    m_passTokens.store(nullptr, std::memory_order_relaxed);
+}
+
+bool FilterCache::AcceptTokens(rofi_int_matcher_t** tokens) {
+    // Doesn't allocate, several threads may compare the same tokens at once
+    size_t count = 0;
+    for (auto it = tokens; (it != nullptr) && (*it != nullptr); ++it, ++count) {
+        if (count == m_currentTokens.size()) {
+            return false;
+        }
+        const Token& token = m_currentTokens[count];
+        const GRegex* regex = (*it)->regex;
+        bool caseless = ((g_regex_get_compile_flags(regex) & G_REGEX_CASELESS) != 0);
+        if ((token.pattern != g_regex_get_pattern(regex)) || (token.invert != ((*it)->invert == TRUE)) || (token.caseless != caseless)) {
+            return false;
+        }
+    }
+    if (count != m_currentTokens.size()) {
+        return false;
+    }
+
+    m_passTokens.store(tokens, std::memory_order_relaxed);
+    return true;
+}
+
+void FilterCache::Precompute(rofi_int_matcher_t** tokens, PassMode mode) {
+    m_pool->ParallelFor(m_current.size(), PRECOMPUTE_CHUNK_SIZE, [this, tokens, mode](size_t begin, size_t end) {
+        for (size_t i=begin; i!=end; ++i) {
+            if (m_current[i] == FilterResult::NotMatched) {
+                continue;
+            }
+            auto previous = (mode == PassMode::Full) ? FilterResult::Unknown : m_previous[i];
+            if ((mode == PassMode::Same) || (previous == FilterResult::NotMatched)) {
+                m_current[i] = previous;
+            } else {
+                m_current[i] = m_handler->OnMatchLine(tokens, i) ? FilterResult::Matched : FilterResult::NotMatched;
+            }
+        }
+    });
+}
+
+std::vector<FilterCache::Token> FilterCache::GetTokens(rofi_int_matcher_t** tokens) {
+    std::vector<Token> result;
+    for (auto it = tokens; (it != nullptr) && (*it != nullptr); ++it) {
+        const GRegex* regex = (*it)->regex;
+        bool caseless = ((g_regex_get_compile_flags(regex) & G_REGEX_CASELESS) != 0);
+        result.push_back(Token{g_regex_get_pattern(regex), ((*it)->invert == TRUE), caseless});
+    }
+
+    return result;
+}
+
+bool FilterCache::IsNarrowing(const std::vector<Token>& previous, const std::vector<Token>& current) {
+    // New tokens are added with AND, each previous token must be narrowed by the token in its place
+    if (current.size() < previous.size()) {
+        return false;
+    }
+    for (size_t i=0; i!=previous.size(); ++i) {
+        if (!IsNarrowing(previous[i], current[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FilterCache::IsNarrowing(const Token& previous, const Token& current) {
+    if ((previous.invert != current.invert) || (current.caseless && (!previous.caseless))) {
+        return false;
+    }
+    if (previous.pattern == current.pattern) {
+        return true;
+    }
+
+    // A longer excluded token excludes fewer lines
+    if (previous.invert) {
+        return false;
+    }
+
+    std::string_view pattern(current.pattern);
+    if ((pattern.size() <= previous.pattern.size()) || (pattern.compare(0, previous.pattern.size(), previous.pattern) != 0)) {
+        return false;
+    }
+
+    return (!EndsWithAlnumEscape(previous.pattern)) && IsConcatenation(pattern.substr(previous.pattern.size()));
+}
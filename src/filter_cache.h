@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "thread_pool.h"
+
+
+enum class FilterResult : uint8_t {
+    Unknown,
+    Matched,
+    NotMatched,
+};
+
+struct rofi_int_matcher_t;
+class TrigramIndex;
+class FilterCacheHandler {
+public:
+    // Test the line against the tokens, called from the filter threads of rofi and the threads of the pool
+    virtual bool OnMatchLine(rofi_int_matcher_t** tokens, size_t index) = 0;
+};
+
+// Results of the previous filtering of lines by rofi. When the new tokens only narrow the previous ones
+// (the user typed more characters), a line that did not match before can not match now and is not tested.
+// The same tokens over the same lines (a reload of the view) are answered from the cache completely.
+// With the precompute mode StartPass tests all lines on the thread pool, Get only reads the results.
+// StartPass and Reset are called from the main loop, Get and Set from the filter threads of rofi.
+// The pass is published by one store to m_passMode, the filter threads don't wait for each other.
+class FilterCache {
+public:
+    FilterCache() = default;
+    ~FilterCache() = default;
+
+    // threadCount includes the calling thread, 0 - number of cores
+    void EnablePrecompute(FilterCacheHandler* handler, size_t threadCount);
+    // Lines which the index excludes are not tested
+    void SetIndex(const TrigramIndex* index) { m_index = index; }
+    // Rofi is going to filter lines with the tokens of the same input, the tokens are used only by the call
+    void StartPass(rofi_int_matcher_t** tokens, size_t linesCount);
+    // Lines were changed, the cached results are not valid
+    void Reset();
+
+    FilterResult Get(rofi_int_matcher_t** tokens, size_t index) {
+        auto mode = m_passMode.load(std::memory_order_acquire);
+        if ((mode == PassMode::None) || (index >= m_current.size())) {
+            return FilterResult::Unknown;
+        }
+        // Rofi tokenizes the input itself, its tokens are compared with the tokens of the pass once
+        if ((m_passTokens.load(std::memory_order_relaxed) != tokens) && (!AcceptTokens(tokens))) {
+            return FilterResult::Unknown;
+        }
+        // Precomputed or excluded by the index
+        if ((mode == PassMode::Precomputed) || (m_current[index] == FilterResult::NotMatched)) {
+            return m_current[index];
+        }
+        if (mode == PassMode::Full) {
+            return FilterResult::Unknown;
+        }
+
+        auto result = m_previous[index];
+        if ((mode == PassMode::Narrow) && (result == FilterResult::Matched)) {
+            return FilterResult::Unknown;
+        }
+        m_current[index] = result;
+        return result;
+    }
+
+    void Set(rofi_int_matcher_t** tokens, size_t index, FilterResult result) {
+        // Each line is tested by one thread, the threads write different bytes
+        if ((m_passTokens.load(std::memory_order_relaxed) == tokens) && (index < m_current.size())) {
+            m_current[index] = result;
+        }
+    }
+
+private:
+    enum class PassMode : uint8_t {
+        None,   // The cache is not used
+        Full,   // All lines are tested
+        Narrow, // Only the lines matched by the previous tokens are tested
+        Same,   // The tokens are the same, all results are from the cache
+        Precomputed, // All results are in m_current
+    };
+
+    struct Token {
+        std::string pattern;
+        bool invert;
+        bool caseless;
+
+        bool operator==(const Token& other) const {
+            return (pattern == other.pattern) && (invert == other.invert) && (caseless == other.caseless);
+        }
+    };
+
+    bool AcceptTokens(rofi_int_matcher_t** tokens);
+    void Precompute(rofi_int_matcher_t** tokens, PassMode mode);
+    static std::vector<Token> GetTokens(rofi_int_matcher_t** tokens);
+    // Every line matched by current tokens is matched by previous tokens
+    static bool IsNarrowing(const std::vector<Token>& previous, const std::vector<Token>& current);
+    static bool IsNarrowing(const Token& previous, const Token& current);
+
+private:
+    std::atomic<PassMode> m_passMode = PassMode::None;
+    // The tokens of rofi which are equal to the tokens of the pass
+    std::atomic<rofi_int_matcher_t**> m_passTokens = nullptr;
+    // Results of the last complete pass, their tokens
+    std::vector<FilterResult> m_previous;
+    std::vector<Token> m_previousTokens;
+    // Results of the running pass
+    std::vector<FilterResult> m_current;
+    std::vector<Token> m_currentTokens;
+    const TrigramIndex* m_index = nullptr;
+    // Only with the precompute mode
+    FilterCacheHandler* m_handler = nullptr;
+    std::unique_ptr<ThreadPool> m_pool;
+};
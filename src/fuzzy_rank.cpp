@@ -0,0 +1,275 @@
+#include "fuzzy_rank.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FUZZY_SIMD_X86
+#endif
+
+#include "line_store.h"
+
+
+namespace {
+
+// Weights of fzf
+static constexpr int32_t SCORE_MATCH = 16;
+static constexpr int32_t SCORE_GAP_START = -3;
+static constexpr int32_t SCORE_GAP_EXTENSION = -1;
+static constexpr int32_t BONUS_BOUNDARY = SCORE_MATCH / 2;
+static constexpr int32_t BONUS_NON_WORD = SCORE_MATCH / 2;
+static constexpr int32_t BONUS_CAMEL_123 = BONUS_BOUNDARY + SCORE_GAP_EXTENSION;
+static constexpr int32_t BONUS_CONSECUTIVE = -(SCORE_GAP_START + SCORE_GAP_EXTENSION);
+static constexpr int32_t BONUS_FIRST_CHAR_MULTIPLIER = 2;
+
+enum class CharClass : uint8_t {
+    NonWord,
+    Lower,
+    Upper,
+    Number,
+};
+
+static CharClass GetCharClass(unsigned char ch) {
+    if ((ch >= 'a') && (ch <= 'z')) {
+        return CharClass::Lower;
+    }
+    if ((ch >= 'A') && (ch <= 'Z')) {
+        return CharClass::Upper;
+    }
+    if ((ch >= '0') && (ch <= '9')) {
+        return CharClass::Number;
+    }
+
+    // Bytes of non-ASCII characters are letters without case
+    return (ch >= 0x80) ? CharClass::Lower : CharClass::NonWord;
+}
+
+static int32_t GetBonus(CharClass prev, CharClass current) {
+    if ((prev == CharClass::NonWord) && (current != CharClass::NonWord)) {
+        return BONUS_BOUNDARY;
+    }
+    if (((prev == CharClass::Lower) && (current == CharClass::Upper)) || ((prev != CharClass::Number) && (current == CharClass::Number))) {
+        return BONUS_CAMEL_123;
+    }
+
+    return (current == CharClass::NonWord) ? BONUS_NON_WORD : 0;
+}
+
+static unsigned char ToLowerAscii(unsigned char ch) {
+    return ((ch >= 'A') && (ch <= 'Z')) ? static_cast<unsigned char>(ch - 'A' + 'a') : ch;
+}
+
+static bool IsMatch(char textCh, char patternCh, bool caseSensitive) {
+    auto ch = static_cast<unsigned char>(textCh);
+    return (caseSensitive ? ch : ToLowerAscii(ch)) == static_cast<unsigned char>(patternCh);
+}
+
+// Position of the letter in any case at or after "from", text.size() if it is not found
+using CaselessFinder = size_t (*)(std::string_view text, size_t from, char lower);
+
+static size_t FindCaselessScalar(std::string_view text, size_t from, char lower) {
+    // memchr is vectorized by libc, the upper case is searched before the lower case match only
+    const char* begin = text.data() + from;
+    size_t size = text.size() - from;
+    auto found = static_cast<const char*>(memchr(begin, lower, size));
+    size_t limit = (found != nullptr) ? static_cast<size_t>(found - begin) : size;
+    if (auto upper = static_cast<const char*>(memchr(begin, lower - 'a' + 'A', limit)); upper != nullptr) {
+        found = upper;
+    }
+
+    return (found != nullptr) ? static_cast<size_t>(found - text.data()) : text.size();
+}
+
+#ifdef FUZZY_SIMD_X86
+
+// Only 'a' and 'A' become 'a' with the 0x20 bit set, so one comparison finds both cases in one pass
+__attribute__((target("sse2"))) static size_t FindCaselessSSE2(std::string_view text, size_t from, char lower) {
+    const __m128i pattern = _mm_set1_epi8(lower);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    size_t i = from;
+    for (; i + 16 <= text.size(); i += 16) {
+        __m128i v = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i)), caseBit);
+        if (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)); mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+
+    return FindCaselessScalar(text, i, lower);
+}
+
+__attribute__((target("avx2"))) static size_t FindCaselessAVX2(std::string_view text, size_t from, char lower) {
+    const __m256i pattern = _mm256_set1_epi8(lower);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    size_t i = from;
+    for (; i + 32 <= text.size(); i += 32) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i)), caseBit);
+        if (int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)); mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+
+    return FindCaselessSSE2(text, i, lower);
+}
+
+#endif
+
+static CaselessFinder SelectCaselessFinder() {
+#ifdef FUZZY_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FindCaselessAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return FindCaselessSSE2;
+    }
+#endif
+
+    return FindCaselessScalar;
+}
+
+static const CaselessFinder FindCaseless = SelectCaselessFinder();
+
+// Position of the character at or after "from", text.size() if it is not found
+static size_t Find(std::string_view text, size_t from, char ch, bool caseSensitive) {
+    if ((!caseSensitive) && (ch >= 'a') && (ch <= 'z')) {
+        return FindCaseless(text, from, ch);
+    }
+
+    auto found = static_cast<const char*>(memchr(text.data() + from, ch, text.size() - from));
+    return (found != nullptr) ? static_cast<size_t>(found - text.data()) : text.size();
+}
+}
+
+void FuzzyRanker::Rank(const char* input, const LineStore& lines) {
+    m_ranked.clear();
+    m_heap.clear();
+
+    // Words are matched separately, a line must contain all of them
+    std::vector<std::string_view> words;
+    std::string_view text((input != nullptr) ? input : "");
+    for (size_t begin = 0; begin < text.size();) {
+        size_t end = std::min(text.find(' ', begin), text.size());
+        if (end != begin) {
+            words.push_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    m_isActive = !words.empty();
+    if (!m_isActive) {
+        return;
+    }
+
+    // The heap keeps the worst of the best lines on top, equal scores keep the order of lines
+    auto isBetter = [](const Candidate& lhs, const Candidate& rhs) {
+        return (lhs.score > rhs.score) || ((lhs.score == rhs.score) && (lhs.index < rhs.index));
+    };
+    for (size_t i=0; i!=lines.Size(); ++i) {
+        // Lines without filtering are always shown, they go first
+        if (!lines.IsFiltering(i)) {
+            m_ranked.push_back(static_cast<uint32_t>(i));
+            continue;
+        }
+
+        std::string_view matchText(lines.GetMatchText(i));
+        int32_t score = 0;
+        for (auto word: words) {
+            int32_t wordScore = Score(word, matchText);
+            if (wordScore < 0) {
+                score = -1;
+                break;
+            }
+            score += wordScore;
+        }
+        if (score < 0) {
+            continue;
+        }
+
+        Candidate candidate{score, static_cast<uint32_t>(i)};
+        if (m_heap.size() < m_limit) {
+            m_heap.push_back(candidate);
+            std::push_heap(m_heap.begin(), m_heap.end(), isBetter);
+        } else if (isBetter(candidate, m_heap.front())) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), isBetter);
+            m_heap.back() = candidate;
+            std::push_heap(m_heap.begin(), m_heap.end(), isBetter);
+        }
+    }
+
+    std::sort_heap(m_heap.begin(), m_heap.end(), isBetter);
+    for (const auto& candidate: m_heap) {
+        m_ranked.push_back(candidate.index);
+    }
+}
+
+void FuzzyRanker::Clear() {
+    m_isActive = false;
+    m_ranked.clear();
+    m_heap.clear();
+}
+
+int32_t FuzzyRanker::Score(std::string_view pattern, std::string_view text) {
+    if (pattern.empty()) {
+        return 0;
+    }
+
+    // Smart case: a pattern with upper case letters is matched with case
+    bool caseSensitive = std::any_of(pattern.begin(), pattern.end(), [](char ch) { return (ch >= 'A') && (ch <= 'Z'); });
+
+    // The first occurrence of the pattern as a subsequence
+    size_t pos = 0;
+    for (char ch: pattern) {
+        pos = Find(text, pos, ch, caseSensitive);
+        if (pos == text.size()) {
+            return -1;
+        }
+        ++pos;
+    }
+    size_t end = pos;
+
+    // The shortest window which ends there
+    size_t begin = end;
+    for (size_t patternPos = pattern.size(); patternPos != 0; ) {
+        --begin;
+        if (IsMatch(text[begin], pattern[patternPos - 1], caseSensitive)) {
+            --patternPos;
+        }
+    }
+
+    // Every position depends on the previous one, the loop stays scalar: it runs only for the window
+    // found by the SIMD scans above, which reject the lines without a match
+    int32_t score = 0;
+    int32_t firstBonus = 0;
+    size_t consecutive = 0;
+    bool inGap = false;
+    size_t patternPos = 0;
+    auto prevClass = (begin != 0) ? GetCharClass(static_cast<unsigned char>(text[begin - 1])) : CharClass::NonWord;
+    for (size_t i=begin; i!=end; ++i) {
+        auto currentClass = GetCharClass(static_cast<unsigned char>(text[i]));
+        if ((patternPos != pattern.size()) && IsMatch(text[i], pattern[patternPos], caseSensitive)) {
+            score += SCORE_MATCH;
+            int32_t bonus = GetBonus(prevClass, currentClass);
+            if (consecutive == 0) {
+                firstBonus = bonus;
+            } else {
+                // A run of matches keeps the bonus of its start
+                if ((bonus >= BONUS_BOUNDARY) && (bonus > firstBonus)) {
+                    firstBonus = bonus;
+                }
+                bonus = std::max({bonus, firstBonus, BONUS_CONSECUTIVE});
+            }
+            score += (patternPos == 0) ? bonus * BONUS_FIRST_CHAR_MULTIPLIER : bonus;
+            inGap = false;
+            ++consecutive;
+            ++patternPos;
+        } else {
+            score += inGap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            inGap = true;
+            consecutive = 0;
+            firstBonus = 0;
+        }
+        prevClass = currentClass;
+    }
+
+    return std::max(score, int32_t(0));
+}
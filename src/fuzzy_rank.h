@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+
+class LineStore;
+// Ranks lines by a fuzzy score against the user input (like fzf): the characters of every word of the input
+// must appear in the text in order, matches at word starts and consecutive matches score higher.
+// Only the best lines are kept, rofi shows them in the order of the score.
+class FuzzyRanker {
+public:
+    FuzzyRanker() = default;
+    ~FuzzyRanker() = default;
+
+    // Number of shown lines, 0 - the ranking is off
+    void SetLimit(size_t limit) { m_limit = limit; }
+    bool IsEnabled() const { return m_limit != 0; }
+    // The ranking of the last non-empty input is applied
+    bool IsActive() const { return m_isActive; }
+
+    // Rank lines for the input, an empty input turns the ranking off until the next call
+    void Rank(const char* input, const LineStore& lines);
+    void Clear();
+    size_t GetRankedCount() const { return m_ranked.size(); }
+    // Line shown at the position, positions after the ranked lines are hidden and mapped to themselves
+    size_t GetLine(size_t position) const { return (position < m_ranked.size()) ? m_ranked[position] : position; }
+
+    // Returns a negative value if the text does not contain the characters of the pattern in order
+    static int32_t Score(std::string_view pattern, std::string_view text);
+
+private:
+    size_t m_limit = 0;
+    bool m_isActive = false;
+    std::vector<uint32_t> m_ranked;
+    struct Candidate {
+        int32_t score;
+        uint32_t index;
+    };
+    std::vector<Candidate> m_heap;
+};
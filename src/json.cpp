@@ -25,16 +25,177 @@
 #include <locale>
 #include <cstring>
 #include <charconv>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_SIMD_X86
+#endif
 
 #include "json.h"
+#include "defer.h"
 #include "exception.h"
 
 static const auto userLocale = std::locale("");
 static const char STRING_INVALID[] = "invalid character inside JSON string";
 static const char JSON_INVALID[]  = "the string is not a full JSON packet, more bytes expected";
+static const char JSON_TOO_BIG[]  = "the JSON packet is too big";
+static constexpr uint32_t NO_PARENT = UINT32_MAX;
+// Max number of bytes that one call of the structural scanner processes
+static constexpr uint32_t INDEX_BLOCK_SIZE = 64 * 1024;
 
 namespace {
 
+template <typename T> static void grow(T*& data, uint32_t count, uint32_t& capacity, uint32_t required) {
+    if (required <= capacity) {
+        return;
+    }
+
+    uint32_t newCapacity = (capacity == 0) ? 64 : capacity;
+    while (newCapacity < required) {
+        newCapacity *= 2;
+    }
+
+    T* newData = new T[newCapacity];
+    if (data != nullptr) {
+        std::copy(data, data + count, newData);
+        delete[] data;
+    }
+    data = newData;
+    capacity = newCapacity;
+}
+
+// Stage one of the parser: find positions of '"', '\\', '{', '}', '[', ']', ':' and ','.
+// Each scanner processes text[begin, end) and writes absolute positions to out,
+// the caller guarantees that out has room for (end - begin) items.
+typedef uint32_t (*StructuralScanner)(const char* text, uint32_t begin, uint32_t end, uint32_t* out);
+
+static bool isStructural(char c) {
+    switch (c) {
+    case '\"':
+    case '\\':
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint32_t scanScalar(const char* text, uint32_t begin, uint32_t end, uint32_t* out) {
+    uint32_t count = 0;
+    for (uint32_t i=begin; i!=end; ++i) {
+        if (isStructural(text[i])) {
+            out[count++] = i;
+        }
+    }
+
+    return count;
+}
+
+static uint32_t flushMask(uint64_t mask, uint32_t offset, uint32_t* out) {
+    uint32_t count = 0;
+    while (mask != 0) {
+        out[count++] = offset + static_cast<uint32_t>(__builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+
+    return count;
+}
+
+#ifdef JSON_SIMD_X86
+
+// '[' and '{', ']' and '}' differ only in 0x20 bit, so 6 comparisons cover all 8 characters
+__attribute__((target("sse2"))) static uint64_t classifySSE2(const char* it) {
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+
+    uint64_t result = 0;
+    for (int i=0; i!=4; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it + i * 16));
+        __m128i lv = _mm_or_si128(v, caseBit);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(lv, open), _mm_cmpeq_epi8(lv, close)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma))));
+        result |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(m))) << (i * 16);
+    }
+
+    return result;
+}
+
+__attribute__((target("avx2"))) static uint64_t classifyAVX2(const char* it) {
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+
+    uint64_t result = 0;
+    for (int i=0; i!=2; ++i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it + i * 32));
+        __m256i lv = _mm256_or_si256(v, caseBit);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(lv, open), _mm256_cmpeq_epi8(lv, close)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma))));
+        result |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(m))) << (i * 32);
+    }
+
+    return result;
+}
+
+__attribute__((target("sse2"))) static uint32_t scanSSE2(const char* text, uint32_t begin, uint32_t end, uint32_t* out) {
+    uint32_t count = 0;
+    uint32_t i = begin;
+    for (; i + 64 <= end; i += 64) {
+        count += flushMask(classifySSE2(text + i), i, out + count);
+    }
+
+    return count + scanScalar(text, i, end, out + count);
+}
+
+__attribute__((target("avx2"))) static uint32_t scanAVX2(const char* text, uint32_t begin, uint32_t end, uint32_t* out) {
+    uint32_t count = 0;
+    uint32_t i = begin;
+    for (; i + 64 <= end; i += 64) {
+        count += flushMask(classifyAVX2(text + i), i, out + count);
+    }
+
+    return count + scanScalar(text, i, end, out + count);
+}
+
+#endif
+
+static StructuralScanner selectScanner() {
+#ifdef JSON_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scanAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scanSSE2;
+    }
+#endif
+
+    return scanScalar;
+}
+
+static const StructuralScanner scanStructural = selectScanner();
+
 static char* toUtf8(const char* data, char* writeIt) {
     static auto& facet = std::use_facet<std::codecvt<char16_t, char, std::mbstate_t>>(userLocale);
     uint16_t v;
@@ -53,10 +214,6 @@ static char* toUtf8(const char* data, char* writeIt) {
 
 }
 
-std::string_view Token::AsString() {
-    return std::string_view(start, static_cast<size_t>(end - start));
-}
-
 Json::Json()
     : m_tokens(new Token[64])
     , m_tokensCapacity(64) {
@@ -67,25 +224,54 @@ Json::~Json() {
     if (m_tokens != nullptr) {
         delete[] m_tokens;
     }
-    if (m_text != nullptr) {
-        delete[] m_text;
+    if (m_index != nullptr) {
+        delete[] m_index;
+    }
+    if (m_stack != nullptr) {
+        delete[] m_stack;
     }
 }
 
-void Json::Parse(const char* text) {
-    if (m_text != nullptr) {
-        delete[] m_text;
+void Json::Feed(char* text, size_t size) noexcept {
+    if (!m_isStarted) {
+        Reset();
+        m_isStarted = true;
+    }
+    if (!m_error.empty()) {
+        return;
     }
-    auto len = strlen(text) + 1;
-    m_text = new char[len];
-    strncpy(m_text, text, len);
-    m_textIt = m_text;
 
-    m_parent = nullptr;
-    m_tokensIt = 0;
-    m_tokensCount = 0;
+    try {
+        if (size > UINT32_MAX) {
+            throw ProxyError(JSON_TOO_BIG);
+        }
+        m_text = text;
+        BuildIndex(static_cast<uint32_t>(size));
+        ParseImpl(static_cast<uint32_t>(size), false);
+    } catch(const std::exception& e) {
+        // The error will be thrown from Parse, when the whole message is received
+        m_error = e.what();
+    }
+}
 
-    ParseImpl();
+void Json::Parse(char* text, size_t size) {
+    Defer _([this](...) mutable {
+        m_isStarted = false;
+    });
+
+    if (!m_isStarted) {
+        Reset();
+    }
+    if (!m_error.empty()) {
+        throw ProxyError(m_error);
+    }
+    if (size > UINT32_MAX) {
+        throw ProxyError(JSON_TOO_BIG);
+    }
+
+    m_text = text;
+    BuildIndex(static_cast<uint32_t>(size));
+    ParseImpl(static_cast<uint32_t>(size), true);
 }
 
 Token* Json::Next() {
@@ -113,7 +299,7 @@ Token* Json::Next(TokenType expectedType) {
         throw ProxyError("unexpected token type");
     }
 
-    if ((token->type == TokenType::Primitive) && (token->AsString() == "null")) {
+    if ((token->type == TokenType::Primitive) && (AsString(token) == "null")) {
         isValue = false;
         return token;
     }
@@ -126,15 +312,37 @@ Token* Json::Next(TokenType expectedType) {
     throw ProxyError("unexpected token type");
 }
 
+void Json::SkipValue() {
+    const Token* token = Next();
+    if (token == nullptr) {
+        throw ProxyError("unexpected end of tokens");
+    }
+
+    if ((token->type == TokenType::Object) || (token->type == TokenType::Array)) {
+        // Tokens of nested values are placed after their container and inside its range
+        while ((m_tokensIt < m_tokensCount) && (m_tokens[m_tokensIt].start < token->end)) {
+            ++m_tokensIt;
+        }
+    }
+}
+
+uint32_t Json::NextObject() {
+    return Next(TokenType::Object)->size;
+}
+
+uint32_t Json::NextArrayOrNull(bool& isArray) {
+    return NextOrNull(TokenType::Array, isArray)->size;
+}
+
 void Json::NextNull() {
-    auto text = Next(TokenType::Primitive)->AsString();
+    auto text = AsString(Next(TokenType::Primitive));
     if (text != "null") {
         throw ProxyError("unexpected null token value");
     }
 }
 
 std::string_view Json::NextString() {
-    return Next(TokenType::String)->AsString();
+    return AsString(Next(TokenType::String));
 }
 
 std::string_view Json::NextStringOrNull(bool& isString) {
@@ -146,12 +354,12 @@ std::string_view Json::NextStringOrNull(bool& isString) {
 
     if (token->type == TokenType::String) {
         isString = true;
-        return token->AsString();
+        return AsString(token);
     }
 
     if (token->type == TokenType::Primitive) {
         isString = false;
-        if (token->AsString() != "null") {
+        if (AsString(token) != "null") {
             throw ProxyError("unexpected null token value");
         }
         return std::string_view();
@@ -161,7 +369,7 @@ std::string_view Json::NextStringOrNull(bool& isString) {
 }
 
 bool Json::NextBool() {
-    auto text = Next(TokenType::Primitive)->AsString();
+    auto text = AsString(Next(TokenType::Primitive));
     if (text == "true") {
         return true;
     }
@@ -174,7 +382,7 @@ bool Json::NextBool() {
 }
 
 bool Json::NextBoolOrNull(bool& isBool) {
-    auto text = Next(TokenType::Primitive)->AsString();
+    auto text = AsString(Next(TokenType::Primitive));
     if (text == "true") {
         isBool = true;
         return true;
@@ -193,281 +401,399 @@ bool Json::NextBoolOrNull(bool& isBool) {
     throw ProxyError("unexpected null token value");
 }
 
-std::string Json::EscapeString(const char* str) {
-    static auto& facet = std::use_facet<std::codecvt<char16_t, char, std::mbstate_t>>(userLocale);
-    char16_t wc;
-    char16_t* toNext;
-    const char* fromNext;
-    std::mbstate_t mb{};
-
-    std::string result;
-    const char* it = str;
-    const char* endIt = str + strlen(str) + 1;
-    while(it != endIt) {
-        int charCount = facet.length(mb, it, endIt, 1);
-        if (charCount == 1) {
-            switch (*it) {
-            case '\"':
-            case '/':
-            case '\\':
-            case '\b':
-            case '\f':
-            case '\r':
-            case '\n':
-            case '\t':
-                result.push_back('\\');
-            }
-            result.push_back(*it);
-        } else {
-            facet.in(mb, it, it + charCount, fromNext, &wc, &wc + 1, toNext);
-            uint16_t v = static_cast<uint16_t>(wc);
-
-            char data[7] = {'\\', 'u', '0', '0', '0', '0', '\0'};
-            char *dataBegin = data + 2;
-            if (v == 0) {
-                dataBegin = nullptr;
-            } else if ((v >> 4) == 0) {
-                dataBegin += 3;
-            } else if ((v >> 8) == 0) {
-                dataBegin += 2;
-            } else if ((v >> 12) == 0) {
-                dataBegin += 1;
-            } else {
-                dataBegin += 0;
-            }
-
-            if (dataBegin != nullptr) {
-                if (auto [p, ec] = std::to_chars(dataBegin, data + 6, v, 16); ((ec != std::errc()) || (p != data + 6))) {
-                    throw ProxyError("invalid string for escape");
-                }
-            }
-            result.append(data);
-        }
-        it += charCount;
+uint32_t Json::NextUInt() {
+    bool isUInt;
+    uint32_t result = NextUIntOrNull(isUInt);
+    if (!isUInt) {
+        throw ProxyError("unexpected null token value, expected unsigned integer");
     }
 
     return result;
 }
 
-Token* Json::NewToken(TokenType type, char* start, char* end) {
-    if (m_tokensCount >= m_tokensCapacity) {
-        m_tokensCapacity *= 2;
-        Token* tokens = new Token[m_tokensCapacity];
-        for (uint32_t i=0; i!=m_tokensCount; ++i) {
-            tokens[i] = m_tokens[i];
-        }
-        if (m_parent != nullptr) {
-            auto parentIndex = std::distance(m_tokens, m_parent);
-            m_parent = &tokens[parentIndex];
-        }
-        delete[] m_tokens;
-        m_tokens = tokens;
+uint32_t Json::NextUIntOrNull(bool& isUInt) {
+    auto text = AsString(Next(TokenType::Primitive));
+    if (text == "null") {
+        isUInt = false;
+        return 0;
     }
+
+    uint32_t value;
+    const char* endIt = text.data() + text.size();
+    if (auto [p, ec] = std::from_chars(text.data(), endIt, value); ((ec != std::errc()) || (p != endIt))) {
+        throw ProxyError("unexpected unsigned integer token value");
+    }
+
+    isUInt = true;
+    return value;
+}
+
+std::string_view Json::AsString(const Token* token) const {
+    return std::string_view(m_text + token->start, token->end - token->start);
+}
+
+Token* Json::NewToken(TokenType type, uint32_t start, uint32_t end) {
+    // The room is reserved by ReserveTokens
     Token* token = &m_tokens[m_tokensCount++];
     token->type = type;
     token->start = start;
     token->end = end;
     token->size = 0;
 
+    if (m_parent != NO_PARENT) {
+        m_tokens[m_parent].size++;
+    }
+
     return token;
 }
 
-void Json::ParsePrimitive() {
-    for (char* start = m_textIt; *m_textIt != '\0'; ++m_textIt) {
-        switch (*m_textIt) {
-#ifndef JSMN_STRICT
-        // In strict mode primitive must be followed by "," or "}" or "]"
-        case ':':
-#endif
+void Json::Reset() {
+    m_error.clear();
+    m_textIt = 0;
+    m_indexIt = 0;
+    m_indexCount = 0;
+    m_indexedSize = 0;
+    m_stringIndexIt = 0;
+    m_stringEscaped = false;
+    m_stackCount = 0;
+    m_parent = NO_PARENT;
+    m_tokensIt = 0;
+    m_tokensCount = 0;
+}
+
+void Json::BuildIndex(uint32_t size) {
+    for (uint32_t begin=m_indexedSize; begin < size; begin += INDEX_BLOCK_SIZE) {
+        uint32_t end = std::min(size, begin + INDEX_BLOCK_SIZE);
+        grow(m_index, m_indexCount, m_indexCapacity, m_indexCount + (end - begin));
+        m_indexCount += scanStructural(m_text, begin, end, m_index + m_indexCount);
+    }
+    m_indexedSize = std::max(m_indexedSize, size);
+    ReserveTokens(0);
+}
+
+void Json::ReserveTokens(uint32_t primitivesCount) {
+    // An opening bracket or a string takes at least one structural character per token and a stack
+    // item per bracket, a primitive in valid JSON follows ':', ',' or '[', which give no tokens
+    // themselves, or is the whole message. Other primitives are counted by the caller.
+    uint32_t structuralCount = m_indexCount - m_indexIt;
+    grow(m_tokens, m_tokensCount, m_tokensCapacity, m_tokensCount + structuralCount + primitivesCount + 1);
+    grow(m_stack, m_stackCount, m_stackCapacity, m_stackCount + structuralCount);
+}
+
+void Json::ParsePrimitives(uint32_t it, uint32_t end) {
+    if (it == end) {
+        return;
+    }
+    // Primitives of invalid JSON can be separated by whitespaces only, one of them is reserved already
+    ReserveTokens((end - it) / 2);
+
+    while (it != end) {
+        switch (m_text[it]) {
         case '\t':
         case '\r':
         case '\n':
         case ' ':
-        case ',':
-        case ']':
-        case '}':
-            NewToken(TokenType::Primitive, start, m_textIt);
-            --m_textIt;
-            return;
+            ++it;
+            continue;
         default:
             break;
         }
-        if ((*m_textIt < 32) || (*m_textIt >= 127)) {
+
+#ifdef JSMN_STRICT
+        // In strict mode primitives are: numbers and booleans
+        if (strchr("-0123456789tfn", m_text[it]) == nullptr) {
             throw ProxyError(STRING_INVALID);
         }
-    }
-#ifdef JSMN_STRICT
-    // In strict mode primitive must be followed by a comma/object/array
-    throw ProxyError(JSON_INVALID);
+        // And they must not be keys of the object
+        if (m_parent != NO_PARENT) {
+            const Token& parent = m_tokens[m_parent];
+            if ((parent.type == TokenType::Object) || ((parent.type == TokenType::String) && (parent.size != 0))) {
+                throw ProxyError(STRING_INVALID);
+            }
+        }
 #endif
+
+        uint32_t start = it;
+        for (; it != end; ++it) {
+            char c = m_text[it];
+            if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
+                break;
+            }
+            if ((c < 32) || (c >= 127)) {
+                throw ProxyError(STRING_INVALID);
+            }
+        }
+        NewToken(TokenType::Primitive, start, it);
+    }
 }
 
-void Json::ParseString() {
-    ++m_textIt;
-    char* startIt = m_textIt;
-    char* writeIt = m_textIt;
+bool Json::ParseString() {
+    // m_indexIt points to the opening quote, the search of the closing quote
+    // continues from the place where the previous Feed call stopped
+    if (m_stringIndexIt <= m_indexIt) {
+        m_stringIndexIt = m_indexIt + 1;
+        m_stringEscaped = false;
+    }
 
-    while (*m_textIt != '\0') {
-        if (*m_textIt == '\"') {
-            NewToken(TokenType::String, startIt, writeIt);
-            return;
+    // Find the closing quote using the index, the string content itself is not read
+    uint32_t closeIt = 0;
+    for (; m_stringIndexIt < m_indexCount; ++m_stringIndexIt) {
+        uint32_t pos = m_index[m_stringIndexIt];
+        if (m_text[pos] == '\"') {
+            closeIt = pos;
+            break;
+        }
+        if (m_text[pos] == '\\') {
+            // The escaped character has not been received yet
+            if (pos + 1 >= m_indexedSize) {
+                return false;
+            }
+            m_stringEscaped = true;
+            // The next character is escaped, skip it if it is a part of index
+            if ((m_stringIndexIt + 1 < m_indexCount) && (m_index[m_stringIndexIt + 1] == pos + 1)) {
+                ++m_stringIndexIt;
+            }
         }
+    }
 
-        if ((*m_textIt == '\\') && (m_textIt[1] != '\0')) {
-            ++m_textIt;
-            switch (*m_textIt++) {
-            case '\"':
-                *writeIt++ = '\"';
-                break;
-            case '/':
-                *writeIt++ = '/';
-                break;
-            case '\\':
-                *writeIt++ = '\\';
-                break;
-            case 'b':
-                *writeIt++ = '\b';
-                break;
-            case 'f':
-                *writeIt++ = '\f';
-                break;
-            case 'r':
-                *writeIt++ = '\r';
-                break;
-            case 'n':
-                *writeIt++ = '\b';
-                break;
-            case 't':
-                *writeIt++ = '\t';
-                break;
-            // \uXXXX
-            case 'u':
-                writeIt = toUtf8(m_textIt, writeIt);
-                m_textIt += 4;
-                break;
-            default:
+    if (closeIt == 0) {
+        return false;
+    }
+
+    uint32_t start = m_index[m_indexIt] + 1;
+    m_indexIt = m_stringIndexIt;
+    if (!m_stringEscaped) {
+        NewToken(TokenType::String, start, closeIt);
+        return true;
+    }
+
+    char* closePtr = m_text + closeIt;
+    char* readIt = m_text + start;
+    char* writeIt = readIt;
+    while (readIt != closePtr) {
+        if (*readIt != '\\') {
+            *writeIt++ = *readIt++;
+            continue;
+        }
+
+        ++readIt;
+        switch (*readIt++) {
+        case '\"':
+            *writeIt++ = '\"';
+            break;
+        case '/':
+            *writeIt++ = '/';
+            break;
+        case '\\':
+            *writeIt++ = '\\';
+            break;
+        case 'b':
+            *writeIt++ = '\b';
+            break;
+        case 'f':
+            *writeIt++ = '\f';
+            break;
+        case 'r':
+            *writeIt++ = '\r';
+            break;
+        case 'n':
+            *writeIt++ = '\n';
+            break;
+        case 't':
+            *writeIt++ = '\t';
+            break;
+        // \uXXXX
+        case 'u':
+            if (closePtr - readIt < 4) {
                 throw ProxyError(STRING_INVALID);
             }
-        } else {
-            *writeIt++ = *m_textIt++;
+            writeIt = toUtf8(readIt, writeIt);
+            readIt += 4;
+            break;
+        default:
+            throw ProxyError(STRING_INVALID);
         }
     }
+    NewToken(TokenType::String, start, static_cast<uint32_t>(writeIt - m_text));
 
-    throw ProxyError(JSON_INVALID);
+    return true;
 }
 
-void Json::ParseImpl() {
-    for (; *m_textIt != '\0'; ++m_textIt) {
-        int32_t i;
+void Json::ParseImpl(uint32_t size, bool isFinal) {
+    // Stage two of the parser: walk over the structural index, the bytes between
+    // two structural characters can contain only whitespaces and primitives.
+    // If the message is not full, stop on the first string which is not closed yet,
+    // the trailing primitive is parsed only in the final call.
+    for (; m_indexIt < m_indexCount; ++m_indexIt) {
+        uint32_t pos = m_index[m_indexIt];
+        if (pos < m_textIt) {
+            // The character inside an already parsed string
+            continue;
+        }
+        ParsePrimitives(m_textIt, pos);
+        m_textIt = pos;
+
         TokenType type;
-        char c = *m_textIt;
+        char c = m_text[pos];
         switch (c) {
         case '{':
         case '[':
             type = (c == '{' ? TokenType::Object : TokenType::Array);
-            NewToken(type, m_textIt, nullptr);
-            if (m_parent != nullptr) {
-                m_parent->size++;
-            }
-            m_parent = &m_tokens[m_tokensCount - 1];
+            NewToken(type, pos, 0);
+            m_parent = m_stack[m_stackCount++] = m_tokensCount - 1;
             break;
         case '}':
         case ']':
             type = (c == '}' ? TokenType::Object : TokenType::Array);
-            for (i=static_cast<int32_t>(m_tokensCount - 1); i >= 0; --i) {
-                Token* token = &m_tokens[i];
-                if (token->end == nullptr) {
-                    if (token->type != type) {
-                        throw ProxyError(STRING_INVALID);
-                    }
-                    m_parent = nullptr;
-                    token->end = m_textIt + 1;
-                    break;
-                }
-            }
             // Error if unmatched closing bracket
-            if (i == -1) {
+            if ((m_stackCount == 0) || (m_tokens[m_stack[m_stackCount - 1]].type != type)) {
                 throw ProxyError(STRING_INVALID);
             }
-            for (; i >= 0; --i) {
-                Token* token = &m_tokens[i];
-                if (token->end == nullptr) {
-                    m_parent = &m_tokens[i];
-                    break;
-                }
-            }
+            m_tokens[m_stack[--m_stackCount]].end = pos + 1;
+            m_parent = (m_stackCount == 0) ? NO_PARENT : m_stack[m_stackCount - 1];
             break;
         case '\"':
-            ParseString();
-            if (m_parent != nullptr) {
-                m_parent->size++;
+            if (!ParseString()) {
+                if (isFinal) {
+                    throw ProxyError(JSON_INVALID);
+                }
+                return;
             }
-            break;
-        case '\t':
-        case '\r':
-        case '\n':
-        case ' ':
+            pos = m_index[m_indexIt];
             break;
         case ':':
-            m_parent = &m_tokens[m_tokensCount - 1];
-            break;
-        case ',':
-            if ((m_parent != nullptr) && (m_parent->type != TokenType::Array) && (m_parent->type != TokenType::Object)) {
-                for (i=static_cast<int32_t>(m_tokensCount - 1); i >= 0; --i) {
-                    Token* t = &m_tokens[i];
-                    if ((t->type == TokenType::Array) || (t->type == TokenType::Object)) {
-                        if (t->end == nullptr) {
-                            m_parent = t;
-                            break;
-                        }
-                    }
-                }
+            if (m_tokensCount == 0) {
+                throw ProxyError(STRING_INVALID);
             }
+            m_parent = m_tokensCount - 1;
             break;
-#ifdef JSMN_STRICT
-        // In strict mode primitives are: numbers and booleans
-        case '-':
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-        case 't':
-        case 'f':
-        case 'n':
-            // And they must not be keys of the object
-            if (m_parent != nullptr) {
-                if ((m_parent->type == TokenType::Object) || ((m_parent->type == TokenType::String) && (m_parent->size != 0))) {
-                    throw ProxyError(STRING_INVALID);
-                }
-            }
-#else
-        // In non-strict mode every unquoted value is a primitive
-        default:
-#endif
-            ParsePrimitive();
-            if (m_parent != nullptr) {
-                m_parent->size++;
+        case ',':
+            if ((m_parent != NO_PARENT) &&
+                (m_tokens[m_parent].type != TokenType::Array) && (m_tokens[m_parent].type != TokenType::Object)) {
+                m_parent = (m_stackCount == 0) ? NO_PARENT : m_stack[m_stackCount - 1];
             }
             break;
-
-#ifdef JSMN_STRICT
-        // Unexpected char in strict mode
         default:
+            // Backslash outside of string
             throw ProxyError(STRING_INVALID);
-#endif
         }
+        m_textIt = pos + 1;
     }
 
-    for (uint32_t i=0; i!=m_tokensCount; ++i) {
+    if (isFinal) {
+        ParsePrimitives(m_textIt, size);
+        m_textIt = size;
+
         // Unmatched opened object or array
-        if (m_tokens[i].end == nullptr) {
+        if (m_stackCount != 0) {
             throw ProxyError(JSON_INVALID);
         }
     }
 }
+
+void JsonWriter::Clear() {
+    m_data.clear();
+    m_needComma = false;
+}
+
+void JsonWriter::Object(uint32_t /* size */) {
+    Separator();
+    m_data.push_back('{');
+    m_needComma = false;
+}
+
+void JsonWriter::EndObject() {
+    m_data.push_back('}');
+    m_needComma = true;
+}
+
+void JsonWriter::Key(std::string_view name) {
+    Separator();
+    WriteString(name);
+    m_data.append(": ", 2);
+    m_needComma = false;
+}
+
+void JsonWriter::Null() {
+    Separator();
+    m_data.append("null", 4);
+    m_needComma = true;
+}
+
+void JsonWriter::String(std::string_view value) {
+    Separator();
+    WriteString(value);
+    m_needComma = true;
+}
+
+void JsonWriter::Bool(bool value) {
+    Separator();
+    if (value) {
+        m_data.append("true", 4);
+    } else {
+        m_data.append("false", 5);
+    }
+    m_needComma = true;
+}
+
+void JsonWriter::UInt(uint64_t value) {
+    Separator();
+    char data[20];
+    auto [p, ec] = std::to_chars(data, data + sizeof(data), value);
+    m_data.append(data, static_cast<size_t>(p - data));
+    m_needComma = true;
+}
+
+void JsonWriter::Separator() {
+    if (m_needComma) {
+        m_data.append(", ", 2);
+    }
+}
+
+void JsonWriter::WriteString(std::string_view value) {
+    static const char* hex = "0123456789abcdef";
+
+    m_data.push_back('\"');
+    // UTF-8 is valid in JSON strings, only quote, backslash and control characters are escaped
+    const char* it = value.data();
+    const char* endIt = value.data() + value.size();
+    const char* runBegin = it;
+    for (; it != endIt; ++it) {
+        auto ch = static_cast<unsigned char>(*it);
+        if ((ch >= 0x20) && (ch != '\"') && (ch != '\\')) {
+            continue;
+        }
+
+        m_data.append(runBegin, static_cast<size_t>(it - runBegin));
+        runBegin = it + 1;
+        switch (ch) {
+        case '\"':
+            m_data.append("\\\"", 2);
+            break;
+        case '\\':
+            m_data.append("\\\\", 2);
+            break;
+        case '\b':
+            m_data.append("\\b", 2);
+            break;
+        case '\f':
+            m_data.append("\\f", 2);
+            break;
+        case '\n':
+            m_data.append("\\n", 2);
+            break;
+        case '\r':
+            m_data.append("\\r", 2);
+            break;
+        case '\t':
+            m_data.append("\\t", 2);
+            break;
+        default:
+            const char data[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf]};
+            m_data.append(data, sizeof(data));
+            break;
+        }
+    }
+    m_data.append(runBegin, static_cast<size_t>(it - runBegin));
+    m_data.push_back('\"');
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <cstdint>
 #include <string_view>
 
 
@@ -11,13 +13,13 @@ enum class TokenType : uint8_t {
     Primitive = 4 // Other primitive: number, boolean (true/false) or null
 };
 
+// Start and end are offsets in the parsed text, so tokens stay valid
+// when the caller moves its buffer between two Feed calls
 struct Token {
     TokenType type;
-    char* start;
-    char* end;
+    uint32_t start;
+    uint32_t end; // 0 for not closed object or array
     uint32_t size;
-
-    std::string_view AsString();
 };
 
 class Json {
@@ -25,31 +27,98 @@ public:
     Json();
     ~Json();
 
-    void Parse(const char* text);
+    // Tokenize the beginning of a message, text[0, size) is a prefix of the message
+    // and the caller can move or extend the buffer before the next call.
+    // Strings are unescaped in place, so the buffer must be writable.
+    // Errors are postponed until the Parse call for the same message.
+    void Feed(char* text, size_t size) noexcept;
+    // Finish tokenizing of a message that was (or was not) started with Feed,
+    // text[0, size) is the whole message, it is parsed in place without copying
+    void Parse(char* text, size_t size);
+    // Start reading of the parsed tokens from the beginning
+    void Rewind() { m_tokensIt = 0; }
+    void SkipValue();
     [[maybe_unused]] Token* Next();
     [[maybe_unused]] Token* Next(TokenType expectedType);
     [[maybe_unused]] Token* NextOrNull(TokenType expectedType, bool& isValue);
+    uint32_t NextObject();
+    uint32_t NextArrayOrNull(bool& isArray);
     void NextNull();
     std::string_view NextString();
     std::string_view NextStringOrNull(bool& isString);
     bool NextBool();
     bool NextBoolOrNull(bool& isBool);
-
-    std::string EscapeString(const char* str);
+    uint32_t NextUInt();
+    uint32_t NextUIntOrNull(bool& isUInt);
+    // Tokens left to read, a bound for the size of an array which is not read yet
+    size_t RemainingSize() const { return m_tokensCount - m_tokensIt; }
 
 protected:
-    Token* NewToken(TokenType type, char* start, char* end);
-    void ParsePrimitive();
-    void ParseString();
-    void ParseImpl();
+    std::string_view AsString(const Token* token) const;
+    Token* NewToken(TokenType type, uint32_t start, uint32_t end);
+    void Reset();
+    void BuildIndex(uint32_t size);
+    // Grow tokens and the stack for all structural characters which are not parsed yet and the primitives
+    void ReserveTokens(uint32_t primitivesCount);
+    void ParsePrimitives(uint32_t it, uint32_t end);
+    bool ParseString();
+    void ParseImpl(uint32_t size, bool isFinal);
 
 private:
     char* m_text = nullptr;
-    char* m_textIt = nullptr;
+    bool m_isStarted = false;
+    std::string m_error;
+    // Offset of the first byte that was not processed by ParseImpl
+    uint32_t m_textIt = 0;
+
+    // Positions of quotes, backslashes and structural characters, filled by BuildIndex
+    uint32_t* m_index = nullptr;
+    uint32_t m_indexIt = 0;
+    uint32_t m_indexCount = 0;
+    uint32_t m_indexCapacity = 0;
+    uint32_t m_indexedSize = 0;
+
+    // State of the string that was not closed in the previous Feed call
+    uint32_t m_stringIndexIt = 0;
+    bool m_stringEscaped = false;
+
+    // Indexes of unclosed objects and arrays
+    uint32_t* m_stack = nullptr;
+    uint32_t m_stackCount = 0;
+    uint32_t m_stackCapacity = 0;
 
     Token* m_tokens = nullptr;
-    Token* m_parent = nullptr;
+    uint32_t m_parent = UINT32_MAX;
     uint32_t m_tokensIt = 0;
     uint32_t m_tokensCount = 0;
     uint32_t m_tokensCapacity = 0;
 };
+
+// Append-only JSON builder, the buffer is reused between messages,
+// so a warmed up writer does not allocate
+class JsonWriter {
+public:
+    JsonWriter() = default;
+    ~JsonWriter() = default;
+
+    void Clear();
+    // Valid until the next change of the writer
+    std::string_view Data() const { return m_data; }
+
+    // size is not used, it keeps the interface of MsgPackWriter
+    void Object(uint32_t size);
+    void EndObject();
+    void Key(std::string_view name);
+    void Null();
+    void String(std::string_view value);
+    void Bool(bool value);
+    void UInt(uint64_t value);
+
+private:
+    void Separator();
+    void WriteString(std::string_view value);
+
+private:
+    std::string m_data;
+    bool m_needComma = false;
+};
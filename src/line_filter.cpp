@@ -0,0 +1,30 @@
+#include "line_filter.h"
+
+#include "fuzzy_rank.h"
+#include "line_store.h"
+
+
+bool MatchLine(rofi_int_matcher_t** tokens, size_t index, bool isVirtual, const LineStore& lines,
+    const FuzzyRanker& ranker, FilterCache& cache, FilterCacheHandler& handler) {
+    // The application filters the virtual list itself
+    if (isVirtual) {
+        return true;
+    }
+
+    if (index >= lines.Size()) {
+        return false;
+    }
+
+    // Rofi filters the positions counted before the ranking until it reloads, only the ranked ones are shown
+    if (ranker.IsActive()) {
+        return (index < ranker.GetRankedCount());
+    }
+
+    if (auto cached = cache.Get(tokens, index); cached != FilterResult::Unknown) {
+        return (cached == FilterResult::Matched);
+    }
+
+    bool result = handler.OnMatchLine(tokens, index);
+    cache.Set(tokens, index, result ? FilterResult::Matched : FilterResult::NotMatched);
+    return result;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+#include "filter_cache.h"
+
+
+class LineStore;
+class FuzzyRanker;
+// The answer to the token match of rofi for the line, shared by Proxy::OnLineMatch and the tests.
+// Called from the filter threads of rofi: the application filters a virtual list itself, only the ranked
+// lines are shown while the ranking is active, the other lines are tested through the filter cache.
+bool MatchLine(rofi_int_matcher_t** tokens, size_t index, bool isVirtual, const LineStore& lines,
+    const FuzzyRanker& ranker, FilterCache& cache, FilterCacheHandler& handler);
@@ -0,0 +1,334 @@
+#include "line_store.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include "exception.h"
+
+
+namespace {
+
+// Do not compact small arenas, the garbage costs less than copying
+static constexpr size_t MIN_COMPACT_SIZE = 64 * 1024;
+// Strings of a line of the patched segment which are kept by ApplyPatch
+static constexpr uint8_t KEEP_LINE = 1 << 0;
+static constexpr uint8_t KEEP_ID = 1 << 1;
+
+}
+
+LineStore::LineStore()
+    : m_arena(1, '\0') {
+
+}
+
+size_t LineStore::MemorySize() const {
+    return m_arena.capacity() +
+        (m_id.capacity() + m_text.capacity() + m_group.capacity() + m_icon.capacity() + m_matchKey.capacity() + m_iconUID.capacity()) * sizeof(uint32_t) +
+        m_flags.capacity();
+}
+
+void LineStore::Clear() {
+    m_arena.resize(1);
+    m_garbageSize = 0;
+    m_id.clear();
+    m_text.clear();
+    m_group.clear();
+    m_icon.clear();
+    m_matchKey.clear();
+    m_flags.clear();
+    m_iconUID.clear();
+}
+
+void LineStore::Reserve(size_t count) {
+    m_id.reserve(count);
+    m_text.reserve(count);
+    m_group.reserve(count);
+    m_icon.reserve(count);
+    m_matchKey.reserve(count);
+    m_flags.reserve(count);
+    m_iconUID.reserve(count);
+}
+
+void LineStore::Add(const Line& line) {
+    m_id.push_back(AddString(line.id));
+    m_text.push_back(AddString(line.text));
+    m_group.push_back(AddString(line.group));
+    m_icon.push_back(AddString(line.icon));
+    m_matchKey.push_back(AddString(line.matchKey));
+    m_flags.push_back(PackFlags(line));
+    m_iconUID.push_back(0);
+}
+
+void LineStore::Update(size_t index, const Line& line) {
+    uint32_t id = AddString(line.id);
+    uint32_t text = AddString(line.text);
+    uint32_t group = AddString(line.group);
+    uint32_t icon = AddString(line.icon);
+    uint32_t matchKey = AddString(line.matchKey);
+
+    ReleaseString(m_id[index]);
+    ReleaseString(m_text[index]);
+    ReleaseString(m_group[index]);
+    ReleaseString(m_icon[index]);
+    ReleaseString(m_matchKey[index]);
+
+    m_id[index] = id;
+    m_text[index] = text;
+    m_group[index] = group;
+    m_icon[index] = icon;
+    m_matchKey[index] = matchKey;
+    m_flags[index] = PackFlags(line);
+    m_iconUID[index] = 0;
+
+    CompactIfNeeded();
+}
+
+void LineStore::Replace(size_t begin, size_t count, LineStore&& lines) {
+    if ((begin == 0) && (count == Size())) {
+        *this = std::move(lines);
+        return;
+    }
+
+    for (size_t i=begin; i!=begin + count; ++i) {
+        ReleaseString(m_id[i]);
+        ReleaseString(m_text[i]);
+        ReleaseString(m_group[i]);
+        ReleaseString(m_icon[i]);
+        ReleaseString(m_matchKey[i]);
+    }
+
+    // The shared empty string of the other arena is not copied
+    if (m_arena.size() + lines.m_arena.size() - 1 > UINT32_MAX) {
+        throw ProxyError("too many lines data, max size is 4GB");
+    }
+    auto shift = static_cast<uint32_t>(m_arena.size() - 1);
+    m_arena.insert(m_arena.end(), lines.m_arena.begin() + 1, lines.m_arena.end());
+    m_garbageSize += lines.m_garbageSize;
+
+    auto first = static_cast<ptrdiff_t>(begin);
+    auto last = static_cast<ptrdiff_t>(begin + count);
+    auto replace = [first, last](auto& column, const auto& other) {
+        column.erase(column.begin() + first, column.begin() + last);
+        column.insert(column.begin() + first, other.begin(), other.end());
+    };
+    auto replaceOffsets = [&replace, shift](std::vector<uint32_t>& column, std::vector<uint32_t>& other) {
+        for (auto& offset: other) {
+            if (offset != 0) {
+                offset += shift;
+            }
+        }
+        replace(column, other);
+    };
+
+    replaceOffsets(m_id, lines.m_id);
+    replaceOffsets(m_text, lines.m_text);
+    replaceOffsets(m_group, lines.m_group);
+    replaceOffsets(m_icon, lines.m_icon);
+    replaceOffsets(m_matchKey, lines.m_matchKey);
+    replace(m_flags, lines.m_flags);
+    replace(m_iconUID, lines.m_iconUID);
+    lines.Clear();
+
+    CompactIfNeeded();
+}
+
+void LineStore::ApplyPatch(const LineStorePatch& patch) {
+    using Row = LineStorePatch::Row;
+    constexpr uint32_t PATCH_LINE = LineStorePatch::PATCH_LINE;
+    const LineStore& patchLines = patch.m_patchLines;
+    const size_t begin = patch.m_begin;
+    const size_t count = patch.m_count;
+    auto forEachRow = [&patch](auto&& callback) {
+        patch.m_rows.ForEach(callback);
+    };
+
+    // The strings of the patch lines are checked first, a failure leaves the store unchanged
+    size_t addedSize = 0;
+    std::vector<uint8_t> kept(count, 0);
+    forEachRow([&](const Row& row) {
+        if ((row.line & PATCH_LINE) == 0) {
+            kept[row.line - begin] |= KEEP_LINE;
+        } else {
+            size_t line = row.line & (~PATCH_LINE);
+            for (auto column: {&LineStore::m_text, &LineStore::m_group, &LineStore::m_icon, &LineStore::m_matchKey}) {
+                addedSize += strlen(&patchLines.m_arena[(patchLines.*column)[line]]) + 1;
+            }
+        }
+        if ((row.id & PATCH_LINE) == 0) {
+            kept[row.id - begin] |= KEEP_ID;
+        } else {
+            addedSize += strlen(&patchLines.m_arena[patchLines.m_id[row.id & (~PATCH_LINE)]]) + 1;
+        }
+    });
+    if (m_arena.size() + addedSize > UINT32_MAX) {
+        throw ProxyError("too many lines data, max size is 4GB");
+    }
+
+    for (size_t i=0; i!=count; ++i) {
+        if ((kept[i] & KEEP_ID) == 0) {
+            ReleaseString(m_id[begin + i]);
+        }
+        if ((kept[i] & KEEP_LINE) == 0) {
+            ReleaseString(m_text[begin + i]);
+            ReleaseString(m_group[begin + i]);
+            ReleaseString(m_icon[begin + i]);
+            ReleaseString(m_matchKey[begin + i]);
+        }
+    }
+
+    // The segment of each column is built from the old column and the patch lines in one pass
+    auto rebuild = [&](auto& column, auto&& getValue) {
+        std::vector<typename std::decay_t<decltype(column)>::value_type> segment;
+        segment.reserve(patch.Size());
+        forEachRow([&segment, &getValue](const Row& row) {
+            segment.push_back(getValue(row));
+        });
+
+        auto first = column.begin() + static_cast<ptrdiff_t>(begin);
+        if (segment.size() == count) {
+            std::copy(segment.begin(), segment.end(), first);
+        } else {
+            first = column.erase(first, first + static_cast<ptrdiff_t>(count));
+            column.insert(first, segment.begin(), segment.end());
+        }
+    };
+    auto rebuildStrings = [this, &rebuild, &patchLines](std::vector<uint32_t> LineStore::* column, bool isId) {
+        rebuild(this->*column, [this, column, isId, &patchLines](const Row& row) {
+            uint32_t line = isId ? row.id : row.line;
+            if ((line & PATCH_LINE) == 0) {
+                return (this->*column)[line];
+            }
+            return AddString(&patchLines.m_arena[(patchLines.*column)[line & (~PATCH_LINE)]]);
+        });
+    };
+
+    rebuildStrings(&LineStore::m_id, true);
+    rebuildStrings(&LineStore::m_text, false);
+    rebuildStrings(&LineStore::m_group, false);
+    rebuildStrings(&LineStore::m_icon, false);
+    rebuildStrings(&LineStore::m_matchKey, false);
+    rebuild(m_flags, [this, &patchLines](const Row& row) {
+        return ((row.line & PATCH_LINE) == 0) ? m_flags[row.line] : patchLines.m_flags[row.line & (~PATCH_LINE)];
+    });
+    rebuild(m_iconUID, [this](const Row& row) {
+        return ((row.line & PATCH_LINE) == 0) ? m_iconUID[row.line] : 0;
+    });
+
+    CompactIfNeeded();
+}
+
+void LineStore::SetMatchKey(size_t index, std::string_view key) {
+    uint32_t matchKey = AddString(key);
+    ReleaseString(m_matchKey[index]);
+    m_matchKey[index] = matchKey;
+}
+
+Line LineStore::Get(size_t index) const {
+    Line result;
+    result.filtering = IsFiltering(index);
+    result.urgent = IsUrgent(index);
+    result.active = IsActive(index);
+    result.markup = IsMarkup(index);
+    result.id = &m_arena[m_id[index]];
+    result.text = &m_arena[m_text[index]];
+    result.group = &m_arena[m_group[index]];
+    result.icon = &m_arena[m_icon[index]];
+    result.matchKey = &m_arena[m_matchKey[index]];
+
+    return result;
+}
+
+uint8_t LineStore::PackFlags(const Line& line) {
+    return static_cast<uint8_t>(
+        (line.filtering ? FILTERING : 0) | (line.urgent ? URGENT : 0) | (line.active ? ACTIVE : 0) | (line.markup ? MARKUP : 0));
+}
+
+uint32_t LineStore::AddString(std::string_view value) {
+    if (value.empty()) {
+        return 0;
+    }
+
+    size_t offset = m_arena.size();
+    if (offset + value.size() + 1 > UINT32_MAX) {
+        throw ProxyError("too many lines data, max size is 4GB");
+    }
+    m_arena.insert(m_arena.end(), value.begin(), value.end());
+    m_arena.push_back('\0');
+
+    return static_cast<uint32_t>(offset);
+}
+
+void LineStore::ReleaseString(uint32_t offset) {
+    if (offset != 0) {
+        m_garbageSize += strlen(&m_arena[offset]) + 1;
+    }
+}
+
+void LineStore::CompactIfNeeded() {
+    if ((m_arena.size() < MIN_COMPACT_SIZE) || (m_garbageSize * 2 < m_arena.size())) {
+        return;
+    }
+
+    std::vector<char> arena;
+    arena.reserve(m_arena.size() - m_garbageSize);
+    arena.push_back('\0');
+    auto copy = [&arena, this](std::vector<uint32_t>& column) {
+        for (auto& offset: column) {
+            if (offset != 0) {
+                const char* value = &m_arena[offset];
+                offset = static_cast<uint32_t>(arena.size());
+                arena.insert(arena.end(), value, value + strlen(value) + 1);
+            }
+        }
+    };
+
+    copy(m_id);
+    copy(m_text);
+    copy(m_group);
+    copy(m_icon);
+    copy(m_matchKey);
+    m_arena = std::move(arena);
+    m_garbageSize = 0;
+}
+
+LineStorePatch::LineStorePatch(const LineStore& lines, size_t begin, size_t count, const LineStore& patchLines)
+    : m_lines(lines)
+    , m_patchLines(patchLines)
+    , m_begin(begin)
+    , m_count(count) {
+
+    if ((begin + count >= PATCH_LINE) || (patchLines.Size() >= PATCH_LINE)) {
+        throw ProxyError("too many lines, max count is %u", PATCH_LINE);
+    }
+    std::vector<Row> rows;
+    rows.reserve(count);
+    for (size_t i=begin; i!=begin + count; ++i) {
+        rows.push_back(Row{static_cast<uint32_t>(i), static_cast<uint32_t>(i)});
+    }
+    m_rows = ChunkedVector<Row>(rows);
+}
+
+void LineStorePatch::Insert(size_t index, size_t patchLine) {
+    auto line = static_cast<uint32_t>(patchLine) | PATCH_LINE;
+    m_rows.Insert(index, Row{line, line});
+}
+
+void LineStorePatch::Remove(size_t index) {
+    m_rows.Take(index);
+}
+
+void LineStorePatch::Update(size_t index, size_t patchLine, bool keepId) {
+    Row& row = m_rows[index];
+    row.line = static_cast<uint32_t>(patchLine) | PATCH_LINE;
+    if (!keepId) {
+        row.id = row.line;
+    }
+}
+
+void LineStorePatch::Move(size_t from, size_t to) {
+    m_rows.Insert(to, m_rows.Take(from));
+}
+
+std::string_view LineStorePatch::GetRowId(const Row& row) const {
+    return ((row.id & PATCH_LINE) != 0) ? m_patchLines.GetId(row.id & (~PATCH_LINE)) : m_lines.GetId(row.id);
+}
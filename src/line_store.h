@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include "chunked_vector.h"
+
+
+// View of a line, strings point to a parser buffer or to a LineStore
+// and are valid until the owner is changed
+struct Line {
+    bool filtering = true;
+    bool urgent = false;
+    bool active = false;
+    bool markup = false;
+    std::string_view id;
+    std::string_view text;
+    std::string_view group;
+    std::string_view icon;
+    // Normalized text for matching (see MatchKeyBuilder), empty if the text is matched as is
+    std::string_view matchKey;
+};
+
+class LineStorePatch;
+// Columnar storage of lines: all strings are kept zero-terminated in one arena,
+// each line has offsets of its strings and packed flags
+class LineStore {
+public:
+    LineStore();
+    ~LineStore() = default;
+    LineStore(const LineStore&) = delete;
+    LineStore(LineStore&&) noexcept = default;
+    LineStore& operator=(const LineStore&) = delete;
+    LineStore& operator=(LineStore&&) noexcept = default;
+
+    size_t Size() const { return m_text.size(); }
+    size_t MemorySize() const;
+    void Clear();
+    void Reserve(size_t count);
+
+    // Strings of the line are copied, they must not point to this store
+    void Add(const Line& line);
+    void Update(size_t index, const Line& line);
+    // Replace lines [begin, begin + count) with all lines of the other store, its arena is appended as is
+    void Replace(size_t begin, size_t count, LineStore&& lines);
+    // Apply all items of the patch to its segment of this store, each column is rebuilt once
+    void ApplyPatch(const LineStorePatch& patch);
+    void SetMatchKey(size_t index, std::string_view key);
+
+    Line Get(size_t index) const;
+    const char* GetText(size_t index) const { return &m_arena[m_text[index]]; }
+    const char* GetIcon(size_t index) const { return &m_arena[m_icon[index]]; }
+    std::string_view GetId(size_t index) const { return &m_arena[m_id[index]]; }
+    const char* GetMatchText(size_t index) const { return &m_arena[(m_matchKey[index] != 0) ? m_matchKey[index] : m_text[index]]; }
+    bool HasMatchKey(size_t index) const { return m_matchKey[index] != 0; }
+    bool IsFiltering(size_t index) const { return (m_flags[index] & FILTERING) != 0; }
+    bool IsUrgent(size_t index) const { return (m_flags[index] & URGENT) != 0; }
+    bool IsActive(size_t index) const { return (m_flags[index] & ACTIVE) != 0; }
+    bool IsMarkup(size_t index) const { return (m_flags[index] & MARKUP) != 0; }
+    uint32_t& GetIconUID(size_t index) { return m_iconUID[index]; }
+
+private:
+    static constexpr uint8_t FILTERING = 1 << 0;
+    static constexpr uint8_t URGENT = 1 << 1;
+    static constexpr uint8_t ACTIVE = 1 << 2;
+    static constexpr uint8_t MARKUP = 1 << 3;
+
+    static uint8_t PackFlags(const Line& line);
+    uint32_t AddString(std::string_view value);
+    void ReleaseString(uint32_t offset);
+    void CompactIfNeeded();
+
+private:
+    // Offset 0 is a shared empty string
+    std::vector<char> m_arena;
+    // Size of strings in the arena that are not used by lines after Update and Remove
+    size_t m_garbageSize = 0;
+
+    std::vector<uint32_t> m_id;
+    std::vector<uint32_t> m_text;
+    std::vector<uint32_t> m_group;
+    std::vector<uint32_t> m_icon;
+    // 0 if the text is matched as is
+    std::vector<uint32_t> m_matchKey;
+    std::vector<uint8_t> m_flags;
+    std::vector<uint32_t> m_iconUID;
+};
+
+// Items of a patch applied to lines [begin, begin + count) of a store: every position of the segment refers
+// to a line of the store or of the patch lines. Positions are kept in a ChunkedVector, so an item does not
+// move all columns of the store, and LineStore::ApplyPatch rebuilds each column of the segment once
+// for the whole patch. The stores must not be changed until then.
+class LineStorePatch {
+public:
+    LineStorePatch() = delete;
+    LineStorePatch(const LineStore& lines, size_t begin, size_t count, const LineStore& patchLines);
+    ~LineStorePatch() = default;
+    LineStorePatch(const LineStorePatch&) = delete;
+    LineStorePatch& operator=(const LineStorePatch&) = delete;
+
+    size_t Size() const { return m_rows.Size(); }
+    void Insert(size_t index, size_t patchLine);
+    void Remove(size_t index);
+    // The line takes the strings and flags of the patch line, with keepId its id is not changed
+    void Update(size_t index, size_t patchLine, bool keepId);
+    // The same as LineStore::Move
+    void Move(size_t from, size_t to);
+    std::string_view GetId(size_t index) const { return GetRowId(m_rows[index]); }
+
+    // Calls callback(index, id) for each line of the patched segment in order
+    template <typename Callback> void ForEachId(Callback&& callback) const {
+        size_t index = 0;
+        m_rows.ForEach([this, &index, &callback](const Row& row) {
+            callback(index++, GetRowId(row));
+        });
+    }
+
+private:
+    friend class LineStore;
+    // Lines of the patch store are marked with the high bit
+    static constexpr uint32_t PATCH_LINE = UINT32_C(1) << 31;
+
+    struct Row {
+        // Line with the strings and flags
+        uint32_t line;
+        // Line with the id
+        uint32_t id;
+    };
+
+    std::string_view GetRowId(const Row& row) const;
+
+private:
+    const LineStore& m_lines;
+    const LineStore& m_patchLines;
+    size_t m_begin;
+    size_t m_count;
+    ChunkedVector<Row> m_rows;
+};
@@ -1,29 +1,49 @@
 #include "logger.h"
 
+#include <chrono>
+#include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "exception.h"
 
 
+namespace {
+
+// The writer thread wakes up with this period, producers do not notify it
+static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(20);
+static constexpr size_t BATCH_SIZE = 64 * 1024;
+
+}
+
 Logger::Logger() {
-    GetBuffer(1023);
+
 }
 
 Logger::~Logger() {
+    if (m_writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeup.notify_one();
+        m_writer.join();
+
+        std::vector<char> batch(128);
+        int cnt = snprintf(batch.data(), batch.size(), "Log records: %zu written, %zu dropped, %zu truncated\n",
+            m_writtenCount, m_droppedTotal, m_truncatedCount);
+        batch.resize(std::min(static_cast<size_t>(std::max(cnt, 0)), batch.size() - 1));
+        WriteBatch(batch);
+    }
+
     if (m_logFd >= 0) {
         close(m_logFd);
         m_logFd = -1;
     }
-
-    if (m_buf != nullptr) {
-        delete[] m_buf;
-        m_buf = nullptr;
-    }
-
-    m_bufSize = 0;
 }
 
 void Logger::EnableFileLogging() {
@@ -49,37 +69,118 @@ void Logger::EnableFileLogging() {
     if (m_logFd < 0) {
         throw ProxyError("can't open file '%s' for write log", logPath.c_str());
     }
-}
 
-char* Logger::GetBuffer(size_t size) {
-    if (size <= m_bufSize) {
-        return m_buf;
+    m_records = std::make_unique<Record[]>(RECORDS_COUNT);
+    for (size_t i=0; i!=RECORDS_COUNT; ++i) {
+        m_records[i].sequence.store(i, std::memory_order_relaxed);
     }
+    m_writer = std::thread(&Logger::WriteLoop, this);
+}
 
-    if (m_buf != nullptr) {
-        delete[] m_buf;
+Logger::Record* Logger::Claim(size_t& position) {
+    static_assert((RECORDS_COUNT & (RECORDS_COUNT - 1)) == 0, "RECORDS_COUNT must be a power of two");
+
+    position = m_head.load(std::memory_order_relaxed);
+    while (true) {
+        Record* record = &m_records[position & (RECORDS_COUNT - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                return record;
+            }
+        } else if (sequence < position) {
+            // The record of the previous round is not written yet, the ring is full
+            return nullptr;
+        } else {
+            position = m_head.load(std::memory_order_relaxed);
+        }
     }
+}
+
+void Logger::Commit(Record* record, size_t position) {
+    record->sequence.store(position + 1, std::memory_order_release);
+}
 
-    m_bufSize = ((size >> 7) + 1) << 7;
-    m_buf = new char[m_bufSize];
+void Logger::WriteLoop() {
+    std::vector<char> batch;
+    batch.reserve(BATCH_SIZE + RECORD_TEXT_SIZE + 64);
+    while (true) {
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait_for(lock, FLUSH_INTERVAL, [this]() { return m_stop; });
+            stop = m_stop;
+        }
 
-    return m_buf;
+        Drain(batch);
+        if (stop) {
+            return;
+        }
+    }
 }
 
-void Logger::Write(bool isError, const void* buffer, size_t count) {
-    if (m_logFd >= 0) {
-        ssize_t writteCount = ::write(m_logFd, buffer, count);
-        if (writteCount != static_cast<ssize_t>(count)) {
-            throw ProxyError("can't write log to file");
+void Logger::Drain(std::vector<char>& batch) {
+    char suffix[64];
+    batch.clear();
+    if (size_t dropped = m_droppedCount.exchange(0, std::memory_order_relaxed); dropped != 0) {
+        m_droppedTotal += dropped;
+        int cnt = snprintf(suffix, sizeof(suffix), "%zu log records are dropped\n", dropped);
+        batch.insert(batch.end(), suffix, suffix + std::min(static_cast<size_t>(std::max(cnt, 0)), sizeof(suffix) - 1));
+    }
+
+    while (true) {
+        Record& record = m_records[m_tail & (RECORDS_COUNT - 1)];
+        if (record.sequence.load(std::memory_order_acquire) != m_tail + 1) {
+            break;
+        }
+
+        size_t size = std::min(record.fullSize, RECORD_TEXT_SIZE - 1);
+        if (size != 0) {
+            batch.insert(batch.end(), record.text, record.text + size);
+            if (size != record.fullSize) {
+                ++m_truncatedCount;
+                int cnt = snprintf(suffix, sizeof(suffix), "... (%zu bytes)", record.fullSize);
+                batch.insert(batch.end(), suffix, suffix + std::min(static_cast<size_t>(std::max(cnt, 0)), sizeof(suffix) - 1));
+            }
+            batch.push_back('\n');
+            ++m_writtenCount;
+        }
+        record.sequence.store(m_tail + RECORDS_COUNT, std::memory_order_release);
+        ++m_tail;
+
+        if (batch.size() >= BATCH_SIZE) {
+            WriteBatch(batch);
         }
     }
 
-    if (isError) {
-        auto writteCount = ::write(STDERR_FILENO, buffer, count);
-        if (writteCount != static_cast<ssize_t>(count)) {
-            throw ProxyError("can't write log to stderr");
+    WriteBatch(batch);
+}
+
+void Logger::WriteBatch(std::vector<char>& batch) {
+    for (size_t offset = 0; (offset != batch.size()) && (!m_writeFailed);) {
+        ssize_t writteCount = ::write(m_logFd, batch.data() + offset, batch.size() - offset);
+        if (writteCount > 0) {
+            offset += static_cast<size_t>(writteCount);
+        } else if ((writteCount < 0) && (errno == EINTR)) {
+            continue;
+        } else {
+            // The writer thread can't throw, the rest of the log is skipped
+            m_writeFailed = true;
+            const char* text = "can't write log to file";
+            WriteError(text, strlen(text));
         }
     }
+
+    batch.clear();
+}
+
+void Logger::WriteError(const char* text, size_t size) {
+    char newLine = '\n';
+    iovec parts[2] = {
+        iovec{const_cast<char*>(text), size},
+        iovec{&newLine, 1},
+    };
+    [[maybe_unused]] auto writteCount = ::writev(STDERR_FILENO, parts, 2);
 }
 
 void Logger::Raise(const char* text) {
@@ -1,19 +1,57 @@
 #pragma once
 
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <cstdio>
+#include <cstdint>
 #include <utility>
+#include <algorithm>
+#include <condition_variable>
 
 
+// The lowest level which is compiled in (see ROFI_PROXY_LOG_LEVEL in CMakeLists.txt),
+// calls of lower levels are removed with their arguments
+#ifndef ROFI_PROXY_LOG_LEVEL
+#define ROFI_PROXY_LOG_LEVEL 1
+#endif
+
+enum class LogLevel : int {
+    // Calls per line: GetLinesCount, GetLine, GetIcon
+    Trace = 0,
+    Debug = 1,
+    // Errors are always compiled in, they are also written to stderr
+    Error = 2,
+};
+
+static constexpr LogLevel COMPILED_LOG_LEVEL = static_cast<LogLevel>(ROFI_PROXY_LOG_LEVEL);
+
+// Records are formatted by the calling thread into a lock-free ring, a background thread
+// writes them to the log file in batches. Records which do not fit into the ring are dropped and counted.
 class Logger {
 public:
     Logger();
     ~Logger();
 
 public:
+    // Longer records (dumps of messages) are truncated, dumps use it as the precision of "%.*s"
+    // so the formatting does not read the whole message
+    static constexpr size_t RECORD_TEXT_SIZE = 1024;
+
     void EnableFileLogging();
 
-    template<typename ... Args> void Debug(const char* format, Args&&... args) {
-        WriteWithFormat(false, format, std::forward<Args>(args)...);
+    template<typename ... Args> void Trace([[maybe_unused]] const char* format, [[maybe_unused]] Args&&... args) {
+        if constexpr (COMPILED_LOG_LEVEL <= LogLevel::Trace) {
+            WriteWithFormat(false, format, std::forward<Args>(args)...);
+        }
+    }
+
+    template<typename ... Args> void Debug([[maybe_unused]] const char* format, [[maybe_unused]] Args&&... args) {
+        if constexpr (COMPILED_LOG_LEVEL <= LogLevel::Debug) {
+            WriteWithFormat(false, format, std::forward<Args>(args)...);
+        }
     }
 
     template<typename ... Args> void Error(const char* format, Args&&... args) {
@@ -21,8 +59,26 @@ public:
     }
 
 private:
-    char* GetBuffer(size_t size);
-    void Write(bool isError, const void* buffer, size_t count);
+    static constexpr size_t RECORDS_COUNT = 4096;
+
+    struct Record {
+        // Equal to the position of a free record, to the position + 1 of a written one
+        std::atomic<size_t> sequence;
+        // Size of the formatted text before the truncation
+        size_t fullSize;
+        bool isError;
+        char text[RECORD_TEXT_SIZE];
+    };
+
+    // Returns nullptr if the ring is full
+    Record* Claim(size_t& position);
+    void Commit(Record* record, size_t position);
+    void WriteLoop();
+    // Writes all committed records, called by the writer thread only
+    void Drain(std::vector<char>& batch);
+    void WriteBatch(std::vector<char>& batch);
+    // Failures are ignored, a claimed record must be committed
+    void WriteError(const char* text, size_t size);
     void Raise(const char* text);
 
     template<typename ... Args>
@@ -30,20 +86,53 @@ private:
         if ((!isError) && (m_logFd < 0)) {
             return;
         }
-        int cnt = snprintf(nullptr, 0, format, std::forward<Args>(args)...);
+
+        size_t position = 0;
+        Record* record = nullptr;
+        if (m_logFd >= 0) {
+            record = Claim(position);
+            if (record == nullptr) {
+                m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+                if (!isError) {
+                    return;
+                }
+            }
+        }
+
+        // Errors without a record are still written to stderr
+        char errorText[RECORD_TEXT_SIZE];
+        char* text = (record != nullptr) ? record->text : errorText;
+        int cnt = snprintf(text, RECORD_TEXT_SIZE, format, std::forward<Args>(args)...);
+        size_t fullSize = (cnt > 0) ? static_cast<size_t>(cnt) : 0;
+        size_t size = std::min(fullSize, RECORD_TEXT_SIZE - 1);
+        // The record can be reused as soon as it is committed
+        if (isError) {
+            WriteError(text, size);
+        }
+        if (record != nullptr) {
+            record->fullSize = fullSize;
+            record->isError = isError;
+            Commit(record, position);
+        }
         if (cnt <= 0) {
             Raise("error during log formatting");
         }
-        size_t size = static_cast<size_t>(cnt) + 1; // extra space for '\0'
-
-        char* buffer = GetBuffer(size);
-        snprintf(buffer, size, format, std::forward<Args>(args)...);
-        buffer[cnt] = '\n'; // repce '\0' to '\n'
-        Write(isError, reinterpret_cast<const void*>(buffer), size);
     }
 
 private:
     int m_logFd = -1;
-    char* m_buf = nullptr;
-    size_t m_bufSize = 0;
+    std::unique_ptr<Record[]> m_records;
+    alignas(64) std::atomic<size_t> m_head = 0;
+    alignas(64) std::atomic<size_t> m_droppedCount = 0;
+
+    // Writer thread state
+    size_t m_tail = 0;
+    size_t m_writtenCount = 0;
+    size_t m_droppedTotal = 0;
+    size_t m_truncatedCount = 0;
+    bool m_writeFailed = false;
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
 };
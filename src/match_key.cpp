@@ -0,0 +1,159 @@
+#include "match_key.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <cstdlib>
+#include <cstring>
+
+#include "defer.h"
+#include "line_store.h"
+
+
+namespace {
+
+static bool IsAscii(std::string_view text) {
+    for (char ch: text) {
+        if ((static_cast<unsigned char>(ch) & 0x80) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Append the character of the entity without '&' and ';', returns false for an unknown entity
+static bool AppendEntity(std::string_view name, std::string& result) {
+    static const struct {
+        const char* name;
+        char value;
+    } NAMED[] = {{"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '\"'}, {"apos", '\''}};
+
+    for (const auto& entity: NAMED) {
+        if (name == entity.name) {
+            result.push_back(entity.value);
+            return true;
+        }
+    }
+
+    if ((name.size() < 2) || (name[0] != '#')) {
+        return false;
+    }
+    int base = 10;
+    size_t begin = 1;
+    if ((name[1] == 'x') || (name[1] == 'X')) {
+        base = 16;
+        begin = 2;
+    }
+    std::string digits(name.substr(begin));
+    char* end = nullptr;
+    unsigned long code = strtoul(digits.c_str(), &end, base);
+    if (digits.empty() || (*end != '\0') || (code > 0x10FFFF) || (g_unichar_validate(static_cast<gunichar>(code)) == FALSE)) {
+        return false;
+    }
+
+    char buffer[6];
+    int size = g_unichar_to_utf8(static_cast<gunichar>(code), buffer);
+    result.append(buffer, static_cast<size_t>(size));
+    return true;
+}
+
+}
+
+void MatchKeyBuilder::Build(LineStore& lines) const {
+    std::string key;
+    for (size_t i=0; i!=lines.Size(); ++i) {
+        if (lines.IsFiltering(i) && (!lines.HasMatchKey(i)) && Normalize(lines.GetText(i), lines.IsMarkup(i), key)) {
+            lines.SetMatchKey(i, key);
+        }
+    }
+}
+
+const char* MatchKeyBuilder::NormalizeInput(const char* text) {
+    if ((text == nullptr) || (!IsFolding())) {
+        return text;
+    }
+
+    m_input = text;
+    Fold(m_input);
+    return m_input.c_str();
+}
+
+bool MatchKeyBuilder::Normalize(std::string_view text, bool isMarkup, std::string& result) const {
+    if ((!isMarkup) && ((!IsFolding()) || ((!m_foldCase) && IsAscii(text)))) {
+        return false;
+    }
+
+    if (isMarkup) {
+        StripMarkup(text, result);
+    } else {
+        result = text;
+    }
+    Fold(result);
+
+    return (result != text);
+}
+
+void MatchKeyBuilder::StripMarkup(std::string_view text, std::string& result) {
+    result.clear();
+    for (size_t i=0; i!=text.size(); ++i) {
+        char ch = text[i];
+        if (ch == '<') {
+            // Tags are not shown, '<' of the text is always an entity
+            size_t end = text.find('>', i);
+            if (end == std::string_view::npos) {
+                break;
+            }
+            i = end;
+        } else if (ch == '&') {
+            size_t end = text.find(';', i);
+            if ((end != std::string_view::npos) && AppendEntity(text.substr(i + 1, end - i - 1), result)) {
+                i = end;
+            } else {
+                result.push_back(ch);
+            }
+        } else {
+            result.push_back(ch);
+        }
+    }
+}
+
+void MatchKeyBuilder::Fold(std::string& text) const {
+    if (IsAscii(text)) {
+        if (m_foldCase) {
+            for (auto& ch: text) {
+                if ((ch >= 'A') && (ch <= 'Z')) {
+                    ch = static_cast<char>(ch - 'A' + 'a');
+                }
+            }
+        }
+        return;
+    }
+
+    if (m_foldAccents) {
+        // Decompose characters and drop the combining marks: "é" -> "e" + U+0301 -> "e"
+        gchar* decomposed = g_utf8_normalize(text.c_str(), static_cast<gssize>(text.size()), G_NORMALIZE_NFKD);
+        if (decomposed != nullptr) {
+            Defer _([decomposed](...) { g_free(decomposed); });
+            const gchar* end = decomposed + strlen(decomposed);
+            text.clear();
+            for (const gchar* it = decomposed; it != nullptr;) {
+                const gchar* next = g_utf8_find_next_char(it, end);
+                if (g_unichar_ismark(g_utf8_get_char(it)) == FALSE) {
+                    text.append(it, static_cast<size_t>(((next != nullptr) ? next : end) - it));
+                }
+                it = next;
+            }
+        }
+    }
+
+    if (m_foldCase) {
+        gchar* folded = g_utf8_casefold(text.c_str(), static_cast<gssize>(text.size()));
+        if (folded != nullptr) {
+            text = folded;
+            g_free(folded);
+        }
+    }
+}
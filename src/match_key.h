@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+
+class LineStore;
+// Builds the text which rofi matches against the user input: Pango markup is stripped and entities are decoded,
+// optionally the case and accents are folded. Keys are built once when lines are received, folding is applied
+// to the user input too. Const methods are called from the reader threads.
+class MatchKeyBuilder {
+public:
+    MatchKeyBuilder() = default;
+    ~MatchKeyBuilder() = default;
+
+    void SetFoldCase(bool value) { m_foldCase = value; }
+    void SetFoldAccents(bool value) { m_foldAccents = value; }
+    bool IsFolding() const { return m_foldCase || m_foldAccents; }
+
+    // Set keys of the lines which do not have them and differ from their text
+    void Build(LineStore& lines) const;
+    // Normalize the user input the same way as keys, the result is valid until the next call
+    const char* NormalizeInput(const char* text);
+
+private:
+    // Returns false if the key is the text itself
+    bool Normalize(std::string_view text, bool isMarkup, std::string& result) const;
+    static void StripMarkup(std::string_view text, std::string& result);
+    void Fold(std::string& text) const;
+
+private:
+    bool m_foldCase = false;
+    bool m_foldAccents = false;
+    std::string m_input;
+};
@@ -0,0 +1,343 @@
+#include "msgpack.h"
+
+#include "exception.h"
+
+
+static const char MSGPACK_INVALID[] = "the MessagePack packet is not full, more bytes expected";
+
+void MsgPack::Parse(const char* data, size_t size) {
+    m_begin = reinterpret_cast<const uint8_t*>(data);
+    m_it = m_begin;
+    m_end = m_begin + size;
+}
+
+void MsgPack::SkipValue() {
+    // Number of values left to skip, containers add their items
+    uint64_t count = 1;
+    for (; count != 0; --count) {
+        uint8_t type = ReadByte();
+        if ((type <= 0x7f) || (type >= 0xe0) || (type == 0xc0) || (type == 0xc2) || (type == 0xc3)) {
+            continue;
+        }
+        if ((type & 0xf0) == 0x80) {
+            count += 2 * (type & 0x0f);
+            continue;
+        }
+        if ((type & 0xf0) == 0x90) {
+            count += type & 0x0f;
+            continue;
+        }
+        if ((type & 0xe0) == 0xa0) {
+            Skip(type & 0x1f);
+            continue;
+        }
+
+        switch (type) {
+        case 0xc4: // bin 8
+        case 0xd9: // str 8
+            Skip(ReadBigEndian(1));
+            break;
+        case 0xc5: // bin 16
+        case 0xda: // str 16
+            Skip(ReadBigEndian(2));
+            break;
+        case 0xc6: // bin 32
+        case 0xdb: // str 32
+            Skip(ReadBigEndian(4));
+            break;
+        case 0xc7: // ext 8
+        case 0xc8: // ext 16
+        case 0xc9: // ext 32
+            Skip(ReadBigEndian(size_t(1) << (type - 0xc7)) + 1);
+            break;
+        case 0xca: // float 32
+            Skip(4);
+            break;
+        case 0xcb: // float 64
+            Skip(8);
+            break;
+        case 0xcc: // uint 8 - uint 64
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            Skip(uint64_t(1) << (type - 0xcc));
+            break;
+        case 0xd0: // int 8 - int 64
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+            Skip(uint64_t(1) << (type - 0xd0));
+            break;
+        case 0xd4: // fixext 1 - fixext 16
+        case 0xd5:
+        case 0xd6:
+        case 0xd7:
+        case 0xd8:
+            Skip((uint64_t(1) << (type - 0xd4)) + 1);
+            break;
+        case 0xdc: // array 16
+            count += ReadBigEndian(2);
+            break;
+        case 0xdd: // array 32
+            count += ReadBigEndian(4);
+            break;
+        case 0xde: // map 16
+            count += 2 * ReadBigEndian(2);
+            break;
+        case 0xdf: // map 32
+            count += 2 * ReadBigEndian(4);
+            break;
+        default:
+            throw ProxyError("unexpected MessagePack type 0x%02x", type);
+        }
+    }
+}
+
+uint32_t MsgPack::NextObject() {
+    uint8_t type = ReadByte();
+    if ((type & 0xf0) == 0x80) {
+        return type & 0x0f;
+    }
+    if (type == 0xde) {
+        return static_cast<uint32_t>(ReadBigEndian(2));
+    }
+    if (type == 0xdf) {
+        return static_cast<uint32_t>(ReadBigEndian(4));
+    }
+
+    throw ProxyError("unexpected MessagePack type 0x%02x, expected map", type);
+}
+
+uint32_t MsgPack::NextArrayOrNull(bool& isArray) {
+    uint8_t type = ReadByte();
+    isArray = true;
+    if ((type & 0xf0) == 0x90) {
+        return type & 0x0f;
+    }
+    if (type == 0xdc) {
+        return static_cast<uint32_t>(ReadBigEndian(2));
+    }
+    if (type == 0xdd) {
+        return static_cast<uint32_t>(ReadBigEndian(4));
+    }
+    if (type == 0xc0) {
+        isArray = false;
+        return 0;
+    }
+
+    throw ProxyError("unexpected MessagePack type 0x%02x, expected array", type);
+}
+
+void MsgPack::NextNull() {
+    if (uint8_t type = ReadByte(); type != 0xc0) {
+        throw ProxyError("unexpected MessagePack type 0x%02x, expected nil", type);
+    }
+}
+
+std::string_view MsgPack::NextString() {
+    bool isString;
+    auto result = NextStringOrNull(isString);
+    if (!isString) {
+        throw ProxyError("unexpected MessagePack nil, expected string");
+    }
+
+    return result;
+}
+
+std::string_view MsgPack::NextStringOrNull(bool& isString) {
+    uint8_t type = ReadByte();
+    isString = (type != 0xc0);
+    if (!isString) {
+        return std::string_view();
+    }
+
+    return ReadString(type);
+}
+
+bool MsgPack::NextBool() {
+    bool isBool;
+    bool result = NextBoolOrNull(isBool);
+    if (!isBool) {
+        throw ProxyError("unexpected MessagePack nil, expected bool");
+    }
+
+    return result;
+}
+
+bool MsgPack::NextBoolOrNull(bool& isBool) {
+    uint8_t type = ReadByte();
+    isBool = true;
+    switch (type) {
+    case 0xc2:
+        return false;
+    case 0xc3:
+        return true;
+    case 0xc0:
+        isBool = false;
+        return false;
+    default:
+        throw ProxyError("unexpected MessagePack type 0x%02x, expected bool", type);
+    }
+}
+
+uint32_t MsgPack::NextUIntOrNull(bool& isUInt) {
+    if (Peek() == 0xc0) {
+        ReadByte();
+        isUInt = false;
+        return 0;
+    }
+
+    isUInt = true;
+    return NextUInt();
+}
+
+uint32_t MsgPack::NextUInt() {
+    uint8_t type = ReadByte();
+    uint64_t result;
+    if (type <= 0x7f) {
+        result = type;
+    } else if ((type >= 0xcc) && (type <= 0xcf)) {
+        result = ReadBigEndian(size_t(1) << (type - 0xcc));
+    } else {
+        throw ProxyError("unexpected MessagePack type 0x%02x, expected unsigned integer", type);
+    }
+
+    if (result > UINT32_MAX) {
+        throw ProxyError("unsigned integer value is too big");
+    }
+
+    return static_cast<uint32_t>(result);
+}
+
+uint8_t MsgPack::Peek() {
+    if (m_it == m_end) {
+        throw ProxyError(MSGPACK_INVALID);
+    }
+
+    return *m_it;
+}
+
+uint8_t MsgPack::ReadByte() {
+    uint8_t result = Peek();
+    ++m_it;
+
+    return result;
+}
+
+uint64_t MsgPack::ReadBigEndian(size_t count) {
+    if (static_cast<size_t>(m_end - m_it) < count) {
+        throw ProxyError(MSGPACK_INVALID);
+    }
+
+    uint64_t result = 0;
+    for (size_t i=0; i!=count; ++i) {
+        result = (result << 8) | *m_it++;
+    }
+
+    return result;
+}
+
+void MsgPack::Skip(uint64_t size) {
+    if (static_cast<uint64_t>(m_end - m_it) < size) {
+        throw ProxyError(MSGPACK_INVALID);
+    }
+
+    m_it += size;
+}
+
+std::string_view MsgPack::ReadString(uint8_t type) {
+    size_t size;
+    if ((type & 0xe0) == 0xa0) {
+        size = type & 0x1f;
+    } else if ((type == 0xd9) || (type == 0xc4)) {
+        size = ReadBigEndian(1);
+    } else if ((type == 0xda) || (type == 0xc5)) {
+        size = ReadBigEndian(2);
+    } else if ((type == 0xdb) || (type == 0xc6)) {
+        size = ReadBigEndian(4);
+    } else {
+        throw ProxyError("unexpected MessagePack type 0x%02x, expected string", type);
+    }
+
+    if (static_cast<size_t>(m_end - m_it) < size) {
+        throw ProxyError(MSGPACK_INVALID);
+    }
+
+    std::string_view result(reinterpret_cast<const char*>(m_it), size);
+    m_it += size;
+
+    return result;
+}
+
+void MsgPackWriter::Object(uint32_t size) {
+    if (size < 16) {
+        m_data.push_back(static_cast<char>(0x80 | size));
+    } else if (size <= UINT16_MAX) {
+        m_data.push_back(static_cast<char>(0xde));
+        WriteBigEndian(size, 2);
+    } else {
+        m_data.push_back(static_cast<char>(0xdf));
+        WriteBigEndian(size, 4);
+    }
+}
+
+void MsgPackWriter::Array(uint32_t size) {
+    if (size < 16) {
+        m_data.push_back(static_cast<char>(0x90 | size));
+    } else if (size <= UINT16_MAX) {
+        m_data.push_back(static_cast<char>(0xdc));
+        WriteBigEndian(size, 2);
+    } else {
+        m_data.push_back(static_cast<char>(0xdd));
+        WriteBigEndian(size, 4);
+    }
+}
+
+void MsgPackWriter::Null() {
+    m_data.push_back(static_cast<char>(0xc0));
+}
+
+void MsgPackWriter::String(std::string_view value) {
+    size_t size = value.size();
+    if (size < 32) {
+        m_data.push_back(static_cast<char>(0xa0 | size));
+    } else if (size <= UINT8_MAX) {
+        m_data.push_back(static_cast<char>(0xd9));
+        WriteBigEndian(size, 1);
+    } else if (size <= UINT16_MAX) {
+        m_data.push_back(static_cast<char>(0xda));
+        WriteBigEndian(size, 2);
+    } else {
+        m_data.push_back(static_cast<char>(0xdb));
+        WriteBigEndian(size, 4);
+    }
+    m_data.append(value);
+}
+
+void MsgPackWriter::Bool(bool value) {
+    m_data.push_back(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void MsgPackWriter::UInt(uint64_t value) {
+    if (value <= 0x7f) {
+        m_data.push_back(static_cast<char>(value));
+    } else if (value <= UINT8_MAX) {
+        m_data.push_back(static_cast<char>(0xcc));
+        WriteBigEndian(value, 1);
+    } else if (value <= UINT16_MAX) {
+        m_data.push_back(static_cast<char>(0xcd));
+        WriteBigEndian(value, 2);
+    } else if (value <= UINT32_MAX) {
+        m_data.push_back(static_cast<char>(0xce));
+        WriteBigEndian(value, 4);
+    } else {
+        m_data.push_back(static_cast<char>(0xcf));
+        WriteBigEndian(value, 8);
+    }
+}
+
+void MsgPackWriter::WriteBigEndian(uint64_t value, size_t count) {
+    for (size_t i=count; i!=0; --i) {
+        m_data.push_back(static_cast<char>((value >> ((i - 1) * 8)) & 0xff));
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <string_view>
+
+
+// Reader for the subset of MessagePack used by the protocol:
+// nil, bool, unsigned integers, str/bin, array and map
+class MsgPack {
+public:
+    MsgPack() = default;
+    ~MsgPack() = default;
+
+    // data must be valid until the next Parse call
+    void Parse(const char* data, size_t size);
+    // Start reading of the parsed data from the beginning
+    void Rewind() { m_it = m_begin; }
+    void SkipValue();
+    uint32_t NextObject();
+    uint32_t NextArrayOrNull(bool& isArray);
+    void NextNull();
+    std::string_view NextString();
+    std::string_view NextStringOrNull(bool& isString);
+    bool NextBool();
+    bool NextBoolOrNull(bool& isBool);
+    uint32_t NextUInt();
+    uint32_t NextUIntOrNull(bool& isUInt);
+    // Bytes left to read, a bound for the size of an array which is not read yet
+    size_t RemainingSize() const { return static_cast<size_t>(m_end - m_it); }
+
+private:
+    uint8_t Peek();
+    uint8_t ReadByte();
+    uint64_t ReadBigEndian(size_t count);
+    std::string_view ReadString(uint8_t type);
+    void Skip(uint64_t size);
+
+private:
+    const uint8_t* m_begin = nullptr;
+    const uint8_t* m_it = nullptr;
+    const uint8_t* m_end = nullptr;
+};
+
+class MsgPackWriter {
+public:
+    MsgPackWriter() = default;
+    ~MsgPackWriter() = default;
+
+    void Clear() { m_data.clear(); }
+    // Valid until the next change of the writer
+    std::string_view Data() const { return m_data; }
+
+    void Object(uint32_t size);
+    void EndObject() {}
+    void Array(uint32_t size);
+    void Key(std::string_view name) { String(name); }
+    void Null();
+    void String(std::string_view value);
+    void Bool(bool value);
+    void UInt(uint64_t value);
+
+private:
+    void WriteBigEndian(uint64_t value, size_t count);
+
+private:
+    std::string m_data;
+};
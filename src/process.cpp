@@ -5,14 +5,28 @@
 #include <glib.h>
 #pragma GCC diagnostic pop
 
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 
 #include "defer.h"
 #include "logger.h"
 #include "exception.h"
 
 
+static constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+static constexpr size_t FRAME_HEADER_SIZE = 4;
+static constexpr gint64 DAEMON_START_TIMEOUT_US = 5 * 1000 * 1000;
+static constexpr guint DAEMON_START_POLL_MS = 10;
+
 namespace {
 
 static void onProcessExit(GPid pid, gint status, gpointer context) {
@@ -22,45 +36,22 @@ static void onProcessExit(GPid pid, gint status, gpointer context) {
     }
 }
 
-static int onProcessInput(GIOChannel *source, GIOCondition /* condition */, gpointer context) {
-    static GString* buffer = g_string_sized_new(1024);
-
-    GError* error = nullptr;
-    Defer _([&](...) mutable {
-        if (error != nullptr) {
-            g_error_free(error);
-        }
-    });
+static void onChildSetup(gpointer context) {
+    // The fd is created with FD_CLOEXEC, only the child process gets it
+    fcntl(*reinterpret_cast<int*>(context), F_SETFD, 0);
+}
 
-    gunichar unichar;
-    GIOStatus status = g_io_channel_read_unichar(source, &unichar, &error);
-
-    while (status == G_IO_STATUS_NORMAL) {
-        g_string_append_unichar(buffer, unichar);
-        if (unichar == '\n') {
-            if (buffer->len > 1) { //input is not an empty line
-                if (context != nullptr) {
-                    auto* handler = reinterpret_cast<ProcessHandler*>(context);
-                    buffer->str[buffer->len - 1] = '\0';
-                    handler->OnReadLine(buffer->str);
-                }
-            }
-            g_string_set_size(buffer, 0);
-        }
-        status = g_io_channel_read_unichar(source, &unichar, &error);
-    }
+static int onProcessInput(GIOChannel* /* source */, GIOCondition /* condition */, gpointer context) {
+    reinterpret_cast<Process*>(context)->ReadInput();
+    return G_SOURCE_CONTINUE;
+}
 
-    // G_IO_STATUS_AGAIN == nothing to read
-    if ((status != G_IO_STATUS_AGAIN) && (context != nullptr)) {
-        auto* handler = reinterpret_cast<ProcessHandler*>(context);
-        if (error != nullptr) {
-            handler->OnReadLineError(error->message);
-        } else {
-            handler->OnReadLineError("unknown error");
-        }
-    }
+static int onProcessOutput(GIOChannel* /* source */, GIOCondition /* condition */, gpointer context) {
+    return reinterpret_cast<Process*>(context)->WriteQueue() ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
 
-    return G_SOURCE_CONTINUE;
+static int onConnectRetry(gpointer context) {
+    return reinterpret_cast<Process*>(context)->RetryConnect() ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
 }
 
 }
@@ -74,11 +65,23 @@ Process::Process(ProcessHandler* handler, const std::shared_ptr<Logger>& logger)
 }
 
 Process::~Process() {
+    StopReadThread();
+
+    if (m_connectTimer != 0) {
+        g_source_remove(m_connectTimer);
+        m_connectTimer = 0;
+    }
+
     if (m_readChWatcher != 0) {
         g_source_remove(m_readChWatcher);
         m_readChWatcher = 0;
     }
 
+    if (m_writeChWatcher != 0) {
+        g_source_remove(m_writeChWatcher);
+        m_writeChWatcher = 0;
+    }
+
     if (m_readCh != nullptr) {
         g_free(m_readCh);
         m_readCh = nullptr;
@@ -89,6 +92,11 @@ Process::~Process() {
         m_writeCh = nullptr;
     }
 
+    if (m_readBuf != nullptr) {
+        delete[] m_readBuf;
+        m_readBuf = nullptr;
+    }
+
     if (m_readFd != STDIN_FILENO) {
         close(m_readFd);
         m_readFd = STDIN_FILENO;
@@ -108,7 +116,8 @@ Process::~Process() {
     m_logger.reset();
 }
 
-void Process::Start(const char *command) {
+void Process::Start(const char *command, Framing framing) {
+    m_framing = framing;
     try {
         StartImpl(command);
     } catch(const std::exception& e) {
@@ -117,46 +126,116 @@ void Process::Start(const char *command) {
     }
 }
 
-void Process::Write(const char* text) {
-    if (m_writeCh == nullptr) {
+void Process::Write(std::string_view data, WritePolicy policy) {
+    bool isConnecting = (m_connectTimer != 0);
+    if ((m_writeCh == nullptr) && (!isConnecting)) {
         return;
     }
 
-    GError *error = nullptr;
-    Defer _([&](...) mutable {
-        if (error != nullptr) {
-            g_error_free(error);
+    char header[FRAME_HEADER_SIZE];
+    struct iovec parts[2];
+    if (m_framing == Framing::LengthPrefixed) {
+        if (data.size() > UINT32_MAX) {
+            throw ProxyError("message is too big for a frame");
         }
-    });
+        auto size = static_cast<uint32_t>(data.size());
+        header[0] = static_cast<char>(size >> 24);
+        header[1] = static_cast<char>(size >> 16);
+        header[2] = static_cast<char>(size >> 8);
+        header[3] = static_cast<char>(size);
+        parts[0] = {header, FRAME_HEADER_SIZE};
+        parts[1] = {const_cast<char*>(data.data()), data.size()};
+    } else {
+        parts[0] = {const_cast<char*>(data.data()), data.size()};
+        parts[1] = {const_cast<char*>("\n"), 1};
+    }
 
-    gsize bytesWitten;
-    if (g_io_channel_write_chars(m_writeCh, text, -1, &bytesWitten, &error) != G_IO_STATUS_NORMAL) {
-        if (error != nullptr) {
-            throw ProxyError(error->message);
-        } else {
-            throw ProxyError("unknown error");
-        }
+    // Messages must not overtake the queued ones, they wait in the queue for the connection too
+    if ((!m_writeQueue.empty()) || isConnecting) {
+        std::string message(static_cast<const char*>(parts[0].iov_base), parts[0].iov_len);
+        message.append(static_cast<const char*>(parts[1].iov_base), parts[1].iov_len);
+        Enqueue(message, policy);
+        return;
     }
 
-    if (g_io_channel_write_unichar(m_writeCh, '\n', &error) != G_IO_STATUS_NORMAL) {
-        if (error != nullptr) {
-            throw ProxyError(error->message);
-        } else {
-            throw ProxyError("unknown error");
-        }
+    size_t written = WriteParts(parts, 2);
+    size_t total = parts[0].iov_len + parts[1].iov_len;
+    if (written == total) {
+        return;
     }
 
-    if (g_io_channel_flush(m_writeCh, &error) != G_IO_STATUS_NORMAL) {
-        if (error != nullptr) {
-            throw ProxyError(error->message);
-        } else {
-            throw ProxyError("unknown error");
+    std::string rest;
+    rest.reserve(total - written);
+    for (const auto& part: parts) {
+        size_t skip = std::min(written, part.iov_len);
+        rest.append(static_cast<const char*>(part.iov_base) + skip, part.iov_len - skip);
+        written -= skip;
+    }
+    // The beginning of the message is already in the pipe, it can not be replaced
+    Enqueue(rest, WritePolicy::Keep);
+}
+
+bool Process::WriteQueue() {
+    static constexpr int MAX_PARTS = 64;
+
+    while (!m_writeQueue.empty()) {
+        struct iovec parts[MAX_PARTS];
+        int count = 0;
+        size_t offset = m_writeOffset;
+        for (auto it = m_writeQueue.begin(); (it != m_writeQueue.end()) && (count != MAX_PARTS); ++it, ++count) {
+            parts[count] = {const_cast<char*>(it->data.data() + offset), it->data.size() - offset};
+            offset = 0;
+        }
+
+        size_t written;
+        try {
+            written = WriteParts(parts, count);
+        } catch(const std::exception& e) {
+            m_writeChWatcher = 0;
+            m_handler->OnWriteError(e.what());
+            return false;
+        }
+        if (written == 0) {
+            return true;
+        }
+
+        m_writeStats.queuedBytes -= written;
+        while (written != 0) {
+            size_t left = m_writeQueue.front().data.size() - m_writeOffset;
+            if (written < left) {
+                m_writeOffset += written;
+                break;
+            }
+            written -= left;
+            m_writeOffset = 0;
+            m_writeQueue.pop_front();
         }
     }
+
+    int64_t stallTime = g_get_monotonic_time() - m_stallStart;
+    m_writeStats.stallTime += stallTime;
+    m_writeChWatcher = 0;
+    m_logger->Debug("Write queue is drained after %" G_GINT64_FORMAT " us", stallTime);
+
+    return false;
+}
+
+void Process::Connect(const char* socketPath, const char* command, Framing framing) {
+    m_framing = framing;
+    try {
+        ConnectImpl(socketPath, command);
+    } catch(const std::exception& e) {
+        m_logger->Error("Unable to connect to socket \"%s\": %s", socketPath, e.what());
+        throw ProxyError("Unable to connect to socket \"%s\": %s", socketPath, e.what());
+    }
 }
 
 void Process::Kill() {
     m_logger->Debug("Send SIGTERM to child process %" G_PID_FORMAT, m_pid);
+    if (m_connectTimer != 0) {
+        g_source_remove(m_connectTimer);
+        m_connectTimer = 0;
+    }
     if (m_pid >= 0) {
         kill(m_pid, SIGTERM);
     } else if (m_handler != nullptr) {
@@ -164,6 +243,34 @@ void Process::Kill() {
     }
 }
 
+void Process::ReadInput() {
+    while (!m_readFailed) {
+        ReserveReadBuffer();
+        ssize_t readCount = read(m_readFd, m_readBuf + m_readSize, m_readCapacity - m_readSize);
+        if (readCount > 0) {
+            size_t begin = m_readSize;
+            m_readSize += static_cast<size_t>(readCount);
+            if (m_framing == Framing::LengthPrefixed) {
+                SplitFrames();
+            } else {
+                SplitLines(begin, m_readSize);
+            }
+            continue;
+        }
+
+        if (readCount == 0) {
+            ReadError("unexpected end of stream");
+        } else if (errno == EINTR) {
+            continue;
+        } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            ReadError(strerror(errno));
+        }
+
+        // EAGAIN == nothing to read
+        break;
+    }
+}
+
 void Process::StartImpl(const char* command) {
     if (command != nullptr) {
         char **argv = nullptr;
@@ -188,10 +295,11 @@ void Process::StartImpl(const char* command) {
     }
 
     try {
-        SetNonBlockFlag(m_readFd);
-        m_readCh = g_io_channel_unix_new(m_readFd);
-        m_writeCh = g_io_channel_unix_new(m_writeFd);
-        m_readChWatcher = g_io_add_watch(m_readCh, G_IO_IN, onProcessInput, m_handler);
+        if ((m_pipeSize != 0) && (m_pid >= 0)) {
+            SetPipeSize(m_readFd);
+            SetPipeSize(m_writeFd);
+        }
+        WatchChannels();
     } catch(const std::exception& e) {
         if (m_pid >= 0) {
             kill(m_pid, SIGTERM);
@@ -204,16 +312,151 @@ void Process::StartImpl(const char* command) {
     }
 }
 
+void Process::ConnectImpl(const char* socketPath, const char* command) {
+    m_socketPath = socketPath;
+    int fd = ConnectSocket(socketPath);
+    if ((fd < 0) && (command != nullptr) && ((errno == ENOENT) || (errno == ECONNREFUSED))) {
+        SpawnDaemon(command, socketPath);
+        // The main loop is not blocked while the daemon creates the socket, messages are queued until then
+        m_connectDeadline = g_get_monotonic_time() + DAEMON_START_TIMEOUT_US;
+        m_connectTimer = g_timeout_add(DAEMON_START_POLL_MS, onConnectRetry, this);
+        m_logger->Debug("Wait for socket \"%s\"", socketPath);
+        return;
+    }
+    if (fd < 0) {
+        throw ProxyError(strerror(errno));
+    }
+
+    OnConnected(fd);
+}
+
+bool Process::RetryConnect() {
+    try {
+        int fd = ConnectSocket(m_socketPath.c_str());
+        if (fd >= 0) {
+            m_connectTimer = 0;
+            OnConnected(fd);
+            return false;
+        }
+        if ((errno != ENOENT) && (errno != ECONNREFUSED)) {
+            throw ProxyError(strerror(errno));
+        }
+        if (g_get_monotonic_time() >= m_connectDeadline) {
+            throw ProxyError("the daemon did not create the socket in %" G_GINT64_FORMAT " ms", DAEMON_START_TIMEOUT_US / 1000);
+        }
+    } catch(const std::exception& e) {
+        m_connectTimer = 0;
+        m_logger->Error("Unable to connect to socket \"%s\": %s", m_socketPath.c_str(), e.what());
+        m_handler->OnWriteError(e.what());
+        return false;
+    }
+
+    return true;
+}
+
+void Process::OnConnected(int fd) {
+    // Each fd is owned and closed separately
+    m_readFd = fd;
+    m_writeFd = dup(fd);
+    if (m_writeFd < 0) {
+        m_writeFd = STDOUT_FILENO;
+        throw ProxyError("unable to duplicate socket: %s", strerror(errno));
+    }
+    m_logger->Debug("Connected to socket \"%s\"", m_socketPath.c_str());
+    m_sendSharedFd = (m_sharedFd >= 0);
+
+    WatchChannels();
+    // Messages written while the daemon was starting
+    if (!m_writeQueue.empty()) {
+        m_writeChWatcher = g_io_add_watch(m_writeCh, G_IO_OUT, onProcessOutput, this);
+    }
+}
+
+void Process::WatchChannels() {
+    SetNonBlockFlag(m_readFd);
+    SetNonBlockFlag(m_writeFd);
+    m_readCh = g_io_channel_unix_new(m_readFd);
+    // The channel is used only for the G_IO_OUT watch, messages are written with writev
+    m_writeCh = g_io_channel_unix_new(m_writeFd);
+    if (m_useReadThread) {
+        StartReadThread();
+    } else {
+        m_readChWatcher = g_io_add_watch(m_readCh, G_IO_IN, onProcessInput, this);
+    }
+}
+
+void Process::StartReadThread() {
+    m_stopFd = eventfd(0, EFD_CLOEXEC);
+    if (m_stopFd < 0) {
+        throw ProxyError("unable to create eventfd: %s", strerror(errno));
+    }
+    m_readThread = std::thread(&Process::ReadLoop, this);
+    m_logger->Debug("Start reader thread for fd %d", m_readFd);
+}
+
+void Process::StopReadThread() {
+    if (!m_readThread.joinable()) {
+        return;
+    }
+
+    uint64_t value = 1;
+    while ((write(m_stopFd, &value, sizeof(value)) < 0) && (errno == EINTR)) {
+    }
+    m_readThread.join();
+    close(m_stopFd);
+    m_stopFd = -1;
+}
+
+void Process::ReadLoop() {
+    struct pollfd fds[2] = {
+        {m_readFd, POLLIN, 0},
+        {m_stopFd, POLLIN, 0},
+    };
+    while (!m_readFailed) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                ReadError(strerror(errno));
+            }
+            continue;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (fds[0].revents != 0) {
+            // POLLHUP and POLLERR are reported by read
+            ReadInput();
+        }
+    }
+}
+
+char** Process::CreateEnvironment(const char* socketPath) {
+    // Let the child process know the format of messages
+    const char* protocol = (m_framing == Framing::LengthPrefixed) ? "binary" : "json";
+    char **envp = g_environ_setenv(g_get_environ(), "ROFI_PROXY_PROTOCOL", protocol, TRUE);
+    if (socketPath != nullptr) {
+        envp = g_environ_setenv(envp, "ROFI_PROXY_SOCKET", socketPath, TRUE);
+    } else if (m_sharedFd >= 0) {
+        envp = g_environ_setenv(envp, "ROFI_PROXY_SHM_FD", std::to_string(m_sharedFd).c_str(), TRUE);
+    }
+
+    return envp;
+}
+
 void Process::Spawn(char **argv) {
-    char **envp = nullptr;
+    char **envp = CreateEnvironment(nullptr);
     void* userData = nullptr;
     int* errorFDPtr = nullptr;
     const char* workingDirectory = nullptr;
     GSpawnChildSetupFunc childSetup = nullptr;
     GSpawnFlags flags = static_cast<GSpawnFlags>(G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH);
+    if (m_sharedFd >= 0) {
+        childSetup = onChildSetup;
+        userData = &m_sharedFd;
+    }
 
     GError *error = nullptr;
     Defer _([&](...) mutable {
+        g_strfreev(envp);
         if (error != nullptr) {
             g_error_free(error);
         }
@@ -225,8 +468,233 @@ void Process::Spawn(char **argv) {
     }
 }
 
+void Process::SpawnDaemon(const char* command, const char* socketPath) {
+    char **argv = nullptr;
+    char **envp = nullptr;
+    GError *error = nullptr;
+
+    Defer _([&](...) mutable {
+        if (argv != nullptr) {
+            g_strfreev(argv);
+        }
+        if (envp != nullptr) {
+            g_strfreev(envp);
+        }
+        if (error != nullptr) {
+            g_error_free(error);
+        }
+    });
+
+    if (g_shell_parse_argv(command, nullptr, &argv, &error) == FALSE) {
+        throw ProxyError("unable to parse arg '-proxy-cmd': %s", error->message);
+    }
+
+    // The daemon outlives rofi, it does not use rofi's stdin and stdout
+    envp = CreateEnvironment(socketPath);
+    GSpawnFlags flags = static_cast<GSpawnFlags>(
+        G_SPAWN_SEARCH_PATH | G_SPAWN_STDIN_FROM_DEV_NULL | G_SPAWN_STDOUT_TO_DEV_NULL);
+    if (g_spawn_async(nullptr, argv, envp, flags, nullptr, nullptr, nullptr, &error) == FALSE) {
+        throw ProxyError(error->message);
+    }
+    m_logger->Debug("Start daemon \"%s\"", command);
+}
+
+int Process::ConnectSocket(const char* socketPath) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    size_t size = strlen(socketPath);
+    if (size >= sizeof(addr.sun_path)) {
+        throw ProxyError("socket path is longer than %zu bytes", sizeof(addr.sun_path) - 1);
+    }
+    memcpy(addr.sun_path, socketPath, size);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw ProxyError("unable to create socket: %s", strerror(errno));
+    }
+
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int connectErrno = errno;
+        close(fd);
+        errno = connectErrno;
+        return -1;
+    }
+
+    return fd;
+}
+
 void Process::SetNonBlockFlag(int fd) {
     if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
         throw ProxyError("can't set non block to output pipe");
     }
 }
+
+size_t Process::WriteParts(const struct iovec* parts, int count) {
+    while (true) {
+        ssize_t written = m_sendSharedFd ? SendPartsWithFd(parts, count) : writev(m_writeFd, parts, count);
+        if (written >= 0) {
+            m_sendSharedFd = m_sendSharedFd && (written == 0);
+            return static_cast<size_t>(written);
+        }
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            throw ProxyError("unable to write to child process: %s", strerror(errno));
+        }
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wcast-align"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+ssize_t Process::SendPartsWithFd(const struct iovec* parts, int count) {
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec*>(parts);
+    msg.msg_iovlen = static_cast<size_t>(count);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &m_sharedFd, sizeof(int));
+
+    return sendmsg(m_writeFd, &msg, 0);
+}
+#pragma GCC diagnostic pop
+
+void Process::Enqueue(std::string_view data, WritePolicy policy) {
+    if (m_writeQueue.empty()) {
+        m_stallStart = g_get_monotonic_time();
+        m_writeStats.stallCount++;
+        // While connecting the watch is added with the channel
+        if (m_writeCh != nullptr) {
+            m_writeChWatcher = g_io_add_watch(m_writeCh, G_IO_OUT, onProcessOutput, this);
+        }
+    }
+
+    if (policy == WritePolicy::ReplacePending) {
+        // Other messages can be queued after the pending one, the new message goes to the end of the queue
+        auto pending = std::find_if(m_writeQueue.rbegin(), m_writeQueue.rend(), [](const QueuedMessage& message) {
+            return message.policy == WritePolicy::ReplacePending;
+        });
+        if (pending != m_writeQueue.rend()) {
+            auto it = std::prev(pending.base());
+            bool isStarted = (it == m_writeQueue.begin()) && (m_writeOffset != 0);
+            while ((!isStarted) && (it != m_writeQueue.end())) {
+                // The messages about the replaced one are dropped with it
+                if ((it->policy == WritePolicy::DropWithReplaced) || (it->policy == WritePolicy::ReplacePending)) {
+                    m_writeStats.queuedBytes -= it->data.size();
+                    m_writeStats.replacedCount++;
+                    it = m_writeQueue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+    m_writeQueue.push_back(QueuedMessage{std::string(data), policy});
+
+    m_writeStats.queuedBytes += data.size();
+    m_writeStats.maxQueuedBytes = std::max(m_writeStats.maxQueuedBytes, m_writeStats.queuedBytes);
+}
+
+void Process::SetPipeSize(int fd) {
+#ifdef F_SETPIPE_SZ
+    if (fcntl(fd, F_SETPIPE_SZ, static_cast<int>(m_pipeSize)) < 0) {
+        m_logger->Error("Unable to set size of pipe to %u bytes: %s", m_pipeSize, strerror(errno));
+    }
+#else
+    m_logger->Error("Unable to set size of pipe for fd %d, it is not supported", fd);
+#endif
+}
+
+void Process::ReserveReadBuffer() {
+    if (m_lineBegin == m_readSize) {
+        m_lineBegin = 0;
+        m_readSize = 0;
+    }
+
+    if (m_readCapacity - m_readSize >= READ_CHUNK_SIZE) {
+        return;
+    }
+
+    // Move the incomplete line to the beginning of the buffer
+    if (m_lineBegin != 0) {
+        memmove(m_readBuf, m_readBuf + m_lineBegin, m_readSize - m_lineBegin);
+        m_readSize -= m_lineBegin;
+        m_lineBegin = 0;
+        if (m_readCapacity - m_readSize >= READ_CHUNK_SIZE) {
+            return;
+        }
+    }
+
+    size_t capacity = std::max(m_readCapacity * 2, m_readSize + READ_CHUNK_SIZE);
+    char* buf = new char[capacity];
+    if (m_readBuf != nullptr) {
+        memcpy(buf, m_readBuf, m_readSize);
+        delete[] m_readBuf;
+    }
+    m_readBuf = buf;
+    m_readCapacity = capacity;
+}
+
+void Process::SplitLines(size_t begin, size_t end) {
+    while (begin != end) {
+        auto* it = reinterpret_cast<char*>(memchr(m_readBuf + begin, '\n', end - begin));
+        if (it == nullptr) {
+            if (end - m_lineBegin > m_maxMessageSize) {
+                ReadError(detail::Format("message is longer than %zu bytes", m_maxMessageSize).c_str());
+                return;
+            }
+            m_handler->OnReadPartialLine(m_readBuf + m_lineBegin, end - m_lineBegin);
+            return;
+        }
+
+        size_t lineEnd = static_cast<size_t>(it - m_readBuf);
+        if (lineEnd - m_lineBegin > m_maxMessageSize) {
+            ReadError(detail::Format("message is longer than %zu bytes", m_maxMessageSize).c_str());
+            return;
+        }
+        if (lineEnd != m_lineBegin) { // input is not an empty line
+            *it = '\0';
+            m_handler->OnReadLine(m_readBuf + m_lineBegin, lineEnd - m_lineBegin);
+        }
+        begin = m_lineBegin = lineEnd + 1;
+    }
+}
+
+void Process::SplitFrames() {
+    while (m_readSize - m_lineBegin >= FRAME_HEADER_SIZE) {
+        const auto* header = reinterpret_cast<const uint8_t*>(m_readBuf + m_lineBegin);
+        size_t size = (size_t(header[0]) << 24) | (size_t(header[1]) << 16) | (size_t(header[2]) << 8) | size_t(header[3]);
+        if (size > m_maxMessageSize) {
+            ReadError(detail::Format("message size %zu is bigger than %zu bytes", size, m_maxMessageSize).c_str());
+            return;
+        }
+        if (m_readSize - m_lineBegin - FRAME_HEADER_SIZE < size) {
+            return;
+        }
+
+        if (size != 0) { // input is not an empty frame
+            m_handler->OnReadLine(m_readBuf + m_lineBegin + FRAME_HEADER_SIZE, size);
+        }
+        m_lineBegin += FRAME_HEADER_SIZE + size;
+    }
+}
+
+void Process::ReadError(const char* text) {
+    // The stream can not be synchronized after an error, the rest of the input is ignored
+    m_readFailed = true;
+    m_lineBegin = m_readSize = 0;
+    if (m_readChWatcher != 0) {
+        g_source_remove(m_readChWatcher);
+        m_readChWatcher = 0;
+    }
+
+    m_handler->OnReadLineError(text);
+}
@@ -1,6 +1,13 @@
 #pragma once
 
+#include <deque>
+#include <string>
 #include <memory>
+#include <thread>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
 
 
 class ProcessHandler {
@@ -9,11 +16,39 @@ public:
     virtual ~ProcessHandler() = default;
 
 public:
-    virtual void OnReadLine(const char* text) = 0;
+    // Read callbacks are called in the main loop or in the reader thread (see Process::SetReadThread)
+    // The beginning of a line that has not been fully received yet,
+    // text is valid only during the call and can be modified in place
+    virtual void OnReadPartialLine(char* text, size_t size) = 0;
+    // Full line without '\n' (zero-terminated) or a length-prefixed frame without its header,
+    // text is valid only during the call and can be modified in place
+    virtual void OnReadLine(char* text, size_t size) = 0;
     virtual void OnReadLineError(const char* text) = 0;
+    virtual void OnWriteError(const char* text) = 0;
     virtual void OnProcessExit(int pid, bool normally) = 0;
 };
 
+enum class Framing : uint8_t {
+    Line,           // Messages are separated by '\n'
+    LengthPrefixed, // Each message is prefixed with its size as 4 bytes big-endian
+};
+
+enum class WritePolicy : uint8_t {
+    Keep,           // The message is always delivered
+    ReplacePending, // While the pipe is full, the message replaces the newest queued message with this policy
+                    // if its writing was not started
+    DropWithReplaced, // The message refers to the ReplacePending message queued before it (a cancel of that input),
+                      // it is dropped when that message is replaced
+};
+
+struct WriteStats {
+    size_t queuedBytes = 0;    // Bytes waiting for the pipe now
+    size_t maxQueuedBytes = 0;
+    size_t stallCount = 0;     // Number of times the pipe was full
+    int64_t stallTime = 0;     // Total time in microseconds while the queue was not empty
+    size_t replacedCount = 0;  // Messages dropped by WritePolicy::ReplacePending and WritePolicy::DropWithReplaced
+};
+
 class Logger;
 struct _GIOChannel;
 typedef struct _GIOChannel GIOChannel;
@@ -24,22 +59,91 @@ public:
     Process(ProcessHandler* handler, const std::shared_ptr<Logger>& logger);
     ~Process();
 
-    void Start(const char* command);
-    void Write(const char* text);
+    // Longer messages are an error, the limit is checked before the whole message is read
+    void SetMaxMessageSize(size_t size) { m_maxMessageSize = size; }
+    // Size of the pipes to the child process in bytes, 0 - default size of the system
+    void SetPipeSize(unsigned int size) { m_pipeSize = size; }
+    // The fd is passed to the backend: a started child process inherits it with its number
+    // in ROFI_PROXY_SHM_FD, a connected backend gets it with SCM_RIGHTS along with the first message
+    void SetSharedFd(int fd) { m_sharedFd = fd; }
+    // Read and split messages in a separate thread instead of the main loop,
+    // the read callbacks of the handler are called in that thread
+    void SetReadThread(bool enabled) { m_useReadThread = enabled; }
+    void Start(const char* command, Framing framing);
+    // Connect to a running backend, if the socket is not available and command is not null,
+    // the backend is started as a daemon with the socket path in ROFI_PROXY_SOCKET.
+    // The connection to the daemon is retried from the main loop, messages are queued until it is made,
+    // a failure is reported with OnWriteError.
+    void Connect(const char* socketPath, const char* command, Framing framing);
+    // Write the message without blocking, if the pipe is full the message is queued
+    void Write(std::string_view data, WritePolicy policy);
+    const WriteStats& GetWriteStats() const { return m_writeStats; }
     void Kill();
+    // Read all available data from the child process, called from the GLib watch
+    void ReadInput();
+    // Write queued messages, called from the GLib watch, returns false when the queue is empty
+    bool WriteQueue();
+    // Try to connect to the starting daemon, called from the GLib timer, returns false when it is finished
+    bool RetryConnect();
 
 private:
     void StartImpl(const char* command);
+    void ConnectImpl(const char* socketPath, const char* command);
+    void OnConnected(int fd);
+    void WatchChannels();
+    void StartReadThread();
+    void StopReadThread();
+    void ReadLoop();
+    char** CreateEnvironment(const char* socketPath);
     void Spawn(char **argv);
+    void SpawnDaemon(const char* command, const char* socketPath);
+    int ConnectSocket(const char* socketPath);
     void SetNonBlockFlag(int fd);
+    void SetPipeSize(int fd);
+    size_t WriteParts(const struct iovec* parts, int count);
+    ssize_t SendPartsWithFd(const struct iovec* parts, int count);
+    void Enqueue(std::string_view data, WritePolicy policy);
+    void ReserveReadBuffer();
+    void SplitLines(size_t begin, size_t end);
+    void SplitFrames();
+    void ReadError(const char* text);
 
 private:
     int m_pid = -1;
+    Framing m_framing = Framing::Line;
+    size_t m_maxMessageSize = UINT32_MAX;
+    unsigned int m_pipeSize = 0;
+    bool m_readFailed = false;
+    bool m_useReadThread = false;
+    // Wakes up the reader thread to stop it
+    int m_stopFd = -1;
+    std::thread m_readThread;
+    int m_sharedFd = -1;
+    bool m_sendSharedFd = false;
     int m_readFd;
     int m_writeFd;
+    std::string m_socketPath;
+    // Only while the daemon is starting
+    unsigned int m_connectTimer = 0;
+    int64_t m_connectDeadline = 0;
     unsigned int m_readChWatcher = 0;
+    unsigned int m_writeChWatcher = 0;
     GIOChannel* m_readCh = nullptr;
     GIOChannel* m_writeCh = nullptr;
+    // Data read from the child process, m_readBuf[m_lineBegin, m_readSize) is the incomplete line
+    char* m_readBuf = nullptr;
+    size_t m_readSize = 0;
+    size_t m_readCapacity = 0;
+    size_t m_lineBegin = 0;
+    struct QueuedMessage {
+        std::string data;
+        WritePolicy policy;
+    };
+    // Messages that did not fit into the pipe, m_writeQueue.front() is written from m_writeOffset
+    std::deque<QueuedMessage> m_writeQueue;
+    size_t m_writeOffset = 0;
+    int64_t m_stallStart = 0;
+    WriteStats m_writeStats;
     ProcessHandler* m_handler = nullptr;
     std::shared_ptr<Logger> m_logger;
 };
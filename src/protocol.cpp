@@ -1,68 +1,269 @@
 #include "protocol.h"
 
+#include <algorithm>
+#include <type_traits>
+
 #include "exception.h"
 
 
-std::string Protocol::CreateMessageInput(const char* text) {
-    return detail::Format(
-        "{\"name\": \"input\", \"value\": \"%s\"}",
-        m_json.EscapeString(text).c_str());
+namespace {
+
+// The smallest line or patch item is 3 JSON tokens ({"text": "x"}) or 8 bytes of MessagePack,
+// array sizes come from the sender, so reservations are clamped by the rest of the message
+static constexpr size_t MIN_ITEM_JSON_TOKENS = 3;
+static constexpr size_t MIN_ITEM_MSGPACK_SIZE = 8;
+
+// Upper bound for the number of items in an array which is not read yet
+template <typename Reader> size_t MaxItemCount(const Reader& reader, uint32_t itemCount) {
+    size_t minSize = std::is_same_v<Reader, MsgPack> ? MIN_ITEM_MSGPACK_SIZE : MIN_ITEM_JSON_TOKENS;
+    return std::min(static_cast<size_t>(itemCount), reader.RemainingSize() / minSize);
+}
+
+// The line store keeps strings zero-terminated, a NUL inside a value (\u0000 in JSON) would cut it
+static void CheckLineString(std::string_view value, const char* field) {
+    if (value.find('\0') != std::string_view::npos) {
+        throw ProxyError("field \"%s\" in line item dict contains a NUL character", field);
+    }
+}
+
+}
+
+std::string_view Protocol::CreateMessageHello(const char* sessionId, int pid) {
+    return CreateMessage("hello", 0, [sessionId, pid](auto& writer) {
+        writer.Object(2);
+        writer.Key("session");
+        writer.String(sessionId);
+        writer.Key("pid");
+        writer.UInt(static_cast<uint64_t>(pid));
+        writer.EndObject();
+    });
+}
+
+std::string_view Protocol::CreateMessageInput(const char* text, uint32_t seq) {
+    return CreateMessage("input", seq, [text](auto& writer) {
+        writer.String(text);
+    });
+}
+
+std::string_view Protocol::CreateMessageCancel(uint32_t seq) {
+    return CreateMessage("cancel", 0, [seq](auto& writer) {
+        writer.UInt(seq);
+    });
+}
+
+std::string_view Protocol::CreateMessageLinesShmRelease(uint32_t generation) {
+    return CreateMessage("lines_shm_release", 0, [generation](auto& writer) {
+        writer.UInt(generation);
+    });
+}
+
+std::string_view Protocol::CreateMessageFetchLines(uint32_t generation, size_t offset, size_t count) {
+    return CreateMessage("fetch_lines", 0, [generation, offset, count](auto& writer) {
+        writer.Object(3);
+        writer.Key("generation");
+        writer.UInt(generation);
+        writer.Key("offset");
+        writer.UInt(offset);
+        writer.Key("count");
+        writer.UInt(count);
+        writer.EndObject();
+    });
+}
+
+std::string_view Protocol::CreateMessageSelectLine(const Line& line) {
+    return CreateMessage("select_line", 0, [&line](auto& writer) {
+        WriteLine(writer, line);
+    });
+}
+
+std::string_view Protocol::CreateMessageDeleteLine(const Line& line) {
+    return CreateMessage("delete_line", 0, [&line](auto& writer) {
+        WriteLine(writer, line);
+    });
+}
+
+std::string_view Protocol::CreateMessageSelectCustomInput(const char* text) {
+    return CreateMessage("select_custom_input", 0, [text](auto& writer) {
+        writer.String(text);
+    });
+}
+
+std::string_view Protocol::CreateMessageKeyPress(const Line& line, const char* keyName) {
+    return CreateMessage("key_press", 0, [&line, keyName](auto& writer) {
+        writer.Object(2);
+        writer.Key("key");
+        writer.String(keyName);
+        writer.Key("line");
+        WriteLine(writer, line);
+        writer.EndObject();
+    });
+}
+
+std::string_view Protocol::CreateSnapshot(const std::string& prompt, const std::string& help, const std::string& overlay, const LineStore& lines) {
+    auto& writer = m_msgPackWriter;
+    writer.Clear();
+    writer.Object(4);
+    writer.Key("prompt");
+    writer.String(prompt);
+    writer.Key("help");
+    writer.String(help);
+    writer.Key("overlay");
+    writer.String(overlay);
+    writer.Key("lines");
+    writer.Array(static_cast<uint32_t>(lines.Size()));
+    for (size_t i=0; i!=lines.Size(); ++i) {
+        WriteSnapshotLine(writer, lines.Get(i));
+    }
+
+    return writer.Data();
+}
+
+UserRequest Protocol::ParseSnapshot(const char* data, size_t size) {
+    m_msgPack.Parse(data, size);
+    return ParseRequest(m_msgPack, 0);
+}
+
+void Protocol::FeedRequest(char* text, size_t size) noexcept {
+    if (m_format == MessageFormat::Json) {
+        m_json.Feed(text, size);
+    }
 }
 
-std::string Protocol::CreateMessageSelectLine(const Line& line) {
-    return detail::Format(
-        "{\"name\": \"select_line\", \"value\": {\"id\": \"%s\", \"text\": \"%s\", \"group\": \"%s\"}}",
-        m_json.EscapeString(line.id.c_str()).c_str(),
-        m_json.EscapeString(line.text.c_str()).c_str(),
-        m_json.EscapeString(line.group.c_str()).c_str());
+UserRequest Protocol::ParseRequest(char* text, size_t size, uint32_t lastInputSeq) {
+    if (m_format == MessageFormat::MsgPack) {
+        m_msgPack.Parse(text, size);
+        return ParseRequest(m_msgPack, lastInputSeq);
+    }
+
+    m_json.Parse(text, size);
+    return ParseRequest(m_json, lastInputSeq);
 }
 
-std::string Protocol::CreateMessageDeleteLine(const Line& line) {
-    return detail::Format(
-        "{\"name\": \"delete_line\", \"value\": {\"id\": \"%s\", \"text\": \"%s\", \"group\": \"%s\"}}",
-        m_json.EscapeString(line.id.c_str()).c_str(),
-        m_json.EscapeString(line.text.c_str()).c_str(),
-        m_json.EscapeString(line.group.c_str()).c_str());
+void Protocol::ParseSharedLines(const char* data, size_t size, LineStore& result) {
+    bool isArray;
+    m_msgPack.Parse(data, size);
+    auto itemCount = m_msgPack.NextArrayOrNull(isArray);
+    if (!isArray) {
+        throw ProxyError("shared memory region of \"lines_shm\" must contain an array of lines");
+    }
+    ParseLines(m_msgPack, itemCount, result);
 }
 
-std::string Protocol::CreateMessageSelectCustomInput(const char* text) {
-    return detail::Format(
-        "{\"name\": \"select_custom_input\", \"value\": \"%s\"}",
-        m_json.EscapeString(text).c_str());
+template <typename Fill> std::string_view Protocol::CreateMessage(const char* name, uint32_t seq, const Fill& fillValue) {
+    auto write = [name, seq, &fillValue](auto& writer) {
+        writer.Clear();
+        writer.Object((seq == 0) ? 2 : 3);
+        writer.Key("name");
+        writer.String(name);
+        writer.Key("value");
+        fillValue(writer);
+        if (seq != 0) {
+            writer.Key("seq");
+            writer.UInt(seq);
+        }
+        writer.EndObject();
+        return writer.Data();
+    };
+
+    if (m_format == MessageFormat::MsgPack) {
+        return write(m_msgPackWriter);
+    }
+
+    return write(m_jsonWriter);
 }
 
-std::string Protocol::CreateMessageKeyPress(const Line& line, const char* keyName) {
-    return detail::Format(
-        "{\"name\": \"key_press\", \"value\": {\"key\": \"%s\", \"line\": {\"id\": \"%s\", \"text\": \"%s\", \"group\": \"%s\"}}}",
-        m_json.EscapeString(keyName).c_str(),
-        m_json.EscapeString(line.id.c_str()).c_str(),
-        m_json.EscapeString(line.text.c_str()).c_str(),
-        m_json.EscapeString(line.group.c_str()).c_str());
+template <typename Writer> void Protocol::WriteLine(Writer& writer, const Line& line) {
+    writer.Object(3);
+    writer.Key("id");
+    writer.String(line.id);
+    writer.Key("text");
+    writer.String(line.text);
+    writer.Key("group");
+    writer.String(line.group);
+    writer.EndObject();
 }
 
-UserRequest Protocol::ParseRequest(const char* text) {
-    m_json.Parse(text);
+void Protocol::WriteSnapshotLine(MsgPackWriter& writer, const Line& line) {
+    // Fields with default values are omitted
+    uint32_t size = 2u + (line.id.empty() ? 0u : 1u) + (line.group.empty() ? 0u : 1u) + (line.icon.empty() ? 0u : 1u) +
+        (line.urgent ? 1u : 0u) + (line.active ? 1u : 0u) + (line.markup ? 1u : 0u);
+    writer.Object(size);
+    writer.Key("text");
+    writer.String(line.text);
+    writer.Key("filtering");
+    writer.Bool(line.filtering);
+    if (!line.id.empty()) {
+        writer.Key("id");
+        writer.String(line.id);
+    }
+    if (!line.group.empty()) {
+        writer.Key("group");
+        writer.String(line.group);
+    }
+    if (!line.icon.empty()) {
+        writer.Key("icon");
+        writer.String(line.icon);
+    }
+    if (line.urgent) {
+        writer.Key("urgent");
+        writer.Bool(true);
+    }
+    if (line.active) {
+        writer.Key("active");
+        writer.Bool(true);
+    }
+    if (line.markup) {
+        writer.Key("markup");
+        writer.Bool(true);
+    }
+}
 
+template <typename Reader> UserRequest Protocol::ParseRequest(Reader& reader, uint32_t lastInputSeq) {
     UserRequest result;
-    uint32_t keyCount = m_json.Next(TokenType::Object)->size;
+    // The answer to a superseded input is dropped before the lines are parsed
+    ParseReplyHeader(reader, result);
+    if ((result.inReplyTo != 0) && (result.inReplyTo < lastInputSeq)) {
+        result.isStale = true;
+        return result;
+    }
+
+    reader.Rewind();
+    uint32_t keyCount = reader.NextObject();
     for (uint32_t i=0; i!=keyCount; ++i) {
-        auto key = m_json.NextString();
+        auto key = reader.NextString();
         if (key == "prompt") {
-            result.prompt = m_json.NextStringOrNull(result.updatePrompt);
+            result.prompt = reader.NextStringOrNull(result.updatePrompt);
         } else if (key == "input") {
-            result.input = m_json.NextStringOrNull(result.updateInput);
+            result.input = reader.NextStringOrNull(result.updateInput);
         } else if (key == "overlay") {
-            result.overlay = m_json.NextStringOrNull(result.updateOverlay);
+            result.overlay = reader.NextStringOrNull(result.updateOverlay);
         } else if (key == "help") {
-            result.help = m_json.NextStringOrNull(result.updateHelp);
+            result.help = reader.NextStringOrNull(result.updateHelp);
         } else if (key == "hide_combi_lines") {
-            result.hideCombiLines = m_json.NextBoolOrNull(result.updateHideCombiLines);
+            result.hideCombiLines = reader.NextBoolOrNull(result.updateHideCombiLines);
         } else if (key == "exit_by_cancel") {
-            result.exitByCancel = m_json.NextBoolOrNull(result.updateExitByCancel);
+            result.exitByCancel = reader.NextBoolOrNull(result.updateExitByCancel);
+        } else if (key == "fuzzy_top") {
+            result.fuzzyTop = reader.NextUIntOrNull(result.updateFuzzyTop);
+        } else if (key == "in_reply_to") {
+            reader.NextUInt();
         } else if (key == "lines") {
-            auto itemCount = m_json.NextOrNull(TokenType::Array, result.updateLines)->size;
+            auto itemCount = reader.NextArrayOrNull(result.updateLines);
             if (result.updateLines) {
-                ParseLines(itemCount, result.lines);
+                ParseLines(reader, itemCount, result.lines);
+            }
+        } else if (key == "lines_shm") {
+            result.linesShm = ParseSharedLinesRef(reader, reader.NextObject());
+            result.updateLinesShm = true;
+        } else if (key == "virtual_count") {
+            result.virtualCount = reader.NextUIntOrNull(result.updateVirtualCount);
+        } else if (key == "lines_window") {
+            ParseLinesWindow(reader, reader.NextObject(), result);
+            result.updateLinesWindow = true;
+        } else if (key == "lines_patch") {
+            auto itemCount = reader.NextArrayOrNull(result.updateLinesPatch);
+            if (result.updateLinesPatch) {
+                ParseLinesPatch(reader, itemCount, result.linesPatch, result.linesPatchLines);
             }
         } else {
             throw ProxyError("unexpected key \"%s\" in root dict", std::string(key).c_str());
@@ -72,42 +273,112 @@ UserRequest Protocol::ParseRequest(const char* text) {
     return result;
 }
 
-void Protocol::ParseLines(uint32_t itemCount, std::vector<Line>& result) {
+template <typename Reader> void Protocol::ParseReplyHeader(Reader& reader, UserRequest& result) {
+    uint32_t keyCount = reader.NextObject();
+    for (uint32_t i=0; i!=keyCount; ++i) {
+        auto key = reader.NextString();
+        if (key == "in_reply_to") {
+            result.inReplyTo = reader.NextUInt();
+        } else if (key == "lines_shm") {
+            // The region of a stale request is released too
+            result.linesShm = ParseSharedLinesRef(reader, reader.NextObject());
+            result.updateLinesShm = true;
+        } else {
+            reader.SkipValue();
+        }
+    }
+}
+
+template <typename Reader> SharedLinesRef Protocol::ParseSharedLinesRef(Reader& reader, uint32_t keyCount) {
+    SharedLinesRef result;
+    bool hasGeneration = false;
+    bool hasLength = false;
+    for (uint32_t i=0; i!=keyCount; ++i) {
+        auto key = reader.NextString();
+        if (key == "generation") {
+            result.generation = reader.NextUInt();
+            hasGeneration = true;
+        } else if (key == "offset") {
+            result.offset = reader.NextUInt();
+        } else if (key == "length") {
+            result.length = reader.NextUInt();
+            hasLength = true;
+        } else {
+            throw ProxyError("unexpected key \"%s\" in section \"lines_shm\"", std::string(key).c_str());
+        }
+    }
+
+    if ((!hasGeneration) || (!hasLength)) {
+        throw ProxyError("fields \"generation\" and \"length\" in section \"lines_shm\" are required");
+    }
+
+    return result;
+}
+
+template <typename Reader> void Protocol::ParseLinesWindow(Reader& reader, uint32_t keyCount, UserRequest& result) {
+    bool hasGeneration = false;
+    bool hasOffset = false;
+    bool hasLines = false;
+    for (uint32_t i=0; i!=keyCount; ++i) {
+        auto key = reader.NextString();
+        if (key == "generation") {
+            result.linesWindowGeneration = reader.NextUInt();
+            hasGeneration = true;
+        } else if (key == "offset") {
+            result.linesWindowOffset = reader.NextUInt();
+            hasOffset = true;
+        } else if (key == "lines") {
+            auto itemCount = reader.NextArrayOrNull(hasLines);
+            if (hasLines) {
+                ParseLines(reader, itemCount, result.linesWindow);
+            }
+        } else {
+            throw ProxyError("unexpected key \"%s\" in section \"lines_window\"", std::string(key).c_str());
+        }
+    }
+
+    if ((!hasGeneration) || (!hasOffset) || (!hasLines)) {
+        throw ProxyError("fields \"generation\", \"offset\" and \"lines\" in section \"lines_window\" are required");
+    }
+}
+
+template <typename Reader> void Protocol::ParseLines(Reader& reader, uint32_t itemCount, LineStore& result) {
+    result.Reserve(MaxItemCount(reader, itemCount));
     for (uint32_t i=0; i!=itemCount; ++i) {
-        result.push_back(ParseLine(m_json.Next(TokenType::Object)->size));
+        result.Add(ParseLine(reader, reader.NextObject()));
     }
 }
 
-Line Protocol::ParseLine(uint32_t keyCount) {
+template <typename Reader> Line Protocol::ParseLine(Reader& reader, uint32_t keyCount) {
     Line result;
     bool isValue;
     for (uint32_t i=0; i!=keyCount; ++i) {
-        auto key = m_json.NextString();
+        auto key = reader.NextString();
         if (key == "id") {
-            result.id = m_json.NextStringOrNull(isValue);
+            result.id = reader.NextStringOrNull(isValue);
         } else if (key == "text") {
-            result.text = m_json.NextString();
+            result.text = reader.NextString();
         } else if (key == "group") {
-            result.group = m_json.NextStringOrNull(isValue);
+            result.group = reader.NextStringOrNull(isValue);
         } else if (key == "icon") {
-            result.icon = m_json.NextStringOrNull(isValue);
+            result.icon = reader.NextStringOrNull(isValue);
         } else if (key == "filtering") {
-            bool value = m_json.NextBoolOrNull(isValue);
+            bool value = reader.NextBoolOrNull(isValue);
             if (isValue) {
                 result.filtering = value;
             }
         } else if (key == "urgent") {
-            bool value = m_json.NextBoolOrNull(isValue);
+            bool value = reader.NextBoolOrNull(isValue);
             if (isValue) {
                 result.urgent = value;
             }
         } else if (key == "active") {
-            bool value = m_json.NextBoolOrNull(isValue);
+            bool value = reader.NextBoolOrNull(isValue);
             if (isValue) {
                 result.active = value;
             }
         } else if (key == "markup") {
-            bool value = m_json.NextBoolOrNull(isValue);
+            bool value = reader.NextBoolOrNull(isValue);
             if (isValue) {
                 result.markup = value;
             }
@@ -119,6 +390,69 @@ Line Protocol::ParseLine(uint32_t keyCount) {
     if (result.text.empty()) {
         throw ProxyError("field \"text\" in section \"lines\" is empty");
     }
+    CheckLineString(result.id, "id");
+    CheckLineString(result.text, "text");
+    CheckLineString(result.group, "group");
+    CheckLineString(result.icon, "icon");
+
+    return result;
+}
+
+template <typename Reader> void Protocol::ParseLinesPatch(Reader& reader, uint32_t itemCount, std::vector<LinePatch>& result, LineStore& lines) {
+    result.reserve(MaxItemCount(reader, itemCount));
+    for (uint32_t i=0; i!=itemCount; ++i) {
+        result.push_back(ParseLinePatch(reader, reader.NextObject(), lines));
+    }
+}
+
+template <typename Reader> LinePatch Protocol::ParseLinePatch(Reader& reader, uint32_t keyCount, LineStore& lines) {
+    LinePatch result;
+    bool hasOp = false;
+    bool hasId = false;
+    bool hasLine = false;
+    for (uint32_t i=0; i!=keyCount; ++i) {
+        auto key = reader.NextString();
+        if (key == "op") {
+            auto op = reader.NextString();
+            hasOp = true;
+            if (op == "insert") {
+                result.type = LinePatchType::Insert;
+            } else if (op == "remove") {
+                result.type = LinePatchType::Remove;
+            } else if (op == "update") {
+                result.type = LinePatchType::Update;
+            } else if (op == "move") {
+                result.type = LinePatchType::Move;
+            } else {
+                throw ProxyError("unexpected value \"%s\" of field \"op\" in section \"lines_patch\"", std::string(op).c_str());
+            }
+        } else if (key == "id") {
+            result.id = reader.NextString();
+            hasId = true;
+        } else if (key == "index") {
+            result.index = reader.NextUInt();
+            result.hasIndex = true;
+        } else if (key == "line") {
+            result.line = static_cast<uint32_t>(lines.Size());
+            lines.Add(ParseLine(reader, reader.NextObject()));
+            hasLine = true;
+        } else {
+            throw ProxyError("unexpected key \"%s\" in lines patch item dict", std::string(key).c_str());
+        }
+    }
+
+    if (!hasOp) {
+        throw ProxyError("field \"op\" in section \"lines_patch\" is required");
+    }
+    if ((result.type != LinePatchType::Insert) && (!hasId)) {
+        throw ProxyError("field \"id\" in section \"lines_patch\" is required for remove, update and move");
+    }
+    if (((result.type == LinePatchType::Insert) || (result.type == LinePatchType::Update)) && (!hasLine)) {
+        throw ProxyError("field \"line\" in section \"lines_patch\" is required for insert and update");
+    }
+    if ((result.type == LinePatchType::Move) && (!result.hasIndex)) {
+        throw ProxyError("field \"index\" in section \"lines_patch\" is required for move");
+    }
 
     return result;
 }
@@ -4,21 +4,38 @@
 #include <vector>
 
 #include "json.h"
+#include "msgpack.h"
+#include "line_store.h"
 
 
-struct Line {
-    bool filtering = true;
-    bool urgent = false;
-    bool active = false;
-    bool markup = false;
+enum class LinePatchType : uint8_t {
+    Insert,
+    Remove,
+    Update,
+    Move,
+};
+
+struct LinePatch {
+    LinePatchType type;
     std::string id;
-    std::string text;
-    std::string group;
-    std::string icon;
-    uint32_t iconUID = 0;
+    uint32_t index = 0;
+    bool hasIndex = false;
+    // Index of the line in UserRequest::linesPatchLines
+    uint32_t line = 0;
+};
+
+// Location of "lines" written by the backend to the shared memory (see SharedMemory)
+struct SharedLinesRef {
+    uint32_t generation = 0;
+    uint32_t offset = 0;
+    uint32_t length = 0;
 };
 
 struct UserRequest {
+    // Sequence number of the input message which this request answers, 0 if not set
+    uint32_t inReplyTo = 0;
+    // The request answers a superseded input, other fields except "lines_shm" are not parsed
+    bool isStale = false;
     std::string prompt;
     bool updatePrompt = false;
     std::string input;
@@ -31,8 +48,33 @@ struct UserRequest {
     bool updateHideCombiLines = false;
     bool exitByCancel = true;
     bool updateExitByCancel = false;
-    std::vector<Line> lines;
+    // Number of lines ranked by the plugin, 0 - rofi filters lines
+    uint32_t fuzzyTop = 0;
+    bool updateFuzzyTop = false;
+    LineStore lines;
     bool updateLines = false;
+    SharedLinesRef linesShm;
+    bool updateLinesShm = false;
+    // Lines of linesShm read by the reader thread, valid if isLinesShmParsed is set
+    LineStore linesShmLines;
+    bool isLinesShmParsed = false;
+    // Size of the virtual list, its lines are received by windows
+    uint32_t virtualCount = 0;
+    bool updateVirtualCount = false;
+    // Lines of the virtual list starting from linesWindowOffset, the generation of the list is
+    // from the "fetch_lines" message which they answer
+    uint32_t linesWindowGeneration = 0;
+    uint32_t linesWindowOffset = 0;
+    LineStore linesWindow;
+    bool updateLinesWindow = false;
+    std::vector<LinePatch> linesPatch;
+    LineStore linesPatchLines;
+    bool updateLinesPatch = false;
+};
+
+enum class MessageFormat : uint8_t {
+    Json,
+    MsgPack,
 };
 
 class Protocol {
@@ -40,18 +82,58 @@ public:
     Protocol() = default;
     ~Protocol() = default;
 
-    std::string CreateMessageInput(const char* text);
-    std::string CreateMessageSelectLine(const Line& line);
-    std::string CreateMessageDeleteLine(const Line& line);
-    std::string CreateMessageSelectCustomInput(const char* text);
-    std::string CreateMessageKeyPress(const Line& line, const char* keyName);
+    void SetFormat(MessageFormat format) { m_format = format; }
+    MessageFormat GetFormat() const { return m_format; }
+
+    // Messages are built in a buffer of the protocol, they are valid until the next CreateMessage* call
+    // The first message of a session with a shared backend (see Process::Connect)
+    std::string_view CreateMessageHello(const char* sessionId, int pid);
+    // seq is a number of the input, it is increased for every sent input
+    std::string_view CreateMessageInput(const char* text, uint32_t seq);
+    // seq is a number of the input which result is no longer needed
+    std::string_view CreateMessageCancel(uint32_t seq);
+    // The shared memory region of the generation is no longer used and can be overwritten
+    std::string_view CreateMessageLinesShmRelease(uint32_t generation);
+    // Lines [offset, offset + count) of the virtual list are needed
+    std::string_view CreateMessageFetchLines(uint32_t generation, size_t offset, size_t count);
+    std::string_view CreateMessageSelectLine(const Line& line);
+    std::string_view CreateMessageDeleteLine(const Line& line);
+    std::string_view CreateMessageSelectCustomInput(const char* text);
+    std::string_view CreateMessageKeyPress(const Line& line, const char* keyName);
 
-    UserRequest ParseRequest(const char* text);
+    // State of rofi saved between launches, see Snapshot. It is a request in MessagePack format
+    // regardless of the protocol format, so a mapped read-only file is parsed without copying.
+    std::string_view CreateSnapshot(const std::string& prompt, const std::string& help, const std::string& overlay, const LineStore& lines);
+    UserRequest ParseSnapshot(const char* data, size_t size);
+
+    // Tokenize the received part of a request, see Json::Feed
+    void FeedRequest(char* text, size_t size) noexcept;
+    // Parse the whole request in place, text is modified.
+    // A request with "in_reply_to" less than lastInputSeq is stale and is not parsed further.
+    UserRequest ParseRequest(char* text, size_t size, uint32_t lastInputSeq);
+    // Parse "lines" from the shared memory, they are always in MessagePack format,
+    // so the read-only data is parsed without copying
+    void ParseSharedLines(const char* data, size_t size, LineStore& result);
 
 private:
-    void ParseLines(uint32_t itemCount, std::vector<Line>& result);
-    Line ParseLine(uint32_t keyCount);
+    // Root object of every message has keys "name", "value" and "seq" if it is not 0
+    template <typename Fill> std::string_view CreateMessage(const char* name, uint32_t seq, const Fill& fillValue);
+    template <typename Writer> static void WriteLine(Writer& writer, const Line& line);
+    static void WriteSnapshotLine(MsgPackWriter& writer, const Line& line);
+
+    template <typename Reader> UserRequest ParseRequest(Reader& reader, uint32_t lastInputSeq);
+    template <typename Reader> void ParseReplyHeader(Reader& reader, UserRequest& result);
+    template <typename Reader> SharedLinesRef ParseSharedLinesRef(Reader& reader, uint32_t keyCount);
+    template <typename Reader> void ParseLinesWindow(Reader& reader, uint32_t keyCount, UserRequest& result);
+    template <typename Reader> void ParseLines(Reader& reader, uint32_t itemCount, LineStore& result);
+    template <typename Reader> Line ParseLine(Reader& reader, uint32_t keyCount);
+    template <typename Reader> void ParseLinesPatch(Reader& reader, uint32_t itemCount, std::vector<LinePatch>& result, LineStore& lines);
+    template <typename Reader> LinePatch ParseLinePatch(Reader& reader, uint32_t keyCount, LineStore& lines);
 
 private:
+    MessageFormat m_format = MessageFormat::Json;
     Json m_json;
+    JsonWriter m_jsonWriter;
+    MsgPack m_msgPack;
+    MsgPackWriter m_msgPackWriter;
 };
@@ -1,9 +1,14 @@
 #include "proxy.h"
 
+#include <algorithm>
+#include <unistd.h>
 #include <rofi/helper.h>
+#include <rofi/settings.h>
 
 #include "rofi.h"
+#include "defer.h"
 #include "logger.h"
+#include "line_filter.h"
 #include "exception.h"
 
 
@@ -15,6 +20,25 @@ static const int MARKUP = 8;
 
 namespace {
 
+static constexpr size_t NO_POSITION = SIZE_MAX;
+// The positions of lines are rebuilt after this number of patch items, so FindLine replays a short log
+static constexpr size_t MAX_LINE_SHIFTS = 4096;
+
+// The case sensitivity which rofi uses for tokens of the user input, with the "case-smart" option
+// an uppercase character makes the input case sensitive
+static bool IsCaseSensitive(const char* text) {
+    if ((config.case_sensitive == TRUE) || (config.case_smart == FALSE) || (g_utf8_validate(text, -1, nullptr) == FALSE)) {
+        return (config.case_sensitive == TRUE);
+    }
+    for (const char* it = text; *it != 0; it = g_utf8_find_next_char(it, nullptr)) {
+        if (g_unichar_isupper(g_utf8_get_char(it)) == TRUE) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static int OnPostInitHandler(void* ptr) {
     reinterpret_cast<Proxy*>(ptr)->OnPostInit();
     return FALSE;
@@ -22,11 +46,52 @@ static int OnPostInitHandler(void* ptr) {
 
 }
 
+Source::Source(Proxy* owner, size_t index, const std::shared_ptr<Logger>& logger)
+    : owner(owner)
+    , index(index)
+    , process(std::make_unique<Process>(this, logger))
+    , protocol(std::make_unique<Protocol>()) {
+
+}
+
+Source::~Source() {
+    // The reader thread can wait for space in the queue, it is released before the thread is stopped
+    if (requestQueue) {
+        requestQueue->Close();
+    }
+    process.reset();
+}
+
+void Source::OnReadPartialLine(char* text, size_t size) {
+    owner->OnReadPartialLine(*this, text, size);
+}
+
+void Source::OnReadLine(char* text, size_t size) {
+    owner->OnReadLine(*this, text, size);
+}
+
+void Source::OnReadLineError(const char* text) {
+    owner->OnReadLineError(*this, text);
+}
+
+void Source::OnWriteError(const char* text) {
+    owner->OnWriteError(*this, text);
+}
+
+void Source::OnProcessExit(int pid, bool normally) {
+    owner->OnProcessExit(*this, pid, normally);
+}
+
+void Source::OnRequestsReady() {
+    owner->OnRequestsReady(*this);
+}
+
 Proxy::Proxy()
-    : m_logger(std::make_shared<Logger>())
+    // The proxy is created on load of the plugin (see plugin.cpp), startup times are measured from here
+    : m_loadTime(g_get_monotonic_time())
+    , m_logger(std::make_shared<Logger>())
     , m_rofi(std::make_unique<Rofi>(m_logger))
-    , m_process(std::make_unique<Process>(this, m_logger))
-    , m_protocol(std::make_unique<Protocol>()) {
+    , m_inputScheduler(std::make_unique<InputScheduler>(this, m_logger)) {
 
 }
 
@@ -41,54 +106,237 @@ void Proxy::Init(Mode* proxyMode) {
     }
     m_logger->Debug("Init plugin start");
 
+    CreateSources();
+
+    char* protocol = nullptr;
+    if (find_arg_str("-proxy-protocol", &protocol) == TRUE) {
+        if (std::string(protocol) == "binary") {
+            for (auto& source: m_sources) {
+                source->protocol->SetFormat(MessageFormat::MsgPack);
+            }
+        } else if (std::string(protocol) != "json") {
+            throw ProxyError("unknown value \"%s\" of arg '-proxy-protocol', expected \"json\" or \"binary\"", protocol);
+        }
+    }
+
+    char* debounce = nullptr;
+    if (find_arg_str("-proxy-input-debounce-ms", &debounce) == TRUE) {
+        if (std::string(debounce) == "auto") {
+            m_inputScheduler->SetMode(InputSchedulerMode::Adaptive, 0);
+        } else {
+            char* end = nullptr;
+            unsigned long delayMs = strtoul(debounce, &end, 10);
+            if ((end == debounce) || (*end != '\0') || (delayMs > UINT32_MAX)) {
+                throw ProxyError("invalid value \"%s\" of arg '-proxy-input-debounce-ms', expected a number or \"auto\"", debounce);
+            }
+            m_inputScheduler->SetMode(InputSchedulerMode::Debounce, static_cast<uint32_t>(delayMs));
+        }
+    }
+
+    unsigned int maxMessageSize = 0;
+    if (find_arg_uint("-proxy-max-message-size", &maxMessageSize) == TRUE) {
+        for (auto& source: m_sources) {
+            source->process->SetMaxMessageSize(maxMessageSize);
+        }
+    }
+
+    unsigned int pipeSize = 0;
+    if (find_arg_uint("-proxy-pipe-size", &pipeSize) == TRUE) {
+        for (auto& source: m_sources) {
+            source->process->SetPipeSize(pipeSize);
+        }
+    }
+
+    unsigned int virtualMaxLines = 0;
+    if (find_arg_uint("-proxy-virtual-max-lines", &virtualMaxLines) == TRUE) {
+        m_virtualMaxLines = virtualMaxLines;
+    }
+
+    if (find_arg("-proxy-coalesce-input") >= 0) {
+        m_inputWritePolicy = WritePolicy::ReplacePending;
+    }
+
+    if (find_arg("-proxy-cancel") >= 0) {
+        m_sendCancel = true;
+    }
+
+    if (find_arg("-proxy-shm") >= 0) {
+        for (auto& source: m_sources) {
+            source->sharedMemory = std::make_unique<SharedMemory>();
+            source->sharedMemory->Create("rofi_proxy_lines");
+            source->process->SetSharedFd(source->sharedMemory->GetFd());
+        }
+    }
+
+    m_matchKeys.SetFoldCase(find_arg("-proxy-match-fold-case") >= 0);
+    m_matchKeys.SetFoldAccents(find_arg("-proxy-match-fold-accents") >= 0);
+
+    if (find_arg("-proxy-match-index") >= 0) {
+        m_trigramIndex = std::make_unique<TrigramIndex>();
+        m_filterCache.SetIndex(m_trigramIndex.get());
+    }
+
+    unsigned int matchThreads = 0;
+    if (find_arg_uint("-proxy-match-threads", &matchThreads) == TRUE) {
+        m_filterCache.EnablePrecompute(this, matchThreads);
+    }
+
+    if (find_arg("-proxy-reader-thread") >= 0) {
+        for (auto& source: m_sources) {
+            source->parser = std::make_unique<Protocol>();
+            source->parser->SetFormat(source->protocol->GetFormat());
+            source->requestQueue = std::make_unique<RequestQueue>(source.get());
+            source->process->SetReadThread(true);
+        }
+    }
+
     m_rofi->SetProxyMode(proxyMode);
+    // Backends start in parallel with rofi, their requests wait for the view in m_pendingRequests
+    StartBackends();
+    if (find_arg("-proxy-snapshot") >= 0) {
+        LoadSnapshot();
+    }
     g_idle_add(OnPostInitHandler, this);
 
-    m_logger->Debug("Init plugin finished");
+    m_logger->Debug("Init plugin finished, %" G_GINT64_FORMAT " us after load", g_get_monotonic_time() - m_loadTime);
 }
 
 void Proxy::OnPostInit() {
-    m_logger->Debug("PostInit plugin start");
+    m_logger->Debug("PostInit plugin start, %" G_GINT64_FORMAT " us after load", g_get_monotonic_time() - m_loadTime);
 
     m_rofi->OnPostInit();
 
     m_state = State::Running;
 
-    char* command = nullptr;
-    if (find_arg_str("-proxy-cmd", &command) == TRUE) {
-        m_process->Start(command);
-    } else {
-        m_process->Start(nullptr);
+    if (!m_pendingRequests.empty()) {
+        m_logger->Debug("Apply %zu requests received before the view was ready", m_pendingRequests.size());
+        for (auto& pending: m_pendingRequests) {
+            try {
+                ApplyRequest(*pending.source, pending.request);
+            } catch(const std::exception& e) {
+                m_logger->Error("Error error while applying state from child process request: %s", e.what());
+                KillOnError(*pending.source);
+                break;
+            }
+        }
+        m_pendingRequests.clear();
+        m_pendingRequests.shrink_to_fit();
     }
 
     m_logger->Debug("PostInit plugin finished");
 }
 
+void Proxy::CreateSources() {
+    const char** commands = find_arg_strv("-proxy-cmd");
+    for (const char** it = commands; (it != nullptr) && (*it != nullptr); ++it) {
+        m_sources.push_back(std::make_unique<Source>(this, m_sources.size(), m_logger));
+        m_sources.back()->command = *it;
+    }
+    g_free(commands);
+
+    // Without "-proxy-cmd" the proxy works with its own stdin and stdout
+    if (m_sources.empty()) {
+        m_sources.push_back(std::make_unique<Source>(this, 0, m_logger));
+    }
+}
+
+void Proxy::StartBackends() {
+    for (auto& source: m_sources) {
+        auto framing = (source->protocol->GetFormat() == MessageFormat::MsgPack) ? Framing::LengthPrefixed : Framing::Line;
+        const char* command = source->command.empty() ? nullptr : source->command.c_str();
+
+        char* socketPath = nullptr;
+        if ((source->index == 0) && (find_arg_str("-proxy-socket", &socketPath) == TRUE)) {
+            source->process->Connect(socketPath, command, framing);
+            source->isRunning = true;
+            // Many rofi instances can share one backend, every connection is a separate session
+            auto sessionId = detail::Format("%d-%" G_GINT64_FORMAT, getpid(), g_get_real_time());
+            m_logger->Debug("Start session \"%s\"", sessionId.c_str());
+            SendMessage(*source, "hello", source->protocol->CreateMessageHello(sessionId.c_str(), getpid()));
+        } else {
+            source->process->Start(command, framing);
+            source->isRunning = true;
+        }
+    }
+}
+
 void Proxy::Destroy() {
     m_logger->Debug("Destroy plugin start");
+    if (m_snapshot && (m_state == State::Running) && (!m_showsSnapshot) && m_hasFirstLines) {
+        m_snapshot->Save(m_sources.front()->protocol->CreateSnapshot(m_prompt, m_help, m_overlay, m_lines));
+    }
     m_state = State::DestroyProcess;
-    if (m_process) {
-        m_process->Kill();
+    bool isRunning = false;
+    for (auto& source: m_sources) {
+        const auto& stats = source->process->GetWriteStats();
+        m_logger->Debug("Write stats of source %zu: stalls = %zu, stall time = %" G_GINT64_FORMAT " us, max queued = %zu bytes, replaced = %zu",
+            source->index, stats.stallCount, stats.stallTime, stats.maxQueuedBytes, stats.replacedCount);
+        isRunning = isRunning || source->isRunning;
+    }
+    if (isRunning) {
+        for (auto& source: m_sources) {
+            if (source->isRunning) {
+                source->process->Kill();
+            }
+        }
         while (m_state != State::ChildFinished) {
             g_main_context_iteration(nullptr, TRUE);
         }
-        m_process.reset();
     }
-    m_protocol.reset();
+    m_sources.clear();
+    m_snapshot.reset();
+    m_inputScheduler.reset();
     m_rofi.reset();
     m_logger->Debug("Destroy plugin finished");
     m_logger.reset();
 }
 
+void Proxy::LoadSnapshot() {
+    // The snapshot belongs to the set of backends
+    std::string key;
+    for (const auto& source: m_sources) {
+        key += source->command + "\n";
+    }
+    char* socketPath = nullptr;
+    if (find_arg_str("-proxy-socket", &socketPath) == TRUE) {
+        key += socketPath;
+    }
+    if (key == "\n") {
+        m_logger->Error("Arg '-proxy-snapshot' requires arg '-proxy-cmd' or '-proxy-socket'");
+        return;
+    }
+
+    m_snapshot = std::make_unique<Snapshot>(m_logger);
+    m_snapshot->SetKey(key.c_str());
+    UserRequest snapshot;
+    if (!m_snapshot->Load(*m_sources.front()->protocol, snapshot)) {
+        return;
+    }
+
+    // Lines and help are ready for the first paint of rofi, the rest needs the view
+    m_matchKeys.Build(snapshot.lines);
+    m_lines = std::move(snapshot.lines);
+    m_filterCache.Reset();
+    m_fuzzyRanker.Clear();
+    RebuildIndex();
+    m_sources.front()->linesCount = m_lines.Size();
+    m_help = snapshot.help;
+    snapshot.updateLines = false;
+    snapshot.updateHelp = false;
+    m_pendingRequests.push_back(PendingRequest{m_sources.front().get(), std::move(snapshot)});
+    m_showsSnapshot = true;
+    m_logger->Debug("Load snapshot with %zu lines, %" G_GINT64_FORMAT " us after load", m_lines.Size(), g_get_monotonic_time() - m_loadTime);
+}
+
 size_t Proxy::GetLinesCount() const {
-    size_t result = m_lines.size();
-    m_logger->Debug("GetLinesCount = %zu", result);
+    size_t result = GetPositionsCount();
+    m_logger->Trace("GetLinesCount = %zu", result);
     return result;
 }
 
 const char* Proxy::GetLine(size_t index, int* state) {
-    // m_logger->Debug("GetLine(%zu)", index);
-    if (index >= m_lines.size()) {
+    m_logger->Trace("GetLine(%zu)", index);
+    if (index >= GetPositionsCount()) {
         return nullptr;
     }
 
@@ -99,14 +347,21 @@ const char* Proxy::GetLine(size_t index, int* state) {
         }
     }
 
-    if (m_lines[index].urgent) {
+    index = GetLineIndex(index);
+    LineStore* lines = FindLineStore(index);
+    if (lines == nullptr) {
+        // The line of the virtual list is shown when its window is received
+        return "";
+    }
+
+    if (lines->IsUrgent(index)) {
         *state |= URGENT;
-    } else if (m_lines[index].active) {
+    } else if (lines->IsActive(index)) {
         *state |= ACTIVE;
-    } else if (m_lines[index].markup) {
+    } else if (lines->IsMarkup(index)) {
         *state |= MARKUP;
     }
-    return m_lines[index].text.c_str();
+    return lines->GetText(index);
 }
 
 const char* Proxy::GetHelpMessage() const {
@@ -120,17 +375,19 @@ const char* Proxy::GetHelpMessage() const {
 }
 
 cairo_surface_t* Proxy::GetIcon(size_t index, int height) {
-    // m_logger->Debug("GetIcon(%zu, %d)", index, height);
-    if (index >= m_lines.size()) {
+    m_logger->Trace("GetIcon(%zu, %d)", index, height);
+    index = GetLineIndex(index);
+    LineStore* lines = FindLineStore(index);
+    if (lines == nullptr) {
         return nullptr;
     }
 
-    const std::string& name = m_lines[index].icon;
-    if (name.empty()) {
+    const char* name = lines->GetIcon(index);
+    if (*name == '\0') {
         return nullptr;
     }
 
-    return m_rofi->GetIcon(m_lines[index].iconUID, name, height);
+    return m_rofi->GetIcon(lines->GetIconUID(index), name, height);
 }
 
 bool Proxy::OnCancel() {
@@ -139,7 +396,10 @@ bool Proxy::OnCancel() {
         return true;
     }
 
-    SendMessage("key_press", m_protocol->CreateMessageKeyPress(Line(), "cancel"));
+    m_inputScheduler->SendPending();
+    for (auto& source: m_sources) {
+        SendMessage(*source, "key_press", source->protocol->CreateMessageKeyPress(Line(), "cancel"));
+    }
 
     m_logger->Debug("OnCancel = false (not exit)");
     return false;
@@ -147,123 +407,325 @@ bool Proxy::OnCancel() {
 
 void Proxy::OnSelectLine(size_t index) {
     m_logger->Debug("OnSelectLine(%zu)", index);
-    if (index >= m_lines.size()) {
+    index = GetLineIndex(index);
+    Source* source = FindSource(index);
+    if (source == nullptr) {
         return;
     }
 
-    SendMessage("select_line", m_protocol->CreateMessageSelectLine(m_lines[index]));
+    m_inputScheduler->SendPending();
+    SendMessage(*source, "select_line", source->protocol->CreateMessageSelectLine(GetLineData(index)));
 }
 
 void Proxy::OnDeleteLine(size_t index) {
     m_logger->Debug("OnDeleteLine(%zu)", index);
-    if (index >= m_lines.size()) {
+    index = GetLineIndex(index);
+    Source* source = FindSource(index);
+    if (source == nullptr) {
         return;
     }
 
-    SendMessage("delete_line", m_protocol->CreateMessageDeleteLine(m_lines[index]));
+    m_inputScheduler->SendPending();
+    SendMessage(*source, "delete_line", source->protocol->CreateMessageDeleteLine(GetLineData(index)));
 }
 
 void Proxy::OnSelectCustomInput(const char* text) {
     m_logger->Debug("OnSelectCustomInput(%s)", text);
 
-    SendMessage("select_custom_input", m_protocol->CreateMessageSelectCustomInput(text));
+    m_inputScheduler->SendPending();
+    for (auto& source: m_sources) {
+        SendMessage(*source, "select_custom_input", source->protocol->CreateMessageSelectCustomInput(text));
+    }
 }
 
 void Proxy::OnCustomKey(size_t index, int key) {
     m_logger->Debug("OnCustomKey(line = %zu, key = %d)", index, key);
+    index = GetLineIndex(index);
 
     auto keyName = "custom_" + std::to_string(key);
-    Line line;
-    if (index < m_lines.size()) {
-        line = m_lines[index];
+    m_inputScheduler->SendPending();
+    if (Source* source = FindSource(index); source != nullptr) {
+        SendMessage(*source, "key_press", source->protocol->CreateMessageKeyPress(GetLineData(index), keyName.c_str()));
+        return;
+    }
+
+    // A key without a line is sent to all sources
+    for (auto& source: m_sources) {
+        SendMessage(*source, "key_press", source->protocol->CreateMessageKeyPress(Line(), keyName.c_str()));
     }
-    SendMessage("key_press", m_protocol->CreateMessageKeyPress(line, keyName.c_str()));
 }
 
 const char* Proxy::OnInput(Mode* sw, const char* text) {
-    if (m_rofi->GetCachedUserInput() == text) {
-        return text;
+    if (m_trigramIndex && m_trigramIndex->Update()) {
+        m_logger->Debug("Trigram index of %zu lines is ready, size = %zu KB, build time = %" G_GINT64_FORMAT " us",
+            m_trigramIndex->GetLinesCount(), m_trigramIndex->MemorySize() / 1024, m_trigramIndex->GetBuildTimeUs());
     }
-    m_logger->Debug("OnInput(\"%s\")", text);
+    const char* input = text;
+    if (m_rofi->GetCachedUserInput() != text) {
+        m_logger->Debug("OnInput(\"%s\")", text);
 
-    m_rofi->SetCachedUserInput(text);
-    SendMessage("input", m_protocol->CreateMessageInput(text));
+        m_rofi->SetCachedUserInput(text);
+        m_inputScheduler->OnInput(text);
+        input = m_rofi->CallOriginPreprocessInput(sw, text);
+    }
 
-    return m_rofi->CallOriginPreprocessInput(sw, text);
+    // Rofi matches the returned text against the match keys of lines
+    const char* result = m_matchKeys.NormalizeInput(input);
+    if (!m_virtualLines) {
+        if (m_fuzzyRanker.IsEnabled()) {
+            RankLines(result);
+        }
+        // Rofi preprocesses the input every time before it filters lines
+        if (!m_fuzzyRanker.IsActive()) {
+            StartFilterPass(text, result);
+        }
+    }
+    return result;
 }
 
-bool Proxy::OnLineMatch(rofi_int_matcher_t** tokens, size_t index) const {
-    m_logger->Debug("OnLineMatch(%zu)", index);
-    if (index >= m_lines.size()) {
-        return false;
-    }
+void Proxy::StartFilterPass(const char* text, const char* input) {
+    // The same tokens as rofi builds for the input, the filter threads only read the prepared pass
+    rofi_int_matcher_t** tokens = helper_tokenize(input, IsCaseSensitive(text) ? TRUE : FALSE);
+    Defer _([tokens](...) { helper_tokenize_free(tokens); });
+    m_filterCache.StartPass(tokens, m_lines.Size());
+}
 
-    if (!m_lines[index].filtering) {
-        return true;
+void Proxy::RankLines(const char* input) {
+    int64_t startTime = g_get_monotonic_time();
+    size_t positionsCount = GetPositionsCount();
+    m_fuzzyRanker.Rank(input, m_lines);
+    if (m_fuzzyRanker.IsActive()) {
+        m_logger->Debug("Rank lines for \"%s\": %zu of %zu lines are shown, %" G_GINT64_FORMAT " us",
+            input, m_fuzzyRanker.GetRankedCount(), m_lines.Size(), g_get_monotonic_time() - startTime);
     }
 
-    return (helper_token_match(tokens, m_lines[index].text.c_str()) == TRUE);
+    // Rofi reads the number of lines only on reload, until then the positions after the ranked lines are hidden
+    if (GetPositionsCount() != positionsCount) {
+        m_rofi->Reload();
+    }
 }
 
-void Proxy::OnReadLine(const char* text) {
-    m_logger->Debug("Get request from child process: %s", text);
+bool Proxy::OnLineMatch(rofi_int_matcher_t** tokens, size_t index) {
+    return MatchLine(tokens, index, static_cast<bool>(m_virtualLines), m_lines, m_fuzzyRanker, m_filterCache, *this);
+}
 
-    try {
-        auto request = m_protocol->ParseRequest(text);
+bool Proxy::OnMatchLine(rofi_int_matcher_t** tokens, size_t index) {
+    return (!m_lines.IsFiltering(index)) || (helper_token_match(tokens, m_lines.GetMatchText(index)) == TRUE);
+}
 
-        m_rofi->StartUpdate();
+void Proxy::OnReadPartialLine(Source& source, char* text, size_t size) {
+    source.GetParser().FeedRequest(text, size);
+}
 
-        if (request.updateLines) {
-            m_lines = request.lines;
+void Proxy::OnReadLine(Source& source, char* text, size_t size) {
+    if (source.requestQueue) {
+        // Called in the reader thread, the main loop gets the built request
+        auto event = std::make_unique<ReadEvent>();
+        try {
+            event->request = ParseRequest(source, text, size);
+            // The region of a stale "lines_shm" is released by the main loop
+            if (event->request.isStale && (!event->request.updateLinesShm)) {
+                m_logger->Debug("Drop request in reply to input %u, the last input is %u", event->request.inReplyTo, m_inputSeq.load());
+                return;
+            }
+        } catch(const std::exception& e) {
+            m_logger->Error("Error while parsing child process request: %s", e.what());
+            event->failed = true;
         }
+        source.requestQueue->Push(std::move(event));
+        return;
+    }
 
-        if (request.updateHelp) {
-            m_help = request.help;
-        }
+    try {
+        OnRequest(source, ParseRequest(source, text, size));
+    } catch(const std::exception& e) {
+        m_logger->Error("Error error while applying state from child process request: %s", e.what());
+        KillOnError(source);
+    }
+}
 
-        if (request.updateExitByCancel) {
-            m_exitByCancel = request.exitByCancel;
+void Proxy::OnRequestsReady(Source& source) {
+    while (auto event = source.requestQueue->Pop()) {
+        if (event->failed) {
+            KillOnError(source);
+            return;
         }
-
-        if (request.updateInput) {
-            m_rofi->UpdateUserInput(request.input);
+        try {
+            OnRequest(source, std::move(event->request));
+        } catch(const std::exception& e) {
+            m_logger->Error("Error error while applying state from child process request: %s", e.what());
+            KillOnError(source);
+            return;
         }
+    }
+}
 
-        if (request.updateOverlay) {
-            m_rofi->UpdateOverlay(request.overlay);
-        }
+UserRequest Proxy::ParseRequest(Source& source, char* text, size_t size) {
+    auto& parser = source.GetParser();
+    if (parser.GetFormat() == MessageFormat::MsgPack) {
+        m_logger->Debug("Get binary request from source %zu, size = %zu", source.index, size);
+    } else {
+        m_logger->Debug("Get request from source %zu, size = %zu: %.*s",
+            source.index, size, static_cast<int>(std::min(size, Logger::RECORD_TEXT_SIZE)), text);
+    }
 
-        if (request.updatePrompt) {
-            m_rofi->UpdatePrompt(request.prompt);
-        }
+    auto request = parser.ParseRequest(text, size, m_inputSeq);
+    if (request.updateLinesShm && (!request.isStale) && source.requestQueue && source.sharedMemory) {
+        // The mapping is used only by the reader thread, big lists are not parsed in the main loop
+        auto data = source.sharedMemory->Map(request.linesShm.offset, request.linesShm.length);
+        parser.ParseSharedLines(data.data(), data.size(), request.linesShmLines);
+        request.isLinesShmParsed = true;
+        m_matchKeys.Build(request.linesShmLines);
+    }
+    if (request.updateLines) {
+        m_matchKeys.Build(request.lines);
+    }
+    if (request.updateLinesPatch) {
+        m_matchKeys.Build(request.linesPatchLines);
+    }
+
+    return request;
+}
 
-        if (request.updateHideCombiLines) {
-            m_rofi->UpdateHideCombiLines(request.hideCombiLines);
+void Proxy::OnRequest(Source& source, UserRequest&& request) {
+    // The input could be changed while the request was waiting in the queue of the reader thread
+    if (request.isStale || ((request.inReplyTo != 0) && (request.inReplyTo < m_inputSeq))) {
+        m_logger->Debug("Drop request in reply to input %u, the last input is %u", request.inReplyTo, m_inputSeq.load());
+        // The backend reuses the region only after the release
+        if (request.updateLinesShm) {
+            SendMessage(source, "lines_shm_release", source.protocol->CreateMessageLinesShmRelease(request.linesShm.generation));
         }
+        return;
+    }
+    // The fastest source releases the next input, the slower ones update their segments later.
+    // Older inputs are dropped above, a reply to an input that was not sent yet releases nothing.
+    if ((request.inReplyTo == 0) || (request.inReplyTo == m_inputSeq)) {
+        source.repliedInputSeq = std::max(source.repliedInputSeq, request.inReplyTo);
+        m_inputScheduler->OnBackendReply();
+    }
 
-        m_rofi->ApplyUpdate();
-    } catch(const std::exception& e) {
-        m_logger->Error("Error error while applying state from child process request: %s", e.what());
-        m_state = State::ErrorProcess;
-        m_process->Kill();
+    if (m_state == State::Starting) {
+        m_pendingRequests.push_back(PendingRequest{&source, std::move(request)});
+        return;
     }
+    ApplyRequest(source, request);
 }
 
-void Proxy::OnReadLineError(const char* text) {
+void Proxy::ApplyRequest(Source& source, UserRequest& request) {
+    m_rofi->StartUpdate();
+
+    if (m_showsSnapshot && (request.updateLines || request.updateLinesShm || request.updateLinesPatch || request.updateVirtualCount)) {
+        // The first lines of a backend replace the snapshot, a patch is applied to an empty list
+        DropSnapshotLines();
+    }
+
+    if ((request.updateLines || request.updateLinesShm || request.updateLinesPatch) && m_virtualLines) {
+        m_logger->Debug("Drop the virtual list");
+        m_virtualLines.reset();
+    }
+
+    if (request.updateLines) {
+        ReplaceLines(source, std::move(request.lines));
+    }
+
+    if (request.updateLinesShm) {
+        ApplySharedLines(source, request);
+    }
+
+    if (request.updateLinesPatch) {
+        ApplyLinesPatch(source, request.linesPatch, request.linesPatchLines);
+    }
+
+    if (request.updateVirtualCount) {
+        SetVirtualCount(source, request.virtualCount);
+    }
+
+    if (request.updateLinesWindow) {
+        ApplyLinesWindow(request);
+    }
+
+    if (request.updateHelp) {
+        m_help = request.help;
+    }
+
+    if (request.updateExitByCancel) {
+        m_exitByCancel = request.exitByCancel;
+    }
+
+    if (request.updateFuzzyTop) {
+        // Rofi reloads the view and ranks lines in OnInput
+        m_fuzzyRanker.SetLimit(request.fuzzyTop);
+        m_fuzzyRanker.Clear();
+    }
+
+    if (request.updateInput) {
+        m_rofi->UpdateUserInput(request.input);
+    }
+
+    if (request.updateOverlay) {
+        m_overlay = request.overlay;
+        m_rofi->UpdateOverlay(request.overlay);
+    }
+
+    if (request.updatePrompt) {
+        m_prompt = request.prompt;
+        m_rofi->UpdatePrompt(request.prompt);
+    }
+
+    if (request.updateHideCombiLines) {
+        m_rofi->UpdateHideCombiLines(request.hideCombiLines);
+    }
+
+    m_rofi->ApplyUpdate();
+
+    if ((!m_hasFirstLines) && (m_lines.Size() != 0)) {
+        m_hasFirstLines = true;
+        m_logger->Debug("First lines are shown %" G_GINT64_FORMAT " us after load", g_get_monotonic_time() - m_loadTime);
+    }
+}
+
+void Proxy::OnReadLineError(Source& source, const char* text) {
     m_logger->Error("Error while reading from stdout child process: %s", text);
-    if (m_state == State::Running) {
-        m_state = State::ErrorProcess;
-        m_process->Kill();
+    if (source.requestQueue) {
+        // Called in the reader thread
+        auto event = std::make_unique<ReadEvent>();
+        event->failed = true;
+        source.requestQueue->Push(std::move(event));
+        return;
     }
+    KillOnError(source);
+}
+
+void Proxy::OnWriteError(Source& source, const char* text) {
+    m_logger->Error("Error while writing to stdin child process: %s", text);
+    KillOnError(source);
 }
 
-void Proxy::OnProcessExit(int pid, bool normally) {
-    if (m_state == State::Running) {
+void Proxy::OnProcessExit(Source& source, int pid, bool normally) {
+    if (source.requestQueue) {
+        // Apply the requests which were read before the exit
+        OnRequestsReady(source);
+    }
+    source.isRunning = false;
+    bool isRunning = std::any_of(m_sources.cbegin(), m_sources.cend(), [](const auto& it) { return it->isRunning; });
+
+    if ((m_state == State::Running) || (m_state == State::Starting)) {
         if (normally) {
             m_logger->Debug("Child process %" G_PID_FORMAT " exited unexpectedly, normally", pid);
         } else {
             m_logger->Error("Child process %" G_PID_FORMAT " exited unexpectedly, abnormally", pid);
         }
+        // The other sources keep working without the lines of the finished one
+        if (isRunning) {
+            if (m_state == State::Running) {
+                m_rofi->StartUpdate();
+                ReplaceLines(source, LineStore());
+                m_rofi->ApplyUpdate();
+            } else {
+                ReplaceLines(source, LineStore());
+            }
+            return;
+        }
         Clear();
         if (normally) {
             exit(0);
@@ -279,24 +741,392 @@ void Proxy::OnProcessExit(int pid, bool normally) {
 
     if (m_state == State::DestroyProcess) {
         m_logger->Debug("Child process %" G_PID_FORMAT " exited %s", pid, normally ? "normally" : "abnormally");
-        m_state = State::ChildFinished;
+        if (!isRunning) {
+            m_state = State::ChildFinished;
+        }
+    }
+}
+
+void Proxy::OnSendInput(const std::string& text) {
+    uint32_t prevInputSeq = m_inputSeq++;
+    for (auto& source: m_sources) {
+        if (!source->isRunning) {
+            continue;
+        }
+        if (m_sendCancel && (source->repliedInputSeq < prevInputSeq)) {
+            // A cancel of an input which is replaced in the queue is not sent
+            auto cancelPolicy = (m_inputWritePolicy == WritePolicy::ReplacePending) ? WritePolicy::DropWithReplaced : WritePolicy::Keep;
+            SendMessage(*source, "cancel", source->protocol->CreateMessageCancel(prevInputSeq), cancelPolicy);
+        }
+        SendMessage(*source, "input", source->protocol->CreateMessageInput(text.c_str(), m_inputSeq), m_inputWritePolicy);
     }
 }
 
-void Proxy::SendMessage(const char* messageName, const std::string& messageText) {
+void Proxy::SendMessage(Source& source, const char* messageName, std::string_view messageText, WritePolicy policy) {
+    if (!source.isRunning) {
+        // The backend has finished while the others are still working
+        return;
+    }
+
     try {
-        m_process->Write(messageText.c_str());
-        m_logger->Debug("Send message with name \"%s\" to child process: %s", messageName, messageText.c_str());
+        source.process->Write(messageText, policy);
+        if (source.protocol->GetFormat() == MessageFormat::MsgPack) {
+            m_logger->Debug("Send binary message with name \"%s\" to source %zu, size = %zu", messageName, source.index, messageText.size());
+        } else {
+            m_logger->Debug("Send message with name \"%s\" to source %zu, size = %zu: %.*s", messageName, source.index,
+                messageText.size(), static_cast<int>(std::min(messageText.size(), Logger::RECORD_TEXT_SIZE)), messageText.data());
+        }
     } catch(const std::exception& e) {
         m_logger->Error("Error while send message to child process: %s", e.what());
+        KillOnError(source);
+    }
+}
+
+void Proxy::KillOnError(Source& source) {
+    if ((m_state != State::Running) && (m_state != State::Starting)) {
+        return;
+    }
+
+    // A failed source is stopped alone while the others are running, its lines are dropped on exit
+    bool isOtherRunning = std::any_of(m_sources.cbegin(), m_sources.cend(), [&source](const auto& it) {
+        return (it.get() != &source) && it->isRunning;
+    });
+    if (!isOtherRunning) {
         m_state = State::ErrorProcess;
-        m_process->Kill();
+    }
+    source.process->Kill();
+}
+
+size_t Proxy::GetPositionsCount() const {
+    if (m_virtualLines) {
+        return m_virtualLines->Size();
+    }
+
+    return m_fuzzyRanker.IsActive() ? m_fuzzyRanker.GetRankedCount() : m_lines.Size();
+}
+
+size_t Proxy::GetLineIndex(size_t position) const {
+    return m_fuzzyRanker.IsActive() ? m_fuzzyRanker.GetLine(position) : position;
+}
+
+LineStore* Proxy::FindLineStore(size_t& index) {
+    if (!m_virtualLines) {
+        return (index < m_lines.Size()) ? &m_lines : nullptr;
+    }
+
+    size_t position = 0;
+    if (LineStore* page = m_virtualLines->Find(index, position); page != nullptr) {
+        index = position;
+        return page;
+    }
+    FetchLines(index);
+    return nullptr;
+}
+
+Line Proxy::GetLineData(size_t index) {
+    LineStore* lines = FindLineStore(index);
+    return (lines != nullptr) ? lines->Get(index) : Line();
+}
+
+Source* Proxy::FindSource(size_t index) const {
+    if (m_virtualLines) {
+        return (index < m_virtualLines->Size()) ? m_sources.front().get() : nullptr;
+    }
+
+    for (const auto& source: m_sources) {
+        if (index < source->linesCount) {
+            return source.get();
+        }
+        index -= source->linesCount;
+    }
+
+    return nullptr;
+}
+
+size_t Proxy::GetLinesBegin(const Source& source) const {
+    size_t result = 0;
+    for (size_t i=0; i!=source.index; ++i) {
+        result += m_sources[i]->linesCount;
+    }
+
+    return result;
+}
+
+void Proxy::ReplaceLines(Source& source, LineStore&& lines) {
+    size_t begin = GetLinesBegin(source);
+    size_t count = lines.Size();
+    m_lines.Replace(begin, source.linesCount, std::move(lines));
+    m_filterCache.Reset();
+    m_fuzzyRanker.Clear();
+    if (m_trigramIndex) {
+        // Lines of other sources are not copied again
+        m_trigramIndex->Replace(begin, source.linesCount, m_lines, begin, count);
+        m_trigramIndex->Commit();
+    }
+    source.linesCount = count;
+    source.hasLineIds = false;
+    source.hasDuplicateIds = false;
+    source.lineIds.clear();
+    source.lineShifts.clear();
+}
+
+void Proxy::RebuildIndex() {
+    if (m_trigramIndex) {
+        m_trigramIndex->Rebuild(m_lines);
+    }
+}
+
+void Proxy::SetVirtualCount(Source& source, size_t count) {
+    // Positions of the virtual list are not shifted by segments of other sources
+    if (m_sources.size() != 1) {
+        throw ProxyError("field \"virtual_count\" requires a single application");
+    }
+
+    if (m_lines.Size() != 0) {
+        ReplaceLines(source, LineStore());
+    }
+    // The list is new even if its size is the same, the received windows are outdated
+    m_virtualLines = std::make_unique<VirtualLines>(count, m_virtualMaxLines);
+    ++m_virtualGeneration;
+    m_logger->Debug("Set virtual list with %zu lines, generation = %u", count, m_virtualGeneration);
+}
+
+void Proxy::ApplyLinesWindow(const UserRequest& request) {
+    // The answer to a request of a previous list
+    if ((!m_virtualLines) || (request.linesWindowGeneration != m_virtualGeneration)) {
+        m_logger->Debug("Drop lines window of generation %u, the generation of the virtual list is %u",
+            request.linesWindowGeneration, m_virtualLines ? m_virtualGeneration : 0);
+        return;
+    }
+
+    m_virtualLines->SetLines(request.linesWindowOffset, request.linesWindow);
+    m_logger->Debug("Get %zu lines of the virtual list from %u, %zu lines are kept, size = %zu KB",
+        request.linesWindow.Size(), request.linesWindowOffset, m_virtualLines->GetKeptLinesCount(), m_virtualLines->MemorySize() / 1024);
+}
+
+void Proxy::FetchLines(size_t index) {
+    size_t offset = 0;
+    size_t count = 0;
+    if (!m_virtualLines->GetMissingWindow(index, g_get_monotonic_time(), offset, count)) {
+        return;
+    }
+
+    Source& source = *m_sources.front();
+    m_logger->Debug("Fetch lines [%zu, %zu) of the virtual list", offset, offset + count);
+    SendMessage(source, "fetch_lines", source.protocol->CreateMessageFetchLines(m_virtualGeneration, offset, count));
+}
+
+void Proxy::DropSnapshotLines() {
+    m_showsSnapshot = false;
+    ReplaceLines(*m_sources.front(), LineStore());
+}
+
+void Proxy::ApplySharedLines(Source& source, UserRequest& request) {
+    const auto& ref = request.linesShm;
+    if (!source.sharedMemory) {
+        throw ProxyError("section \"lines_shm\" requires arg '-proxy-shm'");
+    }
+    if (ref.generation <= source.sharedGeneration) {
+        m_logger->Debug("Skip shared lines of generation %u, the last generation is %u", ref.generation, source.sharedGeneration);
+        SendMessage(source, "lines_shm_release", source.protocol->CreateMessageLinesShmRelease(ref.generation));
+        return;
+    }
+
+    LineStore lines;
+    if (request.isLinesShmParsed) {
+        lines = std::move(request.linesShmLines);
+    } else {
+        auto data = source.sharedMemory->Map(ref.offset, ref.length);
+        source.protocol->ParseSharedLines(data.data(), data.size(), lines);
+        m_matchKeys.Build(lines);
+    }
+    source.sharedGeneration = ref.generation;
+    // Strings are copied to the line store, the backend can reuse the region
+    SendMessage(source, "lines_shm_release", source.protocol->CreateMessageLinesShmRelease(ref.generation));
+    m_logger->Debug("Get %zu lines from shared memory, generation = %u, size = %u", lines.Size(), ref.generation, ref.length);
+
+    ReplaceLines(source, std::move(lines));
+}
+
+void Proxy::ApplyLinesPatch(Source& source, const std::vector<LinePatch>& patch, const LineStore& patchLines) {
+    // Indexes of the patch are positions in the segment of the source
+    size_t begin = GetLinesBegin(source);
+    m_filterCache.Reset();
+    m_fuzzyRanker.Clear();
+    // The items change only positions, the line store is rebuilt once for the whole patch.
+    // Only the patched lines are sent to the index, the applied items are committed even if the patch fails.
+    LineStorePatch lines(m_lines, begin, source.linesCount, patchLines);
+    auto apply = [this, &source, &lines]() {
+        m_lines.ApplyPatch(lines);
+        source.linesCount = lines.Size();
+        if (m_trigramIndex) {
+            m_trigramIndex->Commit();
+        }
+    };
+    try {
+        for (const auto& item: patch) {
+            ApplyLinePatch(source, lines, item, patchLines);
+        }
+    } catch(...) {
+        apply();
+        throw;
+    }
+    apply();
+}
+
+void Proxy::ApplyLinePatch(Source& source, LineStorePatch& lines, const LinePatch& item, const LineStore& patchLines) {
+    size_t begin = GetLinesBegin(source);
+    size_t index;
+    switch (item.type) {
+    case LinePatchType::Insert:
+        index = item.hasIndex ? item.index : lines.Size();
+        if (index > lines.Size()) {
+            throw ProxyError("index %zu of inserted line is out of range", index);
+        }
+        lines.Insert(index, item.line);
+        if (m_trigramIndex) {
+            m_trigramIndex->Replace(begin + index, 0, patchLines, item.line, 1);
+        }
+        ShiftLines(source, NO_POSITION, index);
+        SetLinePosition(source, patchLines.GetId(item.line), index, true);
+        break;
+    case LinePatchType::Remove:
+        index = FindLine(source, lines, item.id);
+        source.lineIds.erase(item.id);
+        lines.Remove(index);
+        if (m_trigramIndex) {
+            m_trigramIndex->Replace(begin + index, 1, patchLines, 0, 0);
+        }
+        ShiftLines(source, index, NO_POSITION);
+        break;
+    case LinePatchType::Update: {
+        index = FindLine(source, lines, item.id);
+        auto id = patchLines.GetId(item.line);
+        bool keepId = id.empty() || (id == item.id);
+        if (!keepId) {
+            source.lineIds.erase(item.id);
+        }
+        lines.Update(index, item.line, keepId);
+        if (m_trigramIndex) {
+            m_trigramIndex->Replace(begin + index, 1, patchLines, item.line, 1);
+        }
+        SetLinePosition(source, lines.GetId(index), index, !keepId);
+        break;
+    }
+    case LinePatchType::Move: {
+        index = FindLine(source, lines, item.id);
+        size_t newIndex = item.index;
+        if (newIndex >= lines.Size()) {
+            throw ProxyError("index %zu of moved line is out of range", newIndex);
+        }
+        lines.Move(index, newIndex);
+        if (m_trigramIndex) {
+            m_trigramIndex->Move(begin + index, begin + newIndex);
+        }
+        ShiftLines(source, index, newIndex);
+        break;
+    }
+    }
+}
+
+size_t Proxy::FindLine(Source& source, const LineStorePatch& lines, const std::string& id) {
+    auto find = [&source, &lines, &id]() -> size_t {
+        auto it = source.lineIds.find(id);
+        if (it == source.lineIds.end()) {
+            return NO_POSITION;
+        }
+
+        // Move the position through the patch items applied after it was set
+        auto& position = it->second;
+        for (; (position.version != source.lineShifts.size()) && (position.index != NO_POSITION); ++position.version) {
+            const auto& shift = source.lineShifts[position.version];
+            if (position.index == shift.from) {
+                position.index = shift.to;
+                continue;
+            }
+            if (position.index > shift.from) {
+                --position.index;
+            }
+            if (position.index >= shift.to) {
+                ++position.index;
+            }
+        }
+
+        // A line with a duplicate id can take the position
+        bool isValid = (position.index < lines.Size()) && (lines.GetId(position.index) == id);
+        return isValid ? position.index : NO_POSITION;
+    };
+
+    // The segment is scanned for the first patch of the lines and after MAX_LINE_SHIFTS items,
+    // O(lines / MAX_LINE_SHIFTS) per item
+    if ((!source.hasLineIds) || (source.lineShifts.size() > MAX_LINE_SHIFTS)) {
+        RebuildLineIds(source, lines);
+    }
+    if (size_t index = find(); index != NO_POSITION) {
+        return index;
+    }
+
+    // Without duplicate ids all ids are known, the segment is scanned only for a line which shares its id
+    if (source.hasDuplicateIds) {
+        RebuildLineIds(source, lines);
+        if (size_t index = find(); index != NO_POSITION) {
+            return index;
+        }
+    }
+
+    throw ProxyError("line with id \"%s\" not found", id.c_str());
+}
+
+void Proxy::RebuildLineIds(Source& source, const LineStorePatch& lines) {
+    // Positions are updated in place, the kept ids are not allocated again
+    for (auto& item: source.lineIds) {
+        item.second.index = NO_POSITION;
+    }
+    source.lineShifts.clear();
+    source.hasDuplicateIds = false;
+
+    std::string key;
+    lines.ForEachId([&source, &key](size_t index, std::string_view id) {
+        if (id.empty()) {
+            return;
+        }
+        key.assign(id);
+        auto [it, isInserted] = source.lineIds.try_emplace(key, LinePosition{index, 0});
+        if (!isInserted) {
+            // The last line with the id takes the position
+            source.hasDuplicateIds = source.hasDuplicateIds || (it->second.index != NO_POSITION);
+            it->second = LinePosition{index, 0};
+        }
+    });
+
+    // Ids of lines which were removed
+    for (auto it = source.lineIds.begin(); it != source.lineIds.end();) {
+        it = (it->second.index == NO_POSITION) ? source.lineIds.erase(it) : std::next(it);
+    }
+    source.hasLineIds = true;
+}
+
+void Proxy::ShiftLines(Source& source, size_t from, size_t to) {
+    if (source.hasLineIds) {
+        source.lineShifts.push_back(LineShift{from, to});
+    }
+}
+
+void Proxy::SetLinePosition(Source& source, std::string_view id, size_t index, bool isNewId) {
+    if (source.hasLineIds && (!id.empty())) {
+        auto [it, isInserted] = source.lineIds.try_emplace(std::string(id), LinePosition{index, source.lineShifts.size()});
+        if (!isInserted) {
+            // The id of another line, it is known until one of them is removed
+            source.hasDuplicateIds = source.hasDuplicateIds || isNewId;
+            it->second = LinePosition{index, source.lineShifts.size()};
+        }
     }
 }
 
 void Proxy::Clear() {
-    m_protocol.reset();
-    m_process.reset();
+    m_snapshot.reset();
+    m_inputScheduler.reset();
+    m_sources.clear();
     m_rofi.reset();
     m_logger.reset();
 }
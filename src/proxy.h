@@ -1,17 +1,81 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "process.h"
 #include "protocol.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "match_key.h"
+#include "fuzzy_rank.h"
+#include "filter_cache.h"
+#include "virtual_lines.h"
+#include "trigram_index.h"
+#include "request_queue.h"
+#include "shared_memory.h"
 
 
+// Change of line positions by a patch item: the line at "from" is taken out and a line is put at "to",
+// SIZE_MAX if there is no such step (an insert or a remove)
+struct LineShift {
+    size_t from;
+    size_t to;
+};
+
+// Position of the line after the first "version" shifts of Source::lineShifts
+struct LinePosition {
+    size_t index;
+    size_t version;
+};
+
+class Proxy;
+// One backend ("-proxy-cmd"), its lines are a segment of the merged list of the proxy
+struct Source : public ProcessHandler, public RequestQueueHandler {
+    Source(Proxy* owner, size_t index, const std::shared_ptr<Logger>& logger);
+    ~Source();
+
+    // Requests are parsed by the reader thread with its own protocol
+    Protocol& GetParser() { return parser ? *parser : *protocol; }
+
+    void OnReadPartialLine(char* text, size_t size) override;
+    void OnReadLine(char* text, size_t size) override;
+    void OnReadLineError(const char* text) override;
+    void OnWriteError(const char* text) override;
+    void OnProcessExit(int pid, bool normally) override;
+    void OnRequestsReady() override;
+
+    Proxy* owner;
+    size_t index;
+    std::string command;
+    bool isRunning = false;
+    // Number of lines in the segment, segments follow in the order of sources
+    size_t linesCount = 0;
+    // The last input answered with "in_reply_to"
+    uint32_t repliedInputSeq = 0;
+    // Generation of the last "lines_shm" region, older regions are ignored
+    uint32_t sharedGeneration = 0;
+    // Line position in the segment by its id, built lazily by FindLine and kept by the patch items,
+    // FindLine moves a position through the shifts made after it
+    bool hasLineIds = false;
+    // Some ids are shared by several lines, a missing id is searched in the segment
+    bool hasDuplicateIds = false;
+    std::unordered_map<std::string, LinePosition> lineIds;
+    std::vector<LineShift> lineShifts;
+    std::unique_ptr<Process> process;
+    std::unique_ptr<Protocol> protocol;
+    std::unique_ptr<SharedMemory> sharedMemory;
+    // Only with the reader thread
+    std::unique_ptr<Protocol> parser;
+    std::unique_ptr<RequestQueue> requestQueue;
+};
+
 class Rofi;
-struct rofi_int_matcher_t;
 typedef struct rofi_mode Mode;
 typedef struct _cairo_surface cairo_surface_t;
-class Proxy : public ProcessHandler {
+class Proxy : public InputSchedulerHandler, public FilterCacheHandler {
     enum class State {
         Starting,
         Running,
@@ -19,6 +83,8 @@ class Proxy : public ProcessHandler {
         DestroyProcess,
         ChildFinished,
     };
+    // Lines of the virtual list kept in memory by default
+    static constexpr size_t DEFAULT_VIRTUAL_MAX_LINES = 4096;
 public:
     Proxy();
     ~Proxy();
@@ -39,25 +105,102 @@ public:
     void OnSelectCustomInput(const char* text);
     void OnCustomKey(size_t index, int key);
     const char* OnInput(Mode* sw, const char* text);
-    bool OnLineMatch(rofi_int_matcher_t** tokens, size_t index) const;
+    // Called from the filter threads of rofi at the same time. The main loop waits for them,
+    // so lines are not changed during the call; it must not log or change other state.
+    bool OnLineMatch(rofi_int_matcher_t** tokens, size_t index);
+    // Called from the match threads with the same contract as OnLineMatch
+    bool OnMatchLine(rofi_int_matcher_t** tokens, size_t index) override;
 
 public:
-    void OnReadLine(const char* text) override;
-    void OnReadLineError(const char* text) override;
-    void OnProcessExit(int pid, bool normally) override;
+    void OnReadPartialLine(Source& source, char* text, size_t size);
+    void OnReadLine(Source& source, char* text, size_t size);
+    void OnReadLineError(Source& source, const char* text);
+    void OnWriteError(Source& source, const char* text);
+    void OnProcessExit(Source& source, int pid, bool normally);
+    void OnRequestsReady(Source& source);
+    void OnSendInput(const std::string& text) override;
 
 private:
-    void SendMessage(const char* messageName, const std::string& messageText);
+    void CreateSources();
+    void StartBackends();
+    void LoadSnapshot();
+    // Called in the reader thread if it is enabled
+    UserRequest ParseRequest(Source& source, char* text, size_t size);
+    void OnRequest(Source& source, UserRequest&& request);
+    void ApplyRequest(Source& source, UserRequest& request);
+    void SendMessage(Source& source, const char* messageName, std::string_view messageText, WritePolicy policy = WritePolicy::Keep);
+    void KillOnError(Source& source);
+    // Number of positions of rofi, only the ranked lines while the fuzzy ranking is active
+    size_t GetPositionsCount() const;
+    // Index of the line shown at the position of rofi
+    size_t GetLineIndex(size_t position) const;
+    // Store with the line and the index of the line in it, nullptr if the line is out of range
+    // or is not received yet (then its window of the virtual list is requested)
+    LineStore* FindLineStore(size_t& index);
+    // Copy of the line for messages, an empty line if it is not available
+    Line GetLineData(size_t index);
+    void SetVirtualCount(Source& source, size_t count);
+    void ApplyLinesWindow(const UserRequest& request);
+    void FetchLines(size_t index);
+    void RankLines(const char* input);
+    void StartFilterPass(const char* text, const char* input);
+    // Owner of the line, nullptr if the index is out of range
+    Source* FindSource(size_t index) const;
+    size_t GetLinesBegin(const Source& source) const;
+    void ReplaceLines(Source& source, LineStore&& lines);
+    void RebuildIndex();
+    // Copy lines [begin, begin + linesCount) of the store to the index in place of "count" lines, see TrigramIndex::Replace
+    void DropSnapshotLines();
+    void ApplySharedLines(Source& source, UserRequest& request);
+    void ApplyLinesPatch(Source& source, const std::vector<LinePatch>& patch, const LineStore& patchLines);
+    void ApplyLinePatch(Source& source, LineStorePatch& lines, const LinePatch& item, const LineStore& patchLines);
+    size_t FindLine(Source& source, const LineStorePatch& lines, const std::string& id);
+    void RebuildLineIds(Source& source, const LineStorePatch& lines);
+    void ShiftLines(Source& source, size_t from, size_t to);
+    // isNewId - the line did not have the id before, another line with it is a duplicate
+    void SetLinePosition(Source& source, std::string_view id, size_t index, bool isNewId);
     void Clear();
 
 private:
     std::string m_help;
+    // Copies of the state of rofi for the snapshot
+    std::string m_prompt;
+    std::string m_overlay;
+    // Lines are from the snapshot, they are counted in the segment of the first source
+    bool m_showsSnapshot = false;
     bool m_exitByCancel = true;
-    std::vector<Line> m_lines;
+    bool m_sendCancel = false;
+    WritePolicy m_inputWritePolicy = WritePolicy::Keep;
+    // Sequence number of the last input, it is the same for all sources.
+    // The reader threads read it to drop stale requests before parsing them.
+    std::atomic<uint32_t> m_inputSeq = 0;
+    // Segments of all sources
+    LineStore m_lines;
+    FilterCache m_filterCache;
+    // Only with "fuzzy_top" in a request, rofi shows the ranked lines
+    FuzzyRanker m_fuzzyRanker;
+    // Only after "virtual_count" in a request, m_lines are empty then
+    std::unique_ptr<VirtualLines> m_virtualLines;
+    size_t m_virtualMaxLines = DEFAULT_VIRTUAL_MAX_LINES;
+    // Increased with every "virtual_count", windows of other generations are dropped
+    uint32_t m_virtualGeneration = 0;
+    // Only with "-proxy-match-index"
+    std::unique_ptr<TrigramIndex> m_trigramIndex;
+    // Read by the reader threads, it is set up before they are started
+    MatchKeyBuilder m_matchKeys;
 
+    int64_t m_loadTime = 0;
+    bool m_hasFirstLines = false;
+    struct PendingRequest {
+        Source* source;
+        UserRequest request;
+    };
+    // Requests received before rofi view was created, applied in OnPostInit
+    std::vector<PendingRequest> m_pendingRequests;
     State m_state = State::Starting;
     std::shared_ptr<Logger> m_logger;
     std::unique_ptr<Rofi> m_rofi;
-    std::unique_ptr<Process> m_process;
-    std::unique_ptr<Protocol> m_protocol;
+    std::vector<std::unique_ptr<Source>> m_sources;
+    std::unique_ptr<InputScheduler> m_inputScheduler;
+    std::unique_ptr<Snapshot> m_snapshot;
 };
@@ -0,0 +1,87 @@
+#include "request_queue.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "exception.h"
+
+
+static constexpr size_t QUEUE_CAPACITY = 256;
+static constexpr gulong QUEUE_FULL_WAIT_US = 1000;
+
+namespace {
+
+static int onWakeup(GIOChannel* /* source */, GIOCondition /* condition */, gpointer context) {
+    reinterpret_cast<RequestQueue*>(context)->OnWakeup();
+    return G_SOURCE_CONTINUE;
+}
+
+}
+
+RequestQueue::RequestQueue(RequestQueueHandler* handler)
+    : m_queue(QUEUE_CAPACITY)
+    , m_handler(handler) {
+
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeFd < 0) {
+        throw ProxyError("unable to create eventfd: %s", strerror(errno));
+    }
+    m_wakeCh = g_io_channel_unix_new(m_wakeFd);
+    m_wakeChWatcher = g_io_add_watch(m_wakeCh, G_IO_IN, onWakeup, this);
+}
+
+RequestQueue::~RequestQueue() {
+    if (m_wakeChWatcher != 0) {
+        g_source_remove(m_wakeChWatcher);
+        m_wakeChWatcher = 0;
+    }
+
+    if (m_wakeCh != nullptr) {
+        g_io_channel_unref(m_wakeCh);
+        m_wakeCh = nullptr;
+    }
+
+    if (m_wakeFd >= 0) {
+        close(m_wakeFd);
+        m_wakeFd = -1;
+    }
+
+    m_handler = nullptr;
+}
+
+void RequestQueue::Push(std::unique_ptr<ReadEvent>&& event) {
+    // The reader stops reading the pipe while the main loop is behind, so the backend gets the backpressure
+    while (!m_queue.Push(std::move(event))) {
+        if (m_isClosed) {
+            return;
+        }
+        g_usleep(QUEUE_FULL_WAIT_US);
+    }
+
+    uint64_t value = 1;
+    while ((write(m_wakeFd, &value, sizeof(value)) < 0) && (errno == EINTR)) {
+    }
+}
+
+std::unique_ptr<ReadEvent> RequestQueue::Pop() {
+    std::unique_ptr<ReadEvent> result;
+    m_queue.Pop(result);
+
+    return result;
+}
+
+void RequestQueue::OnWakeup() {
+    // Reset the counter before taking events, a push after it wakes up the loop again
+    uint64_t value;
+    while ((read(m_wakeFd, &value, sizeof(value)) < 0) && (errno == EINTR)) {
+    }
+
+    m_handler->OnRequestsReady();
+}
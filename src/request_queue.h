@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+
+#include "protocol.h"
+#include "spsc_queue.h"
+
+
+class RequestQueueHandler {
+public:
+    RequestQueueHandler() = default;
+    virtual ~RequestQueueHandler() = default;
+
+public:
+    // Called in the main loop when the queue is not empty
+    virtual void OnRequestsReady() = 0;
+};
+
+// Request parsed by the reader thread
+struct ReadEvent {
+    UserRequest request;
+    // Reading or parsing failed, the error is already logged, the request is empty
+    bool failed = false;
+};
+
+struct _GIOChannel;
+typedef struct _GIOChannel GIOChannel;
+
+// Hands off parsed requests from the reader thread (see Process::SetReadThread) to the main loop:
+// the reader pushes fully built requests, an eventfd wakes up the main loop which only takes the pointers
+class RequestQueue {
+public:
+    RequestQueue() = delete;
+    explicit RequestQueue(RequestQueueHandler* handler);
+    ~RequestQueue();
+
+    // Called by the reader thread, waits while the queue is full.
+    // The event is dropped if the queue is closed.
+    void Push(std::unique_ptr<ReadEvent>&& event);
+    // Called in the main loop
+    std::unique_ptr<ReadEvent> Pop();
+    // Release the reader thread waiting in Push, the queue is closed before the reader thread is stopped
+    void Close() { m_isClosed = true; }
+    // Called from the GLib watch
+    void OnWakeup();
+
+private:
+    SpscQueue<std::unique_ptr<ReadEvent>> m_queue;
+    std::atomic<bool> m_isClosed = false;
+    int m_wakeFd = -1;
+    unsigned int m_wakeChWatcher = 0;
+    GIOChannel* m_wakeCh = nullptr;
+    RequestQueueHandler* m_handler = nullptr;
+};
@@ -98,9 +98,9 @@ const char* Rofi::CallOriginPreprocessInput(Mode* sw, const char* text) {
     return text;
 }
 
-cairo_surface_t* Rofi::GetIcon(uint32_t& uid, const std::string& name, int size) {
+cairo_surface_t* Rofi::GetIcon(uint32_t& uid, const char* name, int size) {
     if (uid == 0) {
-        uid = rofi_icon_fetcher_query(name.c_str(), size);
+        uid = rofi_icon_fetcher_query(name, size);
     }
     return rofi_icon_fetcher_get(uid);
 }
@@ -125,6 +125,10 @@ void Rofi::ApplyUpdate() {
     }
 }
 
+void Rofi::Reload() {
+    rofi_view_reload();
+}
+
 void Rofi::UpdatePrompt(const std::string& text) {
     if (m_proxyMode->display_name != text) {
         m_reloadMode = true;
@@ -24,10 +24,12 @@ public:
     const char* GetActualUserInput() noexcept;
     const char* CallOriginPreprocessInput(Mode* sw, const char* text);
 
-    cairo_surface_t* GetIcon(uint32_t& uid, const std::string& name, int size);
+    cairo_surface_t* GetIcon(uint32_t& uid, const char* name, int size);
 
     void StartUpdate();
     void ApplyUpdate();
+    // Rofi reads the number of lines again and filters them
+    void Reload();
 
     void UpdatePrompt(const std::string& text);
     void UpdateOverlay(const std::string& text);
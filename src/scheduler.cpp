@@ -0,0 +1,138 @@
+#include "scheduler.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+
+#include "logger.h"
+
+
+// A backend that did not reply during this time is considered as not replying to this input
+static constexpr guint IN_FLIGHT_TIMEOUT_MS = 1000;
+// Max delay of the adaptive mode, a longer one is noticeable for the user
+static constexpr int64_t MAX_ADAPTIVE_DELAY_US = 100 * 1000;
+
+namespace {
+
+static int onDelayTimer(gpointer context) {
+    reinterpret_cast<InputScheduler*>(context)->OnDelayTimer();
+    return G_SOURCE_REMOVE;
+}
+
+static int onInFlightTimer(gpointer context) {
+    reinterpret_cast<InputScheduler*>(context)->OnInFlightTimer();
+    return G_SOURCE_REMOVE;
+}
+
+}
+
+InputScheduler::InputScheduler(InputSchedulerHandler* handler, const std::shared_ptr<Logger>& logger)
+    : m_handler(handler)
+    , m_logger(logger) {
+
+}
+
+InputScheduler::~InputScheduler() {
+    StopTimer(m_delayTimer);
+    StopTimer(m_inFlightTimer);
+}
+
+void InputScheduler::SetMode(InputSchedulerMode mode, uint32_t delayMs) {
+    m_mode = mode;
+    m_delayMs = delayMs;
+}
+
+void InputScheduler::OnInput(const char* text) {
+    if (m_mode == InputSchedulerMode::Immediate) {
+        m_handler->OnSendInput(text);
+        return;
+    }
+
+    m_pending = text;
+    m_hasPending = true;
+    if (m_inFlight) {
+        return;
+    }
+
+    uint32_t delayMs = GetDelayMs();
+    StopTimer(m_delayTimer);
+    if (delayMs == 0) {
+        Flush();
+    } else {
+        m_delayTimer = g_timeout_add(delayMs, onDelayTimer, this);
+    }
+}
+
+void InputScheduler::SendPending() {
+    if (m_hasPending) {
+        StopTimer(m_delayTimer);
+        StopTimer(m_inFlightTimer);
+        m_inFlight = false;
+        Flush();
+    }
+}
+
+void InputScheduler::OnBackendReply() {
+    if (!m_inFlight) {
+        return;
+    }
+
+    m_inFlight = false;
+    StopTimer(m_inFlightTimer);
+    int64_t responseTime = g_get_monotonic_time() - m_sendTime;
+    m_responseTime = (m_responseTime == 0) ? responseTime : (m_responseTime * 3 + responseTime) / 4;
+    m_logger->Debug("Backend replied to input in %" G_GINT64_FORMAT " us", responseTime);
+
+    if (m_delayTimer == 0) {
+        Flush();
+    }
+}
+
+void InputScheduler::OnDelayTimer() {
+    m_delayTimer = 0;
+    if (!m_inFlight) {
+        Flush();
+    }
+}
+
+void InputScheduler::OnInFlightTimer() {
+    m_inFlightTimer = 0;
+    m_inFlight = false;
+    m_logger->Debug("Backend did not reply to input in %u ms", IN_FLIGHT_TIMEOUT_MS);
+
+    if (m_delayTimer == 0) {
+        Flush();
+    }
+}
+
+uint32_t InputScheduler::GetDelayMs() const {
+    if (m_mode == InputSchedulerMode::Adaptive) {
+        // A fast backend gets every input at once, a slow one gets a delay
+        // which lets the user finish typing instead of searching stale prefixes
+        return static_cast<uint32_t>(std::min(m_responseTime / 2, MAX_ADAPTIVE_DELAY_US) / 1000);
+    }
+
+    return m_delayMs;
+}
+
+void InputScheduler::Flush() {
+    if (!m_hasPending) {
+        return;
+    }
+
+    m_hasPending = false;
+    m_inFlight = true;
+    m_sendTime = g_get_monotonic_time();
+    m_inFlightTimer = g_timeout_add(IN_FLIGHT_TIMEOUT_MS, onInFlightTimer, this);
+    m_handler->OnSendInput(m_pending);
+}
+
+void InputScheduler::StopTimer(unsigned int& timer) {
+    if (timer != 0) {
+        g_source_remove(timer);
+        timer = 0;
+    }
+}
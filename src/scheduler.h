@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+
+class InputSchedulerHandler {
+public:
+    InputSchedulerHandler() = default;
+    virtual ~InputSchedulerHandler() = default;
+
+public:
+    virtual void OnSendInput(const std::string& text) = 0;
+};
+
+enum class InputSchedulerMode : uint8_t {
+    Immediate, // Every input is sent at once, the backend is not waited
+    Debounce,  // Input is sent after a fixed delay without changes
+    Adaptive,  // Delay depends on the measured backend response time
+};
+
+class Logger;
+// Coalesces user input: at most one input is in flight, while the backend is busy
+// only the newest text is kept and it is sent as soon as the backend replies
+class InputScheduler {
+public:
+    InputScheduler() = delete;
+    InputScheduler(InputSchedulerHandler* handler, const std::shared_ptr<Logger>& logger);
+    ~InputScheduler();
+
+    // delayMs is used only for InputSchedulerMode::Debounce
+    void SetMode(InputSchedulerMode mode, uint32_t delayMs);
+
+    void OnInput(const char* text);
+    // Send the delayed input without waiting for the backend,
+    // other messages must not overtake the input they refer to
+    void SendPending();
+    // A request with the seq of the in-flight input in "in_reply_to" or a request without it,
+    // the caller filters out replies to other inputs
+    void OnBackendReply();
+
+    // Called from GLib timers
+    void OnDelayTimer();
+    void OnInFlightTimer();
+
+private:
+    uint32_t GetDelayMs() const;
+    void Flush();
+    void StopTimer(unsigned int& timer);
+
+private:
+    InputSchedulerMode m_mode = InputSchedulerMode::Immediate;
+    uint32_t m_delayMs = 0;
+    // Smoothed backend response time in microseconds, used by InputSchedulerMode::Adaptive
+    int64_t m_responseTime = 0;
+
+    std::string m_pending;
+    bool m_hasPending = false;
+    bool m_inFlight = false;
+    int64_t m_sendTime = 0;
+    unsigned int m_delayTimer = 0;
+    unsigned int m_inFlightTimer = 0;
+
+    InputSchedulerHandler* m_handler = nullptr;
+    std::shared_ptr<Logger> m_logger;
+};
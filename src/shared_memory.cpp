@@ -0,0 +1,76 @@
+#include "shared_memory.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "exception.h"
+
+
+SharedMemory::~SharedMemory() {
+    Unmap();
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void SharedMemory::Create(const char* name) {
+#ifdef MFD_ALLOW_SEALING
+    m_fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (m_fd < 0) {
+        throw ProxyError("unable to create shared memory: %s", strerror(errno));
+    }
+    // The backend can grow the file, but a shrink would turn reads of the mapping into SIGBUS
+    if (fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        throw ProxyError("unable to seal shared memory: %s", strerror(errno));
+    }
+#else
+    static_cast<void>(name);
+    throw ProxyError("shared memory is not supported by the system");
+#endif
+}
+
+std::string_view SharedMemory::Map(uint64_t offset, uint64_t length) {
+    if (m_fd < 0) {
+        throw ProxyError("shared memory is not created");
+    }
+    if ((offset > SIZE_MAX) || (length > SIZE_MAX - offset)) {
+        throw ProxyError("shared memory region is too big");
+    }
+
+    size_t end = static_cast<size_t>(offset + length);
+    if (end > m_mappedSize) {
+        // The backend has grown the file since the last mapping
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            throw ProxyError("unable to get size of shared memory: %s", strerror(errno));
+        }
+        auto size = static_cast<size_t>(st.st_size);
+        if (end > size) {
+            throw ProxyError("shared memory region [%zu, %zu) is out of the memory size %zu",
+                static_cast<size_t>(offset), end, size);
+        }
+
+        Unmap();
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (data == MAP_FAILED) {
+            throw ProxyError("unable to map shared memory: %s", strerror(errno));
+        }
+        m_data = static_cast<const char*>(data);
+        m_mappedSize = size;
+    }
+
+    return std::string_view(m_data + offset, static_cast<size_t>(length));
+}
+
+void SharedMemory::Unmap() {
+    if (m_data != nullptr) {
+        munmap(const_cast<char*>(m_data), m_mappedSize);
+        m_data = nullptr;
+        m_mappedSize = 0;
+    }
+}
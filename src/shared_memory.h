@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+
+// Memory file shared with the backend, the backend writes big payloads there
+// and the plugin reads them through a read-only mapping instead of the pipe.
+// The file can only grow, so the mapped part never disappears under the reader.
+class SharedMemory {
+public:
+    SharedMemory() = default;
+    ~SharedMemory();
+
+    void Create(const char* name);
+    int GetFd() const { return m_fd; }
+    // Data of the region [offset, offset + length), valid until the next Map call
+    std::string_view Map(uint64_t offset, uint64_t length);
+
+private:
+    void Unmap();
+
+private:
+    int m_fd = -1;
+    const char* m_data = nullptr;
+    size_t m_mappedSize = 0;
+};
@@ -0,0 +1,134 @@
+#include "snapshot.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defer.h"
+#include "logger.h"
+#include "protocol.h"
+#include "exception.h"
+
+
+namespace {
+
+// FNV-1a, the hash must be the same in every build, std::hash is not
+static uint64_t hashKey(const char* key) {
+    uint64_t result = 14695981039346656037ULL;
+    for (const char* it = key; *it != '\0'; ++it) {
+        result = (result ^ static_cast<uint8_t>(*it)) * 1099511628211ULL;
+    }
+
+    return result;
+}
+
+}
+
+Snapshot::Snapshot(const std::shared_ptr<Logger>& logger)
+    : m_logger(logger) {
+
+}
+
+Snapshot::~Snapshot() {
+    m_logger.reset();
+}
+
+void Snapshot::SetKey(const char* key) {
+    std::string cacheDir;
+    if (const char* envValue = std::getenv("XDG_CACHE_HOME"); envValue != nullptr) {
+        cacheDir = envValue;
+    } else if (const char* envValue = std::getenv("HOME"); envValue != nullptr) {
+        cacheDir = envValue + std::string("/.cache");
+    } else {
+        throw ProxyError("not found env varaibles: XDG_CACHE_HOME or HOME");
+    }
+
+    m_path = detail::Format("%s/rofi/proxy-%016llx.snapshot", cacheDir.c_str(), static_cast<unsigned long long>(hashKey(key)));
+}
+
+bool Snapshot::Load(Protocol& protocol, UserRequest& result) {
+    int fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            m_logger->Error("Unable to open snapshot \"%s\": %s", m_path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    void* data = MAP_FAILED;
+    size_t size = 0;
+    Defer _([&](...) mutable {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+        close(fd);
+    });
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        m_logger->Error("Unable to map snapshot \"%s\": %s", m_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    try {
+        result = protocol.ParseSnapshot(static_cast<const char*>(data), size);
+    } catch(const std::exception& e) {
+        m_logger->Error("Unable to parse snapshot \"%s\": %s", m_path.c_str(), e.what());
+        return false;
+    }
+
+    return true;
+}
+
+void Snapshot::Save(std::string_view data) {
+    // The cache directory itself may not exist yet
+    auto dir = m_path.substr(0, m_path.rfind('/'));
+    for (auto dirPath: {dir.substr(0, dir.rfind('/')), dir}) {
+        if ((mkdir(dirPath.c_str(), 0755) != 0) && (errno != EEXIST)) {
+            m_logger->Error("Unable to create directory \"%s\" for snapshot: %s", dirPath.c_str(), strerror(errno));
+            return;
+        }
+    }
+
+    // The new file replaces the old one at once, a concurrent Load sees one of them
+    auto tmpPath = detail::Format("%s.%d", m_path.c_str(), getpid());
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IWUSR | S_IRUSR);
+    if (fd < 0) {
+        m_logger->Error("Unable to create snapshot \"%s\": %s", tmpPath.c_str(), strerror(errno));
+        return;
+    }
+
+    const char* it = data.data();
+    size_t left = data.size();
+    while (left != 0) {
+        ssize_t written = write(fd, it, left);
+        if ((written < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (written <= 0) {
+            m_logger->Error("Unable to write snapshot \"%s\": %s", tmpPath.c_str(), strerror(errno));
+            close(fd);
+            unlink(tmpPath.c_str());
+            return;
+        }
+        it += written;
+        left -= static_cast<size_t>(written);
+    }
+    close(fd);
+
+    if (rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+        m_logger->Error("Unable to replace snapshot \"%s\": %s", m_path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return;
+    }
+    m_logger->Debug("Save snapshot \"%s\", size = %zu", m_path.c_str(), data.size());
+}
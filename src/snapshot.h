@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <string_view>
+
+
+struct UserRequest;
+class Logger;
+class Protocol;
+// State of rofi saved on exit and shown on the next launch until the backend answers.
+// It is a cache: errors are logged and the snapshot is ignored.
+class Snapshot {
+public:
+    Snapshot() = delete;
+    Snapshot(const std::shared_ptr<Logger>& logger);
+    ~Snapshot();
+
+    // The file is $XDG_CACHE_HOME/rofi/proxy-<hash of key>.snapshot, key identifies the backend
+    void SetKey(const char* key);
+    // Returns false if there is no valid snapshot
+    bool Load(Protocol& protocol, UserRequest& result);
+    void Save(std::string_view data);
+
+private:
+    std::string m_path;
+    std::shared_ptr<Logger> m_logger;
+};
@@ -0,0 +1,82 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(size_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    m_workers.reserve(threadCount - 1);
+    for (size_t i=1; i!=threadCount; ++i) {
+        m_workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    for (auto& worker: m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& fn) {
+    chunkSize = std::max(chunkSize, size_t(1));
+    if (m_workers.empty() || (count <= chunkSize)) {
+        fn(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn = &fn;
+        m_count = count;
+        m_chunkSize = chunkSize;
+        m_nextChunk.store(0, std::memory_order_relaxed);
+        m_activeWorkers = m_workers.size();
+        ++m_generation;
+    }
+    m_wakeup.notify_all();
+
+    RunChunks();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_activeWorkers == 0; });
+    m_fn = nullptr;
+}
+
+void ThreadPool::WorkerLoop() {
+    uint64_t generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this, generation]() { return m_stop || (m_generation != generation); });
+            if (m_stop) {
+                return;
+            }
+            generation = m_generation;
+        }
+
+        RunChunks();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_activeWorkers == 0) {
+            m_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::RunChunks() {
+    while (true) {
+        size_t begin = m_nextChunk.fetch_add(m_chunkSize, std::memory_order_relaxed);
+        if (begin >= m_count) {
+            return;
+        }
+        (*m_fn)(begin, std::min(begin + m_chunkSize, m_count));
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+
+// Persistent worker threads for data-parallel loops. The range of a loop is cut into chunks
+// and every thread takes the next free chunk, so threads that finish early take over the rest
+// of the work and a slow part of the range does not hold the others.
+class ThreadPool {
+public:
+    ThreadPool() = delete;
+    // threadCount includes the calling thread, 0 - number of cores
+    explicit ThreadPool(size_t threadCount);
+    ~ThreadPool();
+
+    size_t GetThreadCount() const { return m_workers.size() + 1; }
+    // Call fn(begin, end) for all chunks of [0, count) and wait for them, the calling thread takes part.
+    // Only one loop runs at a time.
+    void ParallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& fn);
+
+private:
+    void WorkerLoop();
+    void RunChunks();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_done;
+    bool m_stop = false;
+    uint64_t m_generation = 0;
+    size_t m_activeWorkers = 0;
+
+    // The running loop
+    const std::function<void(size_t, size_t)>* m_fn = nullptr;
+    size_t m_count = 0;
+    size_t m_chunkSize = 0;
+    std::atomic<size_t> m_nextChunk = 0;
+};
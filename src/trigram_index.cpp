@@ -0,0 +1,526 @@
+#include "trigram_index.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <rofi/helper.h>
+
+#include "exception.h"
+#include "line_store.h"
+#include "chunked_vector.h"
+
+
+namespace {
+
+static constexpr uint32_t BUCKET_BITS = 18;
+static constexpr size_t BUCKETS_COUNT = size_t(1) << BUCKET_BITS;
+// A build checks for a newer job once per this number of lines
+static constexpr size_t CANCEL_CHECK_LINES = 64 * 1024;
+// All postings are rebuilt when the delta has more rows than this part of lines (and this minimum)
+// or the replaced rows are a quarter of all rows
+static constexpr size_t DELTA_LINES_PART = 8;
+static constexpr size_t MIN_DELTA_ROWS = 4096;
+static constexpr size_t REPLACED_ROWS_PART = 4;
+static constexpr uint32_t NO_LINE = UINT32_MAX;
+static constexpr size_t MIN_LITERAL_SIZE = 3;
+
+static uint32_t ToLowerAscii(unsigned char ch) {
+    return ((ch >= 'A') && (ch <= 'Z')) ? static_cast<uint32_t>(ch - 'A' + 'a') : ch;
+}
+
+// Kelvin sign and long s match "k" and "s" without case
+static bool HasCaselessAsciiVariant(std::string_view text) {
+    return (text.find("\xE2\x84\xAA") != std::string_view::npos) || (text.find("\xC5\xBF") != std::string_view::npos);
+}
+
+}
+
+TrigramIndex::TrigramIndex() {
+    m_thread = std::thread(&TrigramIndex::BuildLoop, this);
+}
+
+TrigramIndex::~TrigramIndex() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_generation.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_wakeup.notify_one();
+    m_thread.join();
+}
+
+void TrigramIndex::Rebuild(const LineStore& lines) {
+    m_isReset = true;
+    m_changes.clear();
+    m_block.reset();
+    Replace(0, 0, lines, 0, lines.Size());
+    Commit();
+}
+
+void TrigramIndex::Replace(size_t begin, size_t count, const LineStore& lines, size_t linesBegin, size_t linesCount) {
+    m_data.reset();
+
+    // The texts of all changes of a commit are copied into one block
+    if (!m_block) {
+        m_block = std::make_shared<TextBlock>();
+        m_block->offsets.push_back(0);
+    }
+    auto& block = *m_block;
+    size_t blockBegin = block.filtering.size();
+    block.offsets.reserve(block.offsets.size() + linesCount);
+    block.filtering.reserve(block.filtering.size() + linesCount);
+    for (size_t i=linesBegin; i!=linesBegin + linesCount; ++i) {
+        bool filtering = lines.IsFiltering(i);
+        if (filtering) {
+            std::string_view text(lines.GetMatchText(i));
+            if (block.texts.size() + text.size() > UINT32_MAX) {
+                throw ProxyError("too many lines data for the index, max size is 4GB");
+            }
+            block.texts.insert(block.texts.end(), text.begin(), text.end());
+        }
+        block.offsets.push_back(static_cast<uint32_t>(block.texts.size()));
+        block.filtering.push_back(filtering ? 1 : 0);
+    }
+    m_changes.push_back(Change{false, begin, count, m_block, blockBegin, linesCount});
+}
+
+void TrigramIndex::Move(size_t from, size_t to) {
+    m_data.reset();
+    m_changes.push_back(Change{true, from, to, nullptr, 0, 0});
+}
+
+void TrigramIndex::Commit() {
+    m_data.reset();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Changes of a job which is not taken yet are applied before the new ones
+        if ((!m_job) || m_isReset) {
+            m_job = std::make_unique<Job>();
+            m_job->isReset = m_isReset;
+        }
+        std::move(m_changes.begin(), m_changes.end(), std::back_inserter(m_job->changes));
+        m_job->generation = m_generation.load(std::memory_order_relaxed) + 1;
+        m_generation.store(m_job->generation, std::memory_order_relaxed);
+        m_result.reset();
+    }
+    m_wakeup.notify_one();
+
+    m_isReset = false;
+    m_changes.clear();
+    m_block.reset();
+}
+
+bool TrigramIndex::Update() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_result) {
+        return false;
+    }
+
+    m_data = std::move(m_result);
+    return true;
+}
+
+bool TrigramIndex::Filter(rofi_int_matcher_t** tokens, std::vector<FilterResult>& results) const {
+    const Data* data = m_data.get();
+    if ((data == nullptr) || (data->linesCount != results.size())) {
+        return false;
+    }
+
+    // Excluded tokens and tokens with alternation or quantifiers give no trigrams
+    std::vector<uint32_t> buckets;
+    std::vector<uint32_t> literalBuckets;
+    std::vector<std::string> literals;
+    for (auto it = tokens; (it != nullptr) && (*it != nullptr); ++it) {
+        literals.clear();
+        if (((*it)->invert == TRUE) || (!GetLiterals(g_regex_get_pattern((*it)->regex), literals))) {
+            continue;
+        }
+        // Without case a non-ASCII character can match another sequence of bytes
+        bool caseless = ((g_regex_get_compile_flags((*it)->regex) & G_REGEX_CASELESS) != 0);
+        for (const auto& literal: literals) {
+            GetBuckets(literal, caseless, literalBuckets);
+            buckets.insert(buckets.end(), literalBuckets.begin(), literalBuckets.end());
+        }
+    }
+    if (buckets.empty()) {
+        return false;
+    }
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+    // A row is either in the base or in the delta, replaced rows have no line
+    std::fill(results.begin(), results.end(), FilterResult::NotMatched);
+    auto markRows = [data, &results](const std::vector<uint32_t>& rows) {
+        for (auto row: rows) {
+            if (uint32_t line = data->lines[row]; line != NO_LINE) {
+                results[line] = FilterResult::Unknown;
+            }
+        }
+    };
+    std::vector<uint32_t> candidates;
+    for (const Postings* postings: {data->base.get(), &data->delta}) {
+        Intersect(*postings, buckets, candidates);
+        markRows(candidates);
+        markRows(postings->always);
+    }
+
+    return true;
+}
+
+size_t TrigramIndex::MemorySize() const {
+    size_t result = m_mirrorSize.load(std::memory_order_relaxed);
+    if (m_data) {
+        result += sizeof(Data) + m_data->base->MemorySize() + m_data->delta.MemorySize() + m_data->lines.capacity() * sizeof(uint32_t);
+    }
+    if (m_block) {
+        result += m_block->MemorySize();
+    }
+
+    return result + m_changes.capacity() * sizeof(Change);
+}
+
+std::pair<const uint32_t*, const uint32_t*> TrigramIndex::Postings::Get(uint32_t bucket) const {
+    size_t index = bucket;
+    if (!buckets.empty()) {
+        auto it = std::lower_bound(buckets.begin(), buckets.end(), bucket);
+        if ((it == buckets.end()) || (*it != bucket)) {
+            return {nullptr, nullptr};
+        }
+        index = static_cast<size_t>(it - buckets.begin());
+    } else if (index + 1 >= offsets.size()) {
+        return {nullptr, nullptr};
+    }
+
+    return {rows.data() + offsets[index], rows.data() + offsets[index + 1]};
+}
+
+size_t TrigramIndex::Postings::MemorySize() const {
+    return sizeof(Postings) + (buckets.capacity() + offsets.capacity() + rows.capacity() + always.capacity()) * sizeof(uint32_t);
+}
+
+void TrigramIndex::Intersect(const Postings& postings, const std::vector<uint32_t>& buckets, std::vector<uint32_t>& rows) {
+    rows.clear();
+    std::vector<std::pair<const uint32_t*, const uint32_t*>> lists;
+    lists.reserve(buckets.size());
+    for (auto bucket: buckets) {
+        auto list = postings.Get(bucket);
+        if (list.first == list.second) {
+            return;
+        }
+        lists.push_back(list);
+    }
+
+    // Intersect posting lists starting from the shortest one
+    std::sort(lists.begin(), lists.end(), [](const auto& lhs, const auto& rhs) {
+        return (lhs.second - lhs.first) < (rhs.second - rhs.first);
+    });
+    rows.assign(lists[0].first, lists[0].second);
+    std::vector<uint32_t> next;
+    for (size_t i=1; (i != lists.size()) && (!rows.empty()); ++i) {
+        next.clear();
+        std::set_intersection(rows.begin(), rows.end(), lists[i].first, lists[i].second, std::back_inserter(next));
+        std::swap(rows, next);
+    }
+}
+
+void TrigramIndex::BuildLoop() {
+    while (true) {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this]() { return m_stop || m_job; });
+            if (m_stop) {
+                return;
+            }
+            job = std::move(m_job);
+        }
+
+        ApplyChanges(*job);
+        auto data = Build(job->generation);
+        m_mirrorSize.store(GetMirrorSize(), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (data && (data->generation == m_generation.load(std::memory_order_relaxed))) {
+            m_result = std::move(data);
+        }
+    }
+}
+
+void TrigramIndex::ApplyChanges(Job& job) {
+    if (job.isReset) {
+        m_rows.clear();
+        m_blocks.clear();
+        m_order.clear();
+        m_base.reset();
+        m_baseRows = 0;
+        m_indexedRows = 0;
+        m_replacedRows = 0;
+        m_deltaKeys.clear();
+        m_deltaAlways.clear();
+        m_blocksTextSize = 0;
+        m_rowsTextSize = 0;
+    }
+
+    // Lines are moved in chunks, the order is flattened once for the job
+    ChunkedVector<uint32_t> order(m_order);
+    std::vector<uint32_t> added;
+    auto replaceRow = [this](uint32_t row) {
+        m_rowsTextSize -= m_rows[row].text.size();
+        ++m_replacedRows;
+    };
+    for (const auto& change: job.changes) {
+        if (change.isMove) {
+            order.Insert(change.count, order.Take(change.begin));
+            continue;
+        }
+
+        if (m_blocks.empty() || (m_blocks.back() != change.block)) {
+            m_blocks.push_back(change.block);
+            m_blocksTextSize += change.block->texts.size();
+        }
+        order.Erase(change.begin, change.count, replaceRow);
+        added.clear();
+        for (size_t i=change.linesBegin; i!=change.linesBegin + change.linesCount; ++i) {
+            added.push_back(AddRow(*change.block, i));
+        }
+        order.Insert(change.begin, added.begin(), added.end());
+    }
+    m_order = order.ToVector();
+}
+
+uint32_t TrigramIndex::AddRow(const TextBlock& block, size_t line) {
+    uint32_t first = block.offsets[line];
+    uint32_t last = block.offsets[line + 1];
+    auto row = static_cast<uint32_t>(m_rows.size());
+    m_rows.push_back(Row{std::string_view(block.texts.data() + first, last - first), block.filtering[line] != 0});
+    m_rowsTextSize += last - first;
+    return row;
+}
+
+std::unique_ptr<TrigramIndex::Data> TrigramIndex::Build(uint64_t generation) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    size_t deltaRows = m_rows.size() - m_baseRows;
+    bool isFull = (!m_base) || (m_rows.size() >= NO_LINE) || (m_replacedRows * REPLACED_ROWS_PART > m_rows.size()) ||
+        (deltaRows > std::max(MIN_DELTA_ROWS, m_order.size() / DELTA_LINES_PART));
+    if (isFull) {
+        if (!BuildBase(generation)) {
+            return nullptr;
+        }
+    } else {
+        AddDeltaRows();
+    }
+
+    auto data = std::make_unique<Data>();
+    data->generation = generation;
+    data->linesCount = m_order.size();
+    data->base = m_base;
+
+    // The delta is small, its postings are packed for the lookup of the buckets with postings
+    auto& delta = data->delta;
+    delta.rows.reserve(m_deltaKeys.size());
+    for (auto key: m_deltaKeys) {
+        auto bucket = static_cast<uint32_t>(key >> 32);
+        if (delta.buckets.empty() || (delta.buckets.back() != bucket)) {
+            delta.buckets.push_back(bucket);
+            delta.offsets.push_back(static_cast<uint32_t>(delta.rows.size()));
+        }
+        delta.rows.push_back(static_cast<uint32_t>(key));
+    }
+    delta.offsets.push_back(static_cast<uint32_t>(delta.rows.size()));
+    delta.always = m_deltaAlways;
+
+    data->lines.assign(m_rows.size(), NO_LINE);
+    for (size_t i=0; i!=m_order.size(); ++i) {
+        data->lines[m_order[i]] = static_cast<uint32_t>(i);
+    }
+
+    data->buildTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    return data;
+}
+
+bool TrigramIndex::BuildBase(uint64_t generation) {
+    // Rows become lines, the texts are copied into one block when most of the texts of blocks are replaced
+    std::vector<Row> rows;
+    rows.reserve(m_order.size());
+    for (auto row: m_order) {
+        rows.push_back(m_rows[row]);
+    }
+    m_rows = std::move(rows);
+    for (size_t i=0; i!=m_order.size(); ++i) {
+        m_order[i] = static_cast<uint32_t>(i);
+    }
+    if (m_rowsTextSize * 2 < m_blocksTextSize) {
+        auto block = std::make_shared<TextBlock>();
+        block->texts.reserve(m_rowsTextSize);
+        for (const auto& row: m_rows) {
+            block->texts.insert(block->texts.end(), row.text.begin(), row.text.end());
+        }
+        size_t offset = 0;
+        for (auto& row: m_rows) {
+            row.text = std::string_view(block->texts.data() + offset, row.text.size());
+            offset += row.text.size();
+        }
+        m_blocks.assign(1, std::move(block));
+        m_blocksTextSize = m_rowsTextSize;
+    }
+    m_base.reset();
+    m_baseRows = 0;
+    m_indexedRows = 0;
+    m_replacedRows = 0;
+    m_deltaKeys.clear();
+    m_deltaAlways.clear();
+
+    // Count postings of buckets, then place them with the counts as offsets
+    auto base = std::make_shared<Postings>();
+    std::vector<uint32_t> buckets;
+    base->offsets.assign(BUCKETS_COUNT + 1, 0);
+    for (size_t i=0; i!=m_rows.size(); ++i) {
+        if ((i % CANCEL_CHECK_LINES == 0) && (m_generation.load(std::memory_order_relaxed) != generation)) {
+            return false;
+        }
+        const auto& row = m_rows[i];
+        GetBuckets(row.text, false, buckets);
+        for (auto bucket: buckets) {
+            ++base->offsets[bucket + 1];
+        }
+        if ((!row.filtering) || HasCaselessAsciiVariant(row.text)) {
+            base->always.push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    size_t total = 0;
+    for (size_t bucket=0; bucket!=BUCKETS_COUNT; ++bucket) {
+        total += base->offsets[bucket + 1];
+        if (total > UINT32_MAX) {
+            return false;
+        }
+        base->offsets[bucket + 1] = static_cast<uint32_t>(total);
+    }
+
+    base->rows.resize(total);
+    std::vector<uint32_t> positions(base->offsets.begin(), base->offsets.end() - 1);
+    for (size_t i=0; i!=m_rows.size(); ++i) {
+        if ((i % CANCEL_CHECK_LINES == 0) && (m_generation.load(std::memory_order_relaxed) != generation)) {
+            return false;
+        }
+        GetBuckets(m_rows[i].text, false, buckets);
+        for (auto bucket: buckets) {
+            base->rows[positions[bucket]++] = static_cast<uint32_t>(i);
+        }
+    }
+
+    m_base = std::move(base);
+    m_baseRows = m_rows.size();
+    m_indexedRows = m_rows.size();
+    return true;
+}
+
+void TrigramIndex::AddDeltaRows() {
+    std::vector<uint32_t> buckets;
+    std::vector<uint64_t> keys;
+    for (size_t i=m_indexedRows; i!=m_rows.size(); ++i) {
+        const auto& row = m_rows[i];
+        GetBuckets(row.text, false, buckets);
+        for (auto bucket: buckets) {
+            keys.push_back((static_cast<uint64_t>(bucket) << 32) | i);
+        }
+        if ((!row.filtering) || HasCaselessAsciiVariant(row.text)) {
+            m_deltaAlways.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    m_indexedRows = m_rows.size();
+
+    std::sort(keys.begin(), keys.end());
+    auto middle = m_deltaKeys.insert(m_deltaKeys.end(), keys.begin(), keys.end());
+    std::inplace_merge(m_deltaKeys.begin(), middle, m_deltaKeys.end());
+}
+
+size_t TrigramIndex::GetMirrorSize() const {
+    size_t result = m_rows.capacity() * sizeof(Row) + m_order.capacity() * sizeof(uint32_t) +
+        m_blocks.capacity() * sizeof(m_blocks[0]) + m_deltaKeys.capacity() * sizeof(uint64_t) + m_deltaAlways.capacity() * sizeof(uint32_t);
+    for (const auto& block: m_blocks) {
+        result += block->MemorySize();
+    }
+
+    return result;
+}
+
+void TrigramIndex::GetBuckets(std::string_view text, bool skipNonAscii, std::vector<uint32_t>& buckets) {
+    buckets.clear();
+    for (size_t i=0; i + 2 < text.size(); ++i) {
+        auto ch0 = static_cast<unsigned char>(text[i]);
+        auto ch1 = static_cast<unsigned char>(text[i + 1]);
+        auto ch2 = static_cast<unsigned char>(text[i + 2]);
+        if (skipNonAscii && (((ch0 | ch1 | ch2) & 0x80) != 0)) {
+            continue;
+        }
+        // ASCII letters are indexed without case, the index only selects candidates
+        uint32_t key = ToLowerAscii(ch0) | (ToLowerAscii(ch1) << 8) | (ToLowerAscii(ch2) << 16);
+        buckets.push_back((key * 0x9E3779B1u) >> (32 - BUCKET_BITS));
+    }
+
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+}
+
+bool TrigramIndex::GetLiterals(std::string_view pattern, std::vector<std::string>& literals) {
+    // Escapes of one character class or an assertion, other letters and digits start escapes with arguments
+    static const char* SIMPLE_ESCAPES = "dDwWsSbBhHvVRNXnrtfeaAzZGK";
+
+    std::string literal;
+    auto finishLiteral = [&literal, &literals]() {
+        if (literal.size() >= MIN_LITERAL_SIZE) {
+            literals.push_back(literal);
+        }
+        literal.clear();
+    };
+
+    for (size_t i=0; i!=pattern.size();) {
+        char ch = pattern[i];
+        if (ch == '\\') {
+            if (i + 1 == pattern.size()) {
+                return false;
+            }
+            char escaped = pattern[i + 1];
+            i += 2;
+            if (isalnum(static_cast<unsigned char>(escaped)) == 0) {
+                literal.push_back(escaped);
+            } else if (strchr(SIMPLE_ESCAPES, escaped) != nullptr) {
+                finishLiteral();
+            } else {
+                return false;
+            }
+        } else if (ch == '.') {
+            // ".", ".*", ".*?"
+            finishLiteral();
+            ++i;
+            if ((i != pattern.size()) && (pattern[i] == '*')) {
+                ++i;
+                if ((i != pattern.size()) && (pattern[i] == '?')) {
+                    ++i;
+                }
+            }
+        } else if ((ch == '^') || (ch == '$')) {
+            finishLiteral();
+            ++i;
+        } else if (strchr("|?*+()[]{}", ch) != nullptr) {
+            return false;
+        } else {
+            literal.push_back(ch);
+            ++i;
+        }
+    }
+    finishLiteral();
+
+    return true;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <string_view>
+#include <condition_variable>
+
+#include "filter_cache.h"
+
+
+class LineStore;
+// Posting lists of the trigrams of the match text of lines. Literal runs of three or more characters
+// in the tokens of rofi select a small set of candidates, the other lines can not match.
+// Trigrams are hashed into buckets, a collision only adds candidates.
+// The index is built by its own thread. The main loop copies the match texts of the changed lines into
+// one block per commit, the thread keeps each line as a row which points into a block. Postings refer
+// to rows: a commit indexes only its new rows into a small delta and maps lines to rows again,
+// all postings are rebuilt when the delta or the replaced rows become a big part of the index.
+// Until the index is ready all lines are tested.
+// All methods are called from the main loop (Filter from FilterCache::StartPass).
+class TrigramIndex {
+public:
+    TrigramIndex();
+    ~TrigramIndex();
+
+    // Drop the index and start to build it for the new lines
+    void Rebuild(const LineStore& lines);
+    // Replace lines [begin, begin + count) with lines [linesBegin, linesBegin + linesCount) of the store,
+    // the changes are applied by Commit
+    void Replace(size_t begin, size_t count, const LineStore& lines, size_t linesBegin, size_t linesCount);
+    // The same as LineStore::Move
+    void Move(size_t from, size_t to);
+    // Send the changes since the last call to the build thread, the index is not used until it applies them
+    void Commit();
+    // Take the built index, returns true if it is taken
+    bool Update();
+    // Mark lines which can not match the tokens as NotMatched, returns false if the index
+    // is not ready or the tokens have no trigrams
+    bool Filter(rofi_int_matcher_t** tokens, std::vector<FilterResult>& results) const;
+
+    bool IsReady() const { return static_cast<bool>(m_data); }
+    size_t GetLinesCount() const { return m_data ? m_data->linesCount : 0; }
+    // Bytes of the index, the copy of the texts and the changes which are not applied yet
+    size_t MemorySize() const;
+    int64_t GetBuildTimeUs() const { return m_data ? m_data->buildTimeUs : 0; }
+
+private:
+    // Match texts of lines one after another, the text of line i is [offsets[i], offsets[i + 1]).
+    // Filled by the main loop, read by the build thread after the commit.
+    struct TextBlock {
+        std::vector<char> texts;
+        std::vector<uint32_t> offsets;
+        // Lines without filtering have an empty text
+        std::vector<uint8_t> filtering;
+
+        size_t MemorySize() const { return sizeof(TextBlock) + texts.capacity() + offsets.capacity() * sizeof(uint32_t) + filtering.capacity(); }
+    };
+
+    struct Change {
+        bool isMove;
+        size_t begin;
+        // Number of replaced lines or the new position of the moved line
+        size_t count;
+        // The new lines are [linesBegin, linesBegin + linesCount) of the block
+        std::shared_ptr<const TextBlock> block;
+        size_t linesBegin;
+        size_t linesCount;
+    };
+
+    struct Job {
+        uint64_t generation;
+        // The rows are cleared before the changes
+        bool isReset;
+        std::vector<Change> changes;
+    };
+
+    // Posting lists of buckets, rows of a list are sorted
+    struct Postings {
+        // Buckets with postings, empty if offsets are indexed by all buckets
+        std::vector<uint32_t> buckets;
+        // Postings of the bucket are [offsets[bucket], offsets[bucket + 1])
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> rows;
+        // Rows which are candidates for any tokens: not filtered lines and lines
+        // with characters which match ASCII letters without case
+        std::vector<uint32_t> always;
+
+        std::pair<const uint32_t*, const uint32_t*> Get(uint32_t bucket) const;
+        size_t MemorySize() const;
+    };
+
+    struct Data {
+        uint64_t generation;
+        size_t linesCount;
+        int64_t buildTimeUs;
+        // Rows of the last full build, shared by the next builds
+        std::shared_ptr<const Postings> base;
+        // Rows added after it
+        Postings delta;
+        // Line of each row, NO_LINE for replaced rows
+        std::vector<uint32_t> lines;
+    };
+
+    // Owned by the build thread, the text points into a block of m_blocks
+    struct Row {
+        std::string_view text;
+        bool filtering;
+    };
+
+    void BuildLoop();
+    // Called by the build thread
+    void ApplyChanges(Job& job);
+    uint32_t AddRow(const TextBlock& block, size_t line);
+    // Returns nullptr if a newer job is posted
+    std::unique_ptr<Data> Build(uint64_t generation);
+    // Rows are renumbered by lines and all postings are built, returns false if a newer job is posted
+    bool BuildBase(uint64_t generation);
+    void AddDeltaRows();
+    size_t GetMirrorSize() const;
+    // Rows of the candidates which have all buckets
+    static void Intersect(const Postings& postings, const std::vector<uint32_t>& buckets, std::vector<uint32_t>& rows);
+    // Sorted unique buckets of the trigrams of the text
+    static void GetBuckets(std::string_view text, bool skipNonAscii, std::vector<uint32_t>& buckets);
+    // Literal runs which every line matched by the pattern contains, returns false if the pattern is not
+    // a concatenation of literals and wildcards
+    static bool GetLiterals(std::string_view pattern, std::vector<std::string>& literals);
+
+private:
+    std::unique_ptr<Data> m_data;
+    // Changes which are not committed, the texts of their lines
+    bool m_isReset = false;
+    std::vector<Change> m_changes;
+    std::shared_ptr<TextBlock> m_block;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    // Changes which are not taken by the build thread yet
+    std::unique_ptr<Job> m_job;
+    std::unique_ptr<Data> m_result;
+    // Generation of the last posted job, older builds are dropped
+    std::atomic<uint64_t> m_generation = 0;
+
+    // Owned by the build thread
+    std::vector<Row> m_rows;
+    std::vector<std::shared_ptr<const TextBlock>> m_blocks;
+    // Row of each line
+    std::vector<uint32_t> m_order;
+    std::shared_ptr<const Postings> m_base;
+    // Rows [0, m_baseRows) are in the base postings, rows [m_baseRows, m_indexedRows) in the delta
+    size_t m_baseRows = 0;
+    size_t m_indexedRows = 0;
+    size_t m_replacedRows = 0;
+    // Sorted (bucket << 32 | row) of the delta rows
+    std::vector<uint64_t> m_deltaKeys;
+    std::vector<uint32_t> m_deltaAlways;
+    // Bytes of the texts of all blocks and of the rows
+    size_t m_blocksTextSize = 0;
+    size_t m_rowsTextSize = 0;
+    // Memory of the rows, blocks and delta keys, written by the build thread
+    std::atomic<size_t> m_mirrorSize = 0;
+};
@@ -0,0 +1,121 @@
+#include "virtual_lines.h"
+
+#include <algorithm>
+
+
+VirtualLines::VirtualLines(size_t count, size_t maxLines)
+    : m_count(count)
+    // The window of a request and the shown lines must fit
+    , m_maxPages(std::max(maxLines / PAGE_SIZE, 4 * READ_AHEAD_PAGES + 2)) {
+
+}
+
+size_t VirtualLines::MemorySize() const {
+    size_t result = 0;
+    for (const auto& [pageIndex, page]: m_pages) {
+        result += page.lines.MemorySize();
+    }
+
+    return result;
+}
+
+LineStore* VirtualLines::Find(size_t index, size_t& position) {
+    auto it = m_pages.find(index / PAGE_SIZE);
+    if (it == m_pages.end()) {
+        return nullptr;
+    }
+
+    Page& page = it->second;
+    position = index % PAGE_SIZE;
+    if ((page.received & (uint64_t(1) << position)) == 0) {
+        return nullptr;
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, page.lruIt);
+    return &page.lines;
+}
+
+void VirtualLines::SetLines(size_t offset, const LineStore& lines) {
+    for (size_t i=0; (i != lines.Size()) && (offset + i < m_count); ++i) {
+        size_t index = offset + i;
+        size_t pageIndex = index / PAGE_SIZE;
+        size_t position = index % PAGE_SIZE;
+        Page& page = GetPage(pageIndex);
+        page.lines.Update(position, lines.Get(i));
+        page.received |= uint64_t(1) << position;
+        m_requested.erase(pageIndex);
+    }
+
+    DropOldPages();
+}
+
+bool VirtualLines::GetMissingWindow(size_t index, int64_t now, size_t& offset, size_t& count) {
+    if (index >= m_count) {
+        return false;
+    }
+
+    size_t pageIndex = index / PAGE_SIZE;
+    if (IsRequested(pageIndex, now) || IsComplete(pageIndex)) {
+        return false;
+    }
+
+    // Read-ahead in both directions, pages at the edges which are already here are not requested again
+    size_t first = (pageIndex > READ_AHEAD_PAGES) ? pageIndex - READ_AHEAD_PAGES : 0;
+    size_t last = std::min(pageIndex + READ_AHEAD_PAGES, (m_count - 1) / PAGE_SIZE);
+    while ((first != pageIndex) && (IsRequested(first, now) || IsComplete(first))) {
+        ++first;
+    }
+    while ((last != pageIndex) && (IsRequested(last, now) || IsComplete(last))) {
+        --last;
+    }
+
+    for (size_t it=first; it<=last; ++it) {
+        m_requested[it] = now;
+    }
+    offset = first * PAGE_SIZE;
+    count = std::min((last + 1) * PAGE_SIZE, m_count) - offset;
+
+    return true;
+}
+
+VirtualLines::Page& VirtualLines::GetPage(size_t pageIndex) {
+    auto [it, isNew] = m_pages.try_emplace(pageIndex);
+    Page& page = it->second;
+    if (isNew) {
+        size_t size = std::min(PAGE_SIZE, m_count - pageIndex * PAGE_SIZE);
+        page.lines.Reserve(size);
+        for (size_t i=0; i!=size; ++i) {
+            page.lines.Add(Line());
+        }
+        m_lru.push_front(pageIndex);
+        page.lruIt = m_lru.begin();
+    } else {
+        m_lru.splice(m_lru.begin(), m_lru, page.lruIt);
+    }
+
+    return page;
+}
+
+bool VirtualLines::IsComplete(size_t pageIndex) const {
+    auto it = m_pages.find(pageIndex);
+    return (it != m_pages.end()) && (it->second.received == GetFullMask(pageIndex));
+}
+
+bool VirtualLines::IsRequested(size_t pageIndex, int64_t now) const {
+    auto it = m_requested.find(pageIndex);
+    return (it != m_requested.end()) && (now - it->second < REQUEST_TIMEOUT_US);
+}
+
+uint64_t VirtualLines::GetFullMask(size_t pageIndex) const {
+    size_t size = std::min(PAGE_SIZE, m_count - pageIndex * PAGE_SIZE);
+    return (size == PAGE_SIZE) ? UINT64_MAX : ((uint64_t(1) << size) - 1);
+}
+
+void VirtualLines::DropOldPages() {
+    while (m_pages.size() > m_maxPages) {
+        // A dropped page is requested again when it is shown
+        m_requested.erase(m_lru.back());
+        m_pages.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
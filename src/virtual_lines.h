@@ -0,0 +1,61 @@
+#pragma once
+
+#include <list>
+#include <cstdint>
+#include <unordered_map>
+
+#include "line_store.h"
+
+
+// Lines of a list whose size is declared by the application ("virtual_count"), the lines themselves
+// are requested by windows around the shown ones ("fetch_lines") and received on demand ("lines_window").
+// Lines are kept in pages, the least recently used pages are dropped above the limit,
+// so memory depends on the part of the list the user scrolled through, not on its size.
+class VirtualLines {
+public:
+    VirtualLines() = delete;
+    VirtualLines(size_t count, size_t maxLines);
+    ~VirtualLines() = default;
+
+    size_t Size() const { return m_count; }
+    size_t GetKeptLinesCount() const { return m_pages.size() * PAGE_SIZE; }
+    size_t MemorySize() const;
+
+    // Page with the line and the position of the line in the page, nullptr if the line was not received
+    LineStore* Find(size_t index, size_t& position);
+    // Lines [offset, offset + lines.Size()) are received, lines after the end of the list are ignored.
+    // The requests of the pages are answered, pages which are still incomplete are requested again when shown.
+    void SetLines(size_t offset, const LineStore& lines);
+    // The window of pages around the line which are neither received nor requested, they are marked
+    // as requested at the time "now" (us). Returns false if the line is received or requested already.
+    // A request without an answer expires after REQUEST_TIMEOUT_US, the pages are requested again.
+    bool GetMissingWindow(size_t index, int64_t now, size_t& offset, size_t& count);
+
+private:
+    static constexpr size_t PAGE_SIZE = 64;
+    // Pages requested before and after the page of the missing line
+    static constexpr size_t READ_AHEAD_PAGES = 2;
+    static constexpr int64_t REQUEST_TIMEOUT_US = 2 * 1000 * 1000;
+
+    struct Page {
+        LineStore lines;
+        // Bit per received line
+        uint64_t received = 0;
+        std::list<size_t>::iterator lruIt;
+    };
+
+    Page& GetPage(size_t pageIndex);
+    bool IsComplete(size_t pageIndex) const;
+    bool IsRequested(size_t pageIndex, int64_t now) const;
+    uint64_t GetFullMask(size_t pageIndex) const;
+    void DropOldPages();
+
+private:
+    size_t m_count = 0;
+    size_t m_maxPages = 0;
+    std::unordered_map<size_t, Page> m_pages;
+    // Page indexes, the most recently used first
+    std::list<size_t> m_lru;
+    // Time of the request by page index
+    std::unordered_map<size_t, int64_t> m_requested;
+};
@@ -0,0 +1,439 @@
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <rofi/helper.h>
+
+#include "fuzzy_rank.h"
+#include "line_store.h"
+#include "spsc_queue.h"
+#include "line_filter.h"
+#include "filter_cache.h"
+#include "trigram_index.h"
+
+
+// Filters lines from several threads the way rofi does, with lines replaced between the passes,
+// and compares the results of MatchLine (Proxy::OnLineMatch) with a brute-force scan of the lines.
+namespace {
+
+static constexpr size_t LINES_COUNT = 50000;
+static constexpr size_t CYCLES_COUNT = 4;
+static constexpr size_t FILTER_THREADS = 4;
+static constexpr size_t PATCH_SIZE = 1000;
+// The index is committed several times per patch, like after a partially applied lines_patch
+static constexpr size_t PATCH_COMMIT_ITEMS = 300;
+static constexpr size_t FUZZY_TOP = 100;
+static constexpr auto INDEX_TIMEOUT = std::chrono::seconds(30);
+
+// Inputs of one cycle: typing (narrowing), the same input, deleting, excluded words,
+// rare words (the ranked lines have different fuzzy scores)
+static const char* INPUTS[] = {
+    "a", "ap", "app", "appl", "apple", "apple", "apple b", "apple ba", "ap", "-ap", "-app",
+    "zap 1", "zap 12", "pe 19", "aa 199", "ZAP", "Grape", "a.p", "xyz", "map -band", "",
+};
+
+static const char* WORDS[] = {
+    "apple", "Application", "apply", "banana", "band", "zap", "pineapple", "grape", "map", "a.p",
+};
+
+// Tokens as rofi builds them for the "normal" matching method: a word per token, "-word" excludes lines
+class Tokens {
+public:
+    explicit Tokens(const std::string& input) {
+        for (size_t begin = 0; begin < input.size();) {
+            size_t end = std::min(input.find(' ', begin), input.size());
+            if (end != begin) {
+                std::string word = input.substr(begin, end - begin);
+                bool invert = (word.size() > 1) && (word[0] == '-');
+                gchar* pattern = g_regex_escape_string(word.c_str() + (invert ? 1 : 0), -1);
+                GRegex* regex = g_regex_new(pattern, G_REGEX_CASELESS, GRegexMatchFlags(0), nullptr);
+                g_free(pattern);
+                m_matchers.push_back(rofi_int_matcher_t{regex, invert ? TRUE : FALSE});
+            }
+            begin = end + 1;
+        }
+        for (auto& matcher: m_matchers) {
+            m_tokens.push_back(&matcher);
+        }
+        m_tokens.push_back(nullptr);
+    }
+
+    ~Tokens() {
+        for (auto& matcher: m_matchers) {
+            g_regex_unref(matcher.regex);
+        }
+    }
+
+    rofi_int_matcher_t** Get() { return m_tokens.data(); }
+
+private:
+    std::vector<rofi_int_matcher_t> m_matchers;
+    std::vector<rofi_int_matcher_t*> m_tokens;
+};
+
+// The same as helper_token_match of rofi
+static bool TokenMatch(rofi_int_matcher_t** tokens, const char* text) {
+    for (auto it = tokens; *it != nullptr; ++it) {
+        bool isMatch = (g_regex_match((*it)->regex, text, GRegexMatchFlags(0), nullptr) == TRUE);
+        if (isMatch == ((*it)->invert == TRUE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+class Matcher : public FilterCacheHandler {
+public:
+    bool OnMatchLine(rofi_int_matcher_t** tokens, size_t index) override {
+        return (!m_lines.IsFiltering(index)) || TokenMatch(tokens, m_lines.GetMatchText(index));
+    }
+
+    // The steps of Proxy::OnInput before rofi filters lines
+    void StartPass(const char* input) {
+        if (m_index != nullptr) {
+            m_index->Update();
+        }
+        if (m_isVirtual) {
+            return;
+        }
+        if (m_ranker.IsEnabled()) {
+            m_ranker.Rank(input, m_lines);
+        }
+        if (!m_ranker.IsActive()) {
+            // Proxy::OnInput and rofi tokenize the input separately
+            m_filterCache.StartPass(Tokens(input).Get(), m_lines.Size());
+        }
+    }
+
+    bool OnLineMatch(rofi_int_matcher_t** tokens, size_t index) {
+        return MatchLine(tokens, index, m_isVirtual, m_lines, m_ranker, m_filterCache, *this);
+    }
+
+    // Proxy::GetLinesCount
+    size_t GetPositionsCount() const {
+        return m_ranker.IsActive() ? m_ranker.GetRankedCount() : m_lines.Size();
+    }
+
+    // The expected result of OnLineMatch
+    bool IsShown(const char* input, rofi_int_matcher_t** tokens, size_t index) const {
+        if (m_isVirtual) {
+            return true;
+        }
+        if (!m_ranker.IsActive()) {
+            return (!m_lines.IsFiltering(index)) || TokenMatch(tokens, m_lines.GetMatchText(index));
+        }
+        if (index >= m_ranker.GetRankedCount()) {
+            return false;
+        }
+
+        // A ranked line contains the characters of every word, the lines are in the order of the score
+        int32_t score = GetScore(input, m_ranker.GetLine(index));
+        if (score < 0) {
+            return false;
+        }
+        return (index == 0) || (!m_lines.IsFiltering(m_ranker.GetLine(index - 1))) || (GetScore(input, m_ranker.GetLine(index - 1)) >= score);
+    }
+
+    void ReplaceLines(LineStore&& lines) {
+        m_lines = std::move(lines);
+        m_filterCache.Reset();
+        m_ranker.Clear();
+    }
+
+    // Changes lines the way Proxy::ApplyLinesPatch does, the same changes are sent to the index.
+    // Returns the number of lines which differ from the changes applied one by one.
+    size_t PatchLines(std::mt19937& rng, const LineStore& patchLines, TrigramIndex& index) {
+        std::vector<std::string> expected;
+        for (size_t i=0; i!=m_lines.Size(); ++i) {
+            expected.push_back(m_lines.GetText(i));
+        }
+
+        LineStorePatch lines(m_lines, 0, m_lines.Size(), patchLines);
+        for (size_t i=0; i!=patchLines.Size(); ++i) {
+            size_t pos = rng() % lines.Size();
+            switch (i % 4) {
+            case 0:
+                lines.Insert(pos, i);
+                index.Replace(pos, 0, patchLines, i, 1);
+                expected.insert(expected.begin() + static_cast<ptrdiff_t>(pos), patchLines.GetText(i));
+                break;
+            case 1:
+                lines.Remove(pos);
+                index.Replace(pos, 1, patchLines, 0, 0);
+                expected.erase(expected.begin() + static_cast<ptrdiff_t>(pos));
+                break;
+            case 2:
+                lines.Update(pos, i, false);
+                index.Replace(pos, 1, patchLines, i, 1);
+                expected[pos] = patchLines.GetText(i);
+                break;
+            default: {
+                size_t to = rng() % lines.Size();
+                lines.Move(pos, to);
+                index.Move(pos, to);
+                auto text = std::move(expected[pos]);
+                expected.erase(expected.begin() + static_cast<ptrdiff_t>(pos));
+                expected.insert(expected.begin() + static_cast<ptrdiff_t>(to), std::move(text));
+                break;
+            }
+            }
+            if (i % PATCH_COMMIT_ITEMS == PATCH_COMMIT_ITEMS - 1) {
+                index.Commit();
+            }
+        }
+        m_lines.ApplyPatch(lines);
+        index.Commit();
+        m_filterCache.Reset();
+        m_ranker.Clear();
+
+        size_t errors = (m_lines.Size() != expected.size()) ? 1 : 0;
+        for (size_t i=0; (errors == 0) && (i != expected.size()); ++i) {
+            if (expected[i] != m_lines.GetText(i)) {
+                printf("  patched line %zu \"%s\": expected \"%s\"\n", i, m_lines.GetText(i), expected[i].c_str());
+                ++errors;
+            }
+        }
+        return errors;
+    }
+
+    void SetIndex(TrigramIndex* index) {
+        m_index = index;
+        m_filterCache.SetIndex(index);
+    }
+    void SetVirtual(bool isVirtual) { m_isVirtual = isVirtual; }
+
+    LineStore& GetLines() { return m_lines; }
+    FilterCache& GetFilterCache() { return m_filterCache; }
+    FuzzyRanker& GetRanker() { return m_ranker; }
+
+private:
+    // Sum of the scores of the words, negative if a word does not match, 0 for a line without filtering
+    int32_t GetScore(std::string_view input, size_t line) const {
+        int32_t result = 0;
+        for (size_t begin = 0; m_lines.IsFiltering(line) && (begin < input.size());) {
+            size_t end = std::min(input.find(' ', begin), input.size());
+            if (end != begin) {
+                int32_t score = FuzzyRanker::Score(input.substr(begin, end - begin), m_lines.GetMatchText(line));
+                if (score < 0) {
+                    return -1;
+                }
+                result += score;
+            }
+            begin = end + 1;
+        }
+        return result;
+    }
+
+    LineStore m_lines;
+    FilterCache m_filterCache;
+    FuzzyRanker m_ranker;
+    TrigramIndex* m_index = nullptr;
+    bool m_isVirtual = false;
+};
+
+static LineStore CreateLines(std::mt19937& rng, size_t count) {
+    constexpr size_t wordsCount = sizeof(WORDS) / sizeof(WORDS[0]);
+    std::vector<std::string> texts;
+    texts.reserve(count);
+    for (size_t i=0; i!=count; ++i) {
+        texts.push_back(std::string(WORDS[rng() % wordsCount]) + " " + WORDS[rng() % wordsCount] + std::to_string(rng() % 200));
+    }
+
+    LineStore lines;
+    lines.Reserve(count);
+    for (size_t i=0; i!=count; ++i) {
+        Line line;
+        line.text = texts[i];
+        line.filtering = (i % 50 != 0);
+        lines.Add(line);
+    }
+
+    return lines;
+}
+
+// The reader thread parses the next patch while rofi filters lines, the main loop applies it
+// only after the pass, like the requests of Proxy::OnReadLine
+class PatchReader {
+public:
+    PatchReader() : m_queue(1) {}
+    ~PatchReader() { Join(); }
+
+    void Start(uint32_t seed) {
+        m_thread = std::thread([this, seed]() {
+            std::mt19937 rng(seed);
+            auto patch = std::make_unique<LineStore>(CreateLines(rng, PATCH_SIZE));
+            while (!m_queue.Push(std::move(patch))) {
+                std::this_thread::yield();
+            }
+        });
+    }
+
+    // Called by the main loop between the passes
+    std::unique_ptr<LineStore> Take() {
+        std::unique_ptr<LineStore> patch;
+        m_queue.Pop(patch);
+        return patch;
+    }
+
+    void Join() {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+private:
+    SpscQueue<std::unique_ptr<LineStore>> m_queue;
+    std::thread m_thread;
+};
+
+// Filters "count" positions, returns the number of positions with a wrong result
+static size_t FilterPositions(Matcher& matcher, const char* input, size_t count) {
+    Tokens tokens(input);
+
+    // Neighbouring lines are tested by different threads
+    std::vector<uint8_t> results(count);
+    std::vector<std::thread> threads;
+    for (size_t threadIndex=0; threadIndex!=FILTER_THREADS; ++threadIndex) {
+        threads.emplace_back([&matcher, &tokens, &results, threadIndex, count]() {
+            for (size_t i=threadIndex; i<count; i+=FILTER_THREADS) {
+                results[i] = matcher.OnLineMatch(tokens.Get(), i) ? 1 : 0;
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    size_t errors = 0;
+    const LineStore& lines = matcher.GetLines();
+    for (size_t i=0; i!=count; ++i) {
+        bool expected = matcher.IsShown(input, tokens.Get(), i);
+        if (expected != (results[i] != 0)) {
+            if (errors == 0) {
+                printf("  input \"%s\", line %zu \"%s\": expected %d\n", input, i, lines.GetText(i), expected ? 1 : 0);
+            }
+            ++errors;
+        }
+    }
+
+    return errors;
+}
+
+// Returns the number of lines with a wrong result
+static size_t FilterLines(Matcher& matcher, const char* input) {
+    // Rofi filters the positions counted on the last reload, Proxy::RankLines reloads the view if the count changes
+    size_t count = matcher.GetPositionsCount();
+    matcher.StartPass(input);
+    size_t errors = FilterPositions(matcher, input, count);
+    if (matcher.GetPositionsCount() != count) {
+        matcher.StartPass(input);
+        errors += FilterPositions(matcher, input, matcher.GetPositionsCount());
+    }
+
+    return errors;
+}
+
+enum class Mode {
+    Plain,
+    Precompute,
+    Index,
+    IndexPatch,
+    // Patches are read while rofi filters lines, the index is built during the passes
+    Concurrent,
+    Fuzzy,
+    Virtual,
+};
+
+static size_t Run(Mode mode, const char* name) {
+    std::mt19937 rng(42);
+    Matcher matcher;
+    TrigramIndex index;
+    PatchReader reader;
+    bool isPatched = (mode == Mode::IndexPatch) || (mode == Mode::Concurrent);
+    bool useIndex = (mode == Mode::Index) || isPatched;
+    if (mode == Mode::Precompute) {
+        matcher.GetFilterCache().EnablePrecompute(&matcher, FILTER_THREADS);
+    }
+    if (mode == Mode::Fuzzy) {
+        matcher.GetRanker().SetLimit(FUZZY_TOP);
+    }
+    matcher.SetVirtual(mode == Mode::Virtual);
+
+    size_t errors = 0;
+    std::unique_ptr<LineStore> patch;
+    for (size_t cycle=0; cycle!=CYCLES_COUNT; ++cycle) {
+        if (isPatched && (cycle != 0)) {
+            if (mode == Mode::Concurrent) {
+                reader.Join();
+                if (!patch) {
+                    patch = reader.Take();
+                }
+            } else {
+                patch = std::make_unique<LineStore>(CreateLines(rng, PATCH_SIZE));
+            }
+            errors += matcher.PatchLines(rng, *patch, index);
+            patch.reset();
+        } else {
+            // The sizes differ, so the results of the previous lines can't be reused by mistake
+            matcher.ReplaceLines(CreateLines(rng, LINES_COUNT - cycle * 1000));
+            if (useIndex) {
+                index.Rebuild(matcher.GetLines());
+            }
+        }
+        // With concurrent updates the passes take the index when it is ready
+        if (useIndex && (mode != Mode::Concurrent)) {
+            auto deadline = std::chrono::steady_clock::now() + INDEX_TIMEOUT;
+            while (!index.Update()) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    printf("  the index is not built\n");
+                    return errors + 1;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        if (useIndex) {
+            matcher.SetIndex(&index);
+        }
+
+        if (mode == Mode::Concurrent) {
+            reader.Start(static_cast<uint32_t>(rng()));
+        }
+        for (auto input: INPUTS) {
+            errors += FilterLines(matcher, input);
+            // The patch read during the passes is held until all inputs of the cycle are filtered
+            if ((mode == Mode::Concurrent) && (!patch)) {
+                patch = reader.Take();
+            }
+        }
+    }
+
+    printf("%-12s %s\n", name, (errors == 0) ? "ok" : "FAILED");
+    return errors;
+}
+
+}
+
+int main() {
+    size_t errors = 0;
+    errors += Run(Mode::Plain, "plain");
+    errors += Run(Mode::Precompute, "precompute");
+    errors += Run(Mode::Index, "index");
+    errors += Run(Mode::IndexPatch, "index patch");
+    errors += Run(Mode::Concurrent, "concurrent");
+    errors += Run(Mode::Fuzzy, "fuzzy");
+    errors += Run(Mode::Virtual, "virtual");
+
+    return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}